@@ -0,0 +1,411 @@
+#include "catalog.h"
+#include <json/json.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#define LOG_SUFFIX ".log"
+// fold the log into the snapshot once it has more records than this and
+// than the snapshot has sets
+#define COMPACT_MIN_RECORDS 1000
+
+static std::string vm_type_key(const std::string& vm_uuid, const std::string& type)
+{
+    return vm_uuid + "/" + type;
+}
+
+static Json::Value set_to_json(const struct backup_set& b)
+{
+    Json::Value s;
+    s["set_id"] = b.vm_name;
+    s["type"] = b.type;
+    s["vm_uuid"] = b.vm_uuid;
+    s["date"] = b.date;
+    if (!b.parent.empty())
+        s["parent"] = b.parent;
+    if (b.synthetic)
+        s["synthetic"] = true;
+    return s;
+}
+
+static struct backup_set set_from_json(const Json::Value& s)
+{
+    struct backup_set b;
+    b.vm_name = s["set_id"].asString();
+    b.vm_uuid = s["vm_uuid"].asString();
+    b.date = s["date"].asString();
+    b.type = s["type"].asString();
+    b.parent = s["parent"].asString();
+    b.synthetic = s.get("synthetic", false).asBool();
+    return b;
+}
+
+static std::string to_line(const Json::Value& v)
+{
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "";
+    return Json::writeString(builder, v) + "\n";
+}
+
+Catalog::Catalog(const std::string& file)
+    : file_(file), log_file_(file + LOG_SUFFIX)
+{
+    log_fd_ = ::open(log_file_.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (log_fd_ < 0) {
+        std::cout << "Failed to open catalog log " << log_file_ << std::endl;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    reload();
+}
+
+Catalog::~Catalog()
+{
+    if (log_fd_ >= 0)
+        ::close(log_fd_);
+}
+
+std::shared_ptr<Catalog> Catalog::get(const std::string& file)
+{
+    static std::mutex catalogs_mutex;
+    static std::map<std::string, std::shared_ptr<Catalog>> catalogs;
+
+    std::lock_guard<std::mutex> lock(catalogs_mutex);
+    auto& c = catalogs[file];
+    if (!c)
+        c = std::make_shared<Catalog>(file);
+
+    return c;
+}
+
+void Catalog::index(const struct backup_set& bset)
+{
+    unindex(bset.vm_name);
+    by_id_[bset.vm_name] = bset;
+    by_date_.emplace(bset.date, bset.vm_name);
+    by_vm_[bset.vm_uuid].emplace(bset.date, bset.vm_name);
+    by_vm_type_[vm_type_key(bset.vm_uuid, bset.type)].emplace(bset.date, bset.vm_name);
+}
+
+static void erase_value(std::multimap<std::string, std::string>& m,
+                        const std::string& date, const std::string& set_id)
+{
+    auto range = m.equal_range(date);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (it->second == set_id) {
+            m.erase(it);
+            return;
+        }
+    }
+}
+
+void Catalog::unindex(const std::string& set_id)
+{
+    auto it = by_id_.find(set_id);
+    if (it == by_id_.end())
+        return;
+
+    const struct backup_set& b = it->second;
+    erase_value(by_date_, b.date, set_id);
+    erase_value(by_vm_[b.vm_uuid], b.date, set_id);
+    erase_value(by_vm_type_[vm_type_key(b.vm_uuid, b.type)], b.date, set_id);
+    by_id_.erase(it);
+}
+
+void Catalog::apply(const std::string& line)
+{
+    Json::CharReaderBuilder reader;
+    Json::Value v;
+    JSONCPP_STRING errs;
+    std::istringstream in(line);
+    if (!Json::parseFromStream(reader, in, &v, &errs)) {
+        std::cout << "Skip bad catalog record: " << line << std::endl;
+        return;
+    }
+
+    const std::string op = v["op"].asString();
+    if (op == "add")
+        index(set_from_json(v));
+    else if (op == "rm")
+        unindex(v["set_id"].asString());
+
+    log_records_++;
+}
+
+void Catalog::reload()
+{
+    by_id_.clear();
+    by_date_.clear();
+    by_vm_.clear();
+    by_vm_type_.clear();
+    snapshot_ino_ = 0;
+    snapshot_mtime_ = 0;
+    log_offset_ = 0;
+    log_records_ = 0;
+    ok_ = true;
+
+    struct stat st;
+    if (stat(file_.c_str(), &st) == 0) {
+        snapshot_ino_ = st.st_ino;
+        snapshot_mtime_ = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+
+        std::ifstream input_file(file_);
+        Json::CharReaderBuilder reader;
+        Json::Value root;
+        JSONCPP_STRING errs;
+        if (!Json::parseFromStream(reader, input_file, &root, &errs)) {
+            // never compact over a catalog we could not read
+            std::cout << "Failed to load catalog " << file_ << ", err: " << errs << std::endl;
+            ok_ = false;
+        }
+
+        for (const auto& s : root["sets"])
+            index(set_from_json(s));
+    }
+
+    refresh();
+}
+
+void Catalog::refresh()
+{
+    struct stat st;
+    const bool exists = stat(file_.c_str(), &st) == 0;
+    const int64_t mtime = exists ? st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec : 0;
+    if ((exists ? st.st_ino : 0) != snapshot_ino_ || mtime != snapshot_mtime_) {
+        // compacted by another process
+        reload();
+        return;
+    }
+
+    if (log_fd_ < 0 || fstat(log_fd_, &st) != 0)
+        return;
+
+    if (st.st_size < log_offset_) {
+        reload();
+        return;
+    }
+
+    if (st.st_size == log_offset_)
+        return;
+
+    std::string tail(st.st_size - log_offset_, '\0');
+    const ssize_t n = pread(log_fd_, &tail[0], tail.size(), log_offset_);
+    if (n <= 0)
+        return;
+    tail.resize(n);
+
+    // only whole lines, a torn last line is a crashed append
+    size_t start = 0;
+    for (size_t end = tail.find('\n'); end != std::string::npos; end = tail.find('\n', start)) {
+        apply(tail.substr(start, end - start));
+        start = end + 1;
+    }
+    log_offset_ += start;
+}
+
+bool Catalog::append(const std::string& line)
+{
+    if (!ok_ || log_fd_ < 0) {
+        std::cout << "Catalog " << file_ << " is not writable" << std::endl;
+        return false;
+    }
+
+    if (flock(log_fd_, LOCK_EX) != 0) {
+        std::cout << "Failed to lock catalog log " << log_file_ << std::endl;
+        return false;
+    }
+
+    refresh();
+
+    // cut a torn line left by a crash, nobody else writes while we hold the lock
+    struct stat st;
+    if (fstat(log_fd_, &st) == 0 && st.st_size > log_offset_ && ftruncate(log_fd_, log_offset_) != 0)
+        std::cout << "Failed to truncate catalog log " << log_file_ << std::endl;
+
+    bool ok = write(log_fd_, line.data(), line.size()) == (ssize_t)line.size()
+              && fdatasync(log_fd_) == 0;
+    if (ok) {
+        apply(line.substr(0, line.size() - 1));
+        log_offset_ += line.size();
+
+        if (log_records_ > COMPACT_MIN_RECORDS && log_records_ > by_id_.size())
+            compact();
+    } else {
+        std::cout << "Failed to append to catalog log " << log_file_ << std::endl;
+    }
+
+    flock(log_fd_, LOCK_UN);
+    return ok;
+}
+
+bool Catalog::compact()
+{
+    Json::Value root;
+    Json::Value sets(Json::arrayValue);
+    for (const auto& d : by_date_)
+        sets.append(set_to_json(by_id_[d.second]));
+    root["sets"] = sets;
+
+    const std::string tmp = file_ + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::trunc);
+        out << root;
+        out.close();
+        if (out.fail()) {
+            std::cout << "Failed to write " << tmp << std::endl;
+            return false;
+        }
+    }
+
+    const int fd = ::open(tmp.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        ::close(fd);
+    }
+
+    if (rename(tmp.c_str(), file_.c_str()) != 0) {
+        std::cout << "Failed to rename " << tmp << std::endl;
+        return false;
+    }
+
+    // replaying the log over the new snapshot is harmless, so a crash
+    // before the truncate loses nothing
+    if (ftruncate(log_fd_, 0) != 0) {
+        std::cout << "Failed to truncate catalog log " << log_file_ << std::endl;
+        return false;
+    }
+
+    struct stat st;
+    if (stat(file_.c_str(), &st) == 0) {
+        snapshot_ino_ = st.st_ino;
+        snapshot_mtime_ = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    }
+    log_offset_ = 0;
+    log_records_ = 0;
+    return true;
+}
+
+bool Catalog::add(const struct backup_set& bset)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    Json::Value v = set_to_json(bset);
+    v["op"] = "add";
+    return append(to_line(v));
+}
+
+bool Catalog::remove(const std::string& set_id)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    Json::Value v;
+    v["op"] = "rm";
+    v["set_id"] = set_id;
+    return append(to_line(v));
+}
+
+bool Catalog::find(const std::string& set_id, struct backup_set& bset)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    refresh();
+    auto it = by_id_.find(set_id);
+    if (it == by_id_.end())
+        return false;
+
+    bset = it->second;
+    return true;
+}
+
+bool Catalog::latest(const std::string& vm_uuid, const std::string& type, struct backup_set& bset)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    refresh();
+    auto it = by_vm_type_.find(vm_type_key(vm_uuid, type));
+    if (it == by_vm_type_.end() || it->second.empty())
+        return false;
+
+    bset = by_id_[it->second.rbegin()->second];
+    return true;
+}
+
+bool Catalog::latest_of(const std::string& vm_uuid, const std::vector<std::string>& types,
+                        struct backup_set& bset)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    refresh();
+    auto it = by_vm_.find(vm_uuid);
+    if (it == by_vm_.end())
+        return false;
+
+    for (auto d = it->second.rbegin(); d != it->second.rend(); ++d) {
+        const struct backup_set& b = by_id_[d->second];
+        if (std::find(types.begin(), types.end(), b.type) != types.end()) {
+            bset = b;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool Catalog::chain(const std::string& set_id, std::vector<struct backup_set>& bsets)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    refresh();
+    std::vector<struct backup_set> sets;
+    std::string id = set_id;
+    while (!id.empty()) {
+        auto it = by_id_.find(id);
+        if (it == by_id_.end() || sets.size() > by_id_.size()) {
+            std::cout << "Broken backup chain at " << id << std::endl;
+            return false;
+        }
+
+        sets.push_back(it->second);
+        id = it->second.parent;
+    }
+
+    bsets.assign(sets.rbegin(), sets.rend());
+    return true;
+}
+
+bool Catalog::has_children(const std::string& set_id)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    refresh();
+    auto it = by_id_.find(set_id);
+    if (it == by_id_.end())
+        return false;
+
+    for (const auto& d : by_vm_[it->second.vm_uuid]) {
+        if (by_id_[d.second].parent == set_id)
+            return true;
+    }
+
+    return false;
+}
+
+void Catalog::sets_of(const std::string& vm_uuid, std::vector<struct backup_set>& bsets)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    refresh();
+    auto it = by_vm_.find(vm_uuid);
+    if (it == by_vm_.end())
+        return;
+
+    for (const auto& d : it->second)
+        bsets.push_back(by_id_[d.second]);
+}
+
+void Catalog::list(std::vector<struct backup_set>& bsets)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    refresh();
+    bsets.reserve(bsets.size() + by_id_.size());
+    for (const auto& d : by_date_)
+        bsets.push_back(by_id_[d.second]);
+}
@@ -0,0 +1,74 @@
+#ifndef CATALOG_
+#define CATALOG_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <mutex>
+#include <memory>
+#include <sys/types.h>
+#include "xe_client.h"
+
+// The backup set catalog: backup_set.json is a snapshot and
+// backup_set.json.log holds one json line per change since the snapshot.
+// A change is a single appended line, synced before it counts, and the log
+// is folded back into the snapshot (write, sync, rename) once it is longer
+// than the snapshot. Other xc processes see the changes on their next call.
+class Catalog
+{
+public:
+    explicit Catalog(const std::string& file);
+    ~Catalog();
+
+    // one catalog per file in the process
+    static std::shared_ptr<Catalog> get(const std::string& file);
+
+    bool add(const struct backup_set& bset);
+    bool remove(const std::string& set_id);
+
+    bool find(const std::string& set_id, struct backup_set& bset);
+    // newest set of vm_uuid with this type
+    bool latest(const std::string& vm_uuid, const std::string& type, struct backup_set& bset);
+    // newest set of vm_uuid with any of these types
+    bool latest_of(const std::string& vm_uuid, const std::vector<std::string>& types,
+                   struct backup_set& bset);
+    // the sets needed to restore set_id, following parent links, full first
+    bool chain(const std::string& set_id, std::vector<struct backup_set>& bsets);
+    // true if another set names set_id as its parent
+    bool has_children(const std::string& set_id);
+    // sets of vm_uuid, oldest first
+    void sets_of(const std::string& vm_uuid, std::vector<struct backup_set>& bsets);
+    // every set, oldest first
+    void list(std::vector<struct backup_set>& bsets);
+private:
+    void refresh();
+    void reload();
+    void apply(const std::string& line);
+    void index(const struct backup_set& bset);
+    void unindex(const std::string& set_id);
+    bool append(const std::string& line);
+    bool compact();
+
+private:
+    std::string file_;
+    std::string log_file_;
+    std::mutex mutex_;
+    int log_fd_ = -1;
+    bool ok_ = true;    // false if the snapshot could not be parsed
+
+    // what has been read so far, to notice changes by other processes
+    ino_t snapshot_ino_ = 0;
+    int64_t snapshot_mtime_ = 0;
+    int64_t log_offset_ = 0;
+    size_t log_records_ = 0;
+
+    std::unordered_map<std::string, struct backup_set> by_id_;
+    // date order, dates are yyyymmddhhmmss so they sort as strings
+    std::multimap<std::string, std::string> by_date_;
+    // vm_uuid -> date -> set_id, and the same per vm_uuid and type
+    std::unordered_map<std::string, std::multimap<std::string, std::string>> by_vm_;
+    std::unordered_map<std::string, std::multimap<std::string, std::string>> by_vm_type_;
+};
+
+#endif // CATALOG_
@@ -0,0 +1,319 @@
+#include "checksum.h"
+#include <cstring>
+#include <algorithm>
+
+static const uint64_t P1 = 11400714785074694791ULL;
+static const uint64_t P2 = 14029467366897019727ULL;
+static const uint64_t P3 = 1609587929392839161ULL;
+static const uint64_t P4 = 9650029242287828579ULL;
+static const uint64_t P5 = 2870177450012600261ULL;
+
+static inline uint64_t rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char* p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t read32(const unsigned char* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+    acc += input * P2;
+    acc = rotl(acc, 31);
+    return acc * P1;
+}
+
+static inline uint64_t merge(uint64_t acc, uint64_t val)
+{
+    acc ^= xxh_round(0, val);
+    return acc * P1 + P4;
+}
+
+Xxh64::Xxh64(uint64_t seed)
+    : total_(0), mem_size_(0), seed_(seed)
+{
+    v_[0] = seed + P1 + P2;
+    v_[1] = seed + P2;
+    v_[2] = seed;
+    v_[3] = seed - P1;
+}
+
+void Xxh64::update(const void* data, size_t len)
+{
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    const unsigned char* end = p + len;
+    total_ += len;
+
+    if (mem_size_ + len < 32) {
+        memcpy(mem_ + mem_size_, p, len);
+        mem_size_ += len;
+        return;
+    }
+
+    if (mem_size_) {
+        memcpy(mem_ + mem_size_, p, 32 - mem_size_);
+        p += 32 - mem_size_;
+        v_[0] = xxh_round(v_[0], read64(mem_));
+        v_[1] = xxh_round(v_[1], read64(mem_ + 8));
+        v_[2] = xxh_round(v_[2], read64(mem_ + 16));
+        v_[3] = xxh_round(v_[3], read64(mem_ + 24));
+        mem_size_ = 0;
+    }
+
+    uint64_t v1 = v_[0], v2 = v_[1], v3 = v_[2], v4 = v_[3];
+    while (p + 32 <= end) {
+        v1 = xxh_round(v1, read64(p));
+        v2 = xxh_round(v2, read64(p + 8));
+        v3 = xxh_round(v3, read64(p + 16));
+        v4 = xxh_round(v4, read64(p + 24));
+        p += 32;
+    }
+    v_[0] = v1; v_[1] = v2; v_[2] = v3; v_[3] = v4;
+
+    if (p < end) {
+        mem_size_ = end - p;
+        memcpy(mem_, p, mem_size_);
+    }
+}
+
+uint64_t Xxh64::digest() const
+{
+    uint64_t h;
+    if (total_ >= 32) {
+        h = rotl(v_[0], 1) + rotl(v_[1], 7) + rotl(v_[2], 12) + rotl(v_[3], 18);
+        h = merge(h, v_[0]);
+        h = merge(h, v_[1]);
+        h = merge(h, v_[2]);
+        h = merge(h, v_[3]);
+    } else {
+        h = seed_ + P5;
+    }
+
+    h += total_;
+
+    const unsigned char* p = mem_;
+    const unsigned char* end = mem_ + mem_size_;
+    while (p + 8 <= end) {
+        h ^= xxh_round(0, read64(p));
+        h = rotl(h, 27) * P1 + P4;
+        p += 8;
+    }
+
+    if (p + 4 <= end) {
+        h ^= (uint64_t)read32(p) * P1;
+        h = rotl(h, 23) * P2 + P3;
+        p += 4;
+    }
+
+    while (p < end) {
+        h ^= (*p) * P5;
+        h = rotl(h, 11) * P1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+std::string Xxh64::hex(uint64_t h)
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string s(16, '0');
+    for (int i = 15; i >= 0; i--) {
+        s[i] = digits[h & 0xf];
+        h >>= 4;
+    }
+    return s;
+}
+
+std::string Xxh64::hex() const
+{
+    return hex(digest());
+}
+
+std::string Xxh64::state() const
+{
+    std::string s;
+    for (int i = 0; i < 4; i++)
+        s.append(hex(v_[i]));
+    s.append(hex(total_));
+    s.append(hex(seed_));
+    s.append(hex(mem_size_));
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < mem_size_; i++) {
+        s.push_back(digits[mem_[i] >> 4]);
+        s.push_back(digits[mem_[i] & 0xf]);
+    }
+    return s;
+}
+
+bool Xxh64::set_state(const std::string& state)
+{
+    auto parse = [&state](size_t pos, size_t len, uint64_t& v) {
+        if (pos + len > state.size())
+            return false;
+        v = 0;
+        for (size_t i = pos; i < pos + len; i++) {
+            const char c = state[i];
+            const int d = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+            if (d < 0)
+                return false;
+            v = (v << 4) | (uint64_t)d;
+        }
+        return true;
+    };
+
+    uint64_t v[7];
+    for (int i = 0; i < 7; i++) {
+        if (!parse(i * 16, 16, v[i]))
+            return false;
+    }
+
+    if (v[6] >= 32 || state.size() != 7 * 16 + v[6] * 2)
+        return false;
+
+    for (size_t i = 0; i < v[6]; i++) {
+        uint64_t b;
+        parse(7 * 16 + i * 2, 2, b);
+        mem_[i] = (unsigned char)b;
+    }
+
+    v_[0] = v[0]; v_[1] = v[1]; v_[2] = v[2]; v_[3] = v[3];
+    total_ = v[4];
+    seed_ = v[5];
+    mem_size_ = v[6];
+    return true;
+}
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t rotr32(uint32_t x, int r)
+{
+    return (x >> r) | (x << (32 - r));
+}
+
+static inline uint32_t read32_be(const unsigned char* p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+Sha256::Sha256()
+    : h_{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+         0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19},
+      total_(0), mem_size_(0)
+{
+}
+
+void Sha256::block(const unsigned char* p)
+{
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+        w[i] = read32_be(p + 4 * i);
+    for (int i = 16; i < 64; i++) {
+        const uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        const uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = h_[0], b = h_[1], c = h_[2], d = h_[3];
+    uint32_t e = h_[4], f = h_[5], g = h_[6], h = h_[7];
+    for (int i = 0; i < 64; i++) {
+        const uint32_t s1 = rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25);
+        const uint32_t ch = (e & f) ^ (~e & g);
+        const uint32_t t1 = h + s1 + ch + K[i] + w[i];
+        const uint32_t s0 = rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22);
+        const uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        const uint32_t t2 = s0 + maj;
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    h_[0] += a; h_[1] += b; h_[2] += c; h_[3] += d;
+    h_[4] += e; h_[5] += f; h_[6] += g; h_[7] += h;
+}
+
+void Sha256::update(const void* data, size_t len)
+{
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    total_ += len;
+
+    if (mem_size_) {
+        const size_t n = std::min(len, 64 - mem_size_);
+        memcpy(mem_ + mem_size_, p, n);
+        mem_size_ += n;
+        p += n;
+        len -= n;
+        if (mem_size_ < 64)
+            return;
+        block(mem_);
+        mem_size_ = 0;
+    }
+
+    while (len >= 64) {
+        block(p);
+        p += 64;
+        len -= 64;
+    }
+
+    memcpy(mem_, p, len);
+    mem_size_ = len;
+}
+
+void Sha256::digest(unsigned char out[32])
+{
+    const uint64_t bits = total_ * 8;
+    const unsigned char pad = 0x80;
+    const unsigned char zero[64] = {0};
+    update(&pad, 1);
+    update(zero, (mem_size_ <= 56 ? 56 : 120) - mem_size_);
+
+    unsigned char len[8];
+    for (int i = 0; i < 8; i++)
+        len[i] = (unsigned char)(bits >> (56 - 8 * i));
+    update(len, 8);
+
+    for (int i = 0; i < 8; i++) {
+        out[4 * i] = (unsigned char)(h_[i] >> 24);
+        out[4 * i + 1] = (unsigned char)(h_[i] >> 16);
+        out[4 * i + 2] = (unsigned char)(h_[i] >> 8);
+        out[4 * i + 3] = (unsigned char)h_[i];
+    }
+}
+
+std::string Sha256::hex()
+{
+    static const char digits[] = "0123456789abcdef";
+    unsigned char d[32];
+    digest(d);
+
+    std::string s;
+    for (int i = 0; i < 32; i++) {
+        s.push_back(digits[d[i] >> 4]);
+        s.push_back(digits[d[i] & 0xf]);
+    }
+    return s;
+}
@@ -0,0 +1,53 @@
+#ifndef CHECKSUM_
+#define CHECKSUM_
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+// Streaming xxh64, fast enough to hash a stream at memory bandwidth. Used to
+// detect corrupted backup files, not as a cryptographic digest.
+class Xxh64
+{
+public:
+    explicit Xxh64(uint64_t seed = 0);
+
+    void update(const void* data, size_t len);
+    uint64_t digest() const;
+    std::string hex() const;
+
+    static std::string hex(uint64_t h);
+
+    // the whole state as hex, so a hash can be continued by another process
+    std::string state() const;
+    bool set_state(const std::string& state);
+private:
+    uint64_t v_[4];
+    uint64_t total_;
+    unsigned char mem_[32];
+    size_t mem_size_;
+    uint64_t seed_;
+};
+
+// Streaming sha-256, used where a collision would lose data, e.g. as the
+// fingerprint of a deduplicated chunk.
+class Sha256
+{
+public:
+    Sha256();
+
+    void update(const void* data, size_t len);
+    // 32 bytes, the object can not be updated afterwards
+    void digest(unsigned char out[32]);
+    std::string hex();
+private:
+    void block(const unsigned char* p);
+
+private:
+    uint32_t h_[8];
+    uint64_t total_;
+    unsigned char mem_[64];
+    size_t mem_size_;
+};
+
+#endif // CHECKSUM_
@@ -0,0 +1,491 @@
+#include "chunk_store.h"
+#include "checksum.h"
+#include <zstd.h>
+#include <iostream>
+#include <sstream>
+#include <map>
+#include <cstring>
+#include <algorithm>
+#include <filesystem>
+#include <atomic>
+#include <unistd.h>
+
+#define MANIFEST_HEADER "xc-chunks 1"
+// rewrite the index once the log has this many records more than the index
+#define COMPACT_RECORDS (1 << 20)
+
+static const uint64_t* gear_table()
+{
+    // splitmix64, any fixed random table works but it must never change
+    static const std::vector<uint64_t> table = []() {
+        std::vector<uint64_t> t(256);
+        uint64_t x = 0x9e3779b97f4a7c15ULL;
+        for (auto& v : t) {
+            uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            v = z ^ (z >> 31);
+        }
+        return t;
+    }();
+    return table.data();
+}
+
+Chunker::Chunker(size_t avg_size)
+{
+    int bits = 12;
+    while (bits < 24 && ((size_t)1 << bits) < avg_size)
+        bits++;
+
+    // gear shifts left, the high bits depend on the most bytes
+    mask_ = ~0ULL << (64 - bits);
+    min_ = ((size_t)1 << bits) / 4;
+    max_ = ((size_t)1 << bits) * 4;
+}
+
+bool Chunker::next(const char* data, size_t len, size_t& n)
+{
+    const uint64_t* gear = gear_table();
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+    size_t i = 0;
+
+    // no cut can be below min_, do not even hash it
+    if (size_ < min_) {
+        i = std::min(len, min_ - size_);
+        size_ += i;
+    }
+
+    for (; i < len; i++) {
+        hash_ = (hash_ << 1) + gear[p[i]];
+        size_++;
+        if ((hash_ & mask_) == 0 || size_ >= max_) {
+            n = i + 1;
+            hash_ = 0;
+            size_ = 0;
+            return true;
+        }
+    }
+
+    n = len;
+    return false;
+}
+
+Chunk_Store::Chunk_Store(const std::string& dir)
+    : dir_(dir)
+{
+    std::error_code ec;
+    std::filesystem::create_directories(dir_, ec);
+    load();
+    log_.open(dir_ + "/index.log", std::ios::app);
+    if (!log_.is_open()) {
+        std::cout << "Failed to open chunk index log in " << dir_ << std::endl;
+    }
+}
+
+std::shared_ptr<Chunk_Store> Chunk_Store::get(const std::string& dir)
+{
+    static std::mutex stores_mutex;
+    static std::map<std::string, std::shared_ptr<Chunk_Store>> stores;
+
+    std::error_code ec;
+    const std::string key = std::filesystem::weakly_canonical(dir, ec).string();
+
+    std::lock_guard<std::mutex> lock(stores_mutex);
+    auto& s = stores[key.empty() ? dir : key];
+    if (!s)
+        s = std::make_shared<Chunk_Store>(dir);
+
+    return s;
+}
+
+std::string Chunk_Store::dir_of(const std::string& file)
+{
+    const std::filesystem::path p(file);
+    return (p.parent_path().parent_path() / CHUNK_STORE_DIR).string();
+}
+
+std::string Chunk_Store::path(const std::string& hash) const
+{
+    return dir_ + "/" + hash.substr(0, 2) + "/" + hash;
+}
+
+void Chunk_Store::load()
+{
+    std::ifstream index(dir_ + "/index");
+    std::string hash;
+    struct entry e;
+    while (index >> hash >> e.refs >> e.size >> e.stored)
+        index_[hash] = e;
+
+    // replay the changes, a torn last line is simply dropped
+    std::ifstream log(dir_ + "/index.log");
+    std::string line;
+    while (std::getline(log, line)) {
+        std::istringstream in(line);
+        char op = 0;
+        if (!(in >> op >> hash >> e.size >> e.stored))
+            continue;
+
+        log_records_++;
+        if (op == '+') {
+            auto& x = index_[hash];
+            x.refs++;
+            x.size = e.size;
+            x.stored = e.stored;
+        } else if (op == '-') {
+            auto it = index_.find(hash);
+            if (it != index_.end() && it->second.refs > 0)
+                it->second.refs--;
+        } else if (op == 'x') {
+            index_.erase(hash);
+        }
+    }
+}
+
+void Chunk_Store::log(char op, const std::string& hash, const struct entry& e)
+{
+    log_ << op << " " << hash << " " << e.size << " " << e.stored << "\n";
+    log_records_++;
+}
+
+bool Chunk_Store::put(const std::string& hash, const char* data, size_t len, int level)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = index_.find(hash);
+        if (it != index_.end()) {
+            it->second.refs++;
+            log('+', hash, it->second);
+            return true;
+        }
+    }
+
+    std::vector<char> packed;
+    const char* out = data;
+    size_t out_len = len;
+    if (level > 0) {
+        packed.resize(ZSTD_compressBound(len));
+        const size_t n = ZSTD_compress(packed.data(), packed.size(), data, len, level);
+        // keep incompressible chunks raw
+        if (!ZSTD_isError(n) && n < len) {
+            out = packed.data();
+            out_len = n;
+        }
+    }
+
+    // a chunk only appears under its name once it is complete. Writers of
+    // the same new chunk each use their own temp file, the last rename wins
+    // with the same bytes.
+    static std::atomic<uint64_t> tmp_seq(0);
+    const std::string file = path(hash);
+    const std::string tmp = file + "." + std::to_string(getpid()) + "."
+                            + std::to_string(tmp_seq++) + ".tmp";
+    std::error_code ec;
+    std::filesystem::create_directories(std::filesystem::path(file).parent_path(), ec);
+    {
+        std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+        f.write(out, out_len);
+        f.close();
+        if (f.fail()) {
+            std::cout << "Failed to write chunk " << tmp << std::endl;
+            std::filesystem::remove(tmp, ec);
+            return false;
+        }
+    }
+    std::filesystem::rename(tmp, file, ec);
+    if (ec) {
+        std::cout << "Failed to rename chunk " << tmp << ": " << ec.message() << std::endl;
+        std::error_code rm;
+        std::filesystem::remove(tmp, rm);
+        return false;
+    }
+
+    // another writer may have stored the same chunk meanwhile, same bytes
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& e = index_[hash];
+    e.refs++;
+    e.size = (uint32_t)len;
+    e.stored = (uint32_t)out_len;
+    log('+', hash, e);
+    return true;
+}
+
+bool Chunk_Store::read(const std::string& hash, std::vector<char>& out)
+{
+    struct entry e;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = index_.find(hash);
+        if (it == index_.end()) {
+            std::cout << "Failed to find chunk " << hash << std::endl;
+            return false;
+        }
+        e = it->second;
+    }
+
+    std::ifstream f(path(hash), std::ios::binary);
+    std::vector<char> stored(e.stored);
+    if (!f.read(stored.data(), stored.size())) {
+        std::cout << "Failed to read chunk " << hash << std::endl;
+        return false;
+    }
+
+    if (e.stored == e.size) {
+        out.swap(stored);
+        return true;
+    }
+
+    out.resize(e.size);
+    const size_t n = ZSTD_decompress(out.data(), out.size(), stored.data(), stored.size());
+    if (ZSTD_isError(n) || n != e.size) {
+        std::cout << "Failed to decompress chunk " << hash << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+void Chunk_Store::release(const std::string& hash)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = index_.find(hash);
+    if (it == index_.end() || it->second.refs == 0)
+        return;
+
+    it->second.refs--;
+    log('-', hash, it->second);
+}
+
+void Chunk_Store::release_set(const std::string& set_dir)
+{
+    std::error_code ec;
+    for (const auto& f : std::filesystem::directory_iterator(set_dir, ec)) {
+        if (f.path().extension() != CHUNKS_SUFFIX)
+            continue;
+
+        std::vector<struct chunk_ref> chunks;
+        if (!load_manifest(f.path().string(), chunks))
+            continue;
+
+        for (const auto& c : chunks)
+            release(c.hash);
+    }
+}
+
+size_t Chunk_Store::gc()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t n = 0;
+    for (auto it = index_.begin(); it != index_.end();) {
+        if (it->second.refs > 0) {
+            ++it;
+            continue;
+        }
+
+        std::error_code ec;
+        std::filesystem::remove(path(it->first), ec);
+        log('x', it->first, it->second);
+        it = index_.erase(it);
+        n++;
+    }
+
+    return n;
+}
+
+bool Chunk_Store::compact()
+{
+    const std::string tmp = dir_ + "/index.tmp";
+    std::ofstream out(tmp, std::ios::trunc);
+    for (const auto& e : index_)
+        out << e.first << " " << e.second.refs << " " << e.second.size << " " << e.second.stored << "\n";
+    out.close();
+    if (out.fail()) {
+        std::cout << "Failed to write " << tmp << std::endl;
+        return false;
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(tmp, dir_ + "/index", ec);
+    if (ec) {
+        std::cout << "Failed to rename " << tmp << ": " << ec.message() << std::endl;
+        return false;
+    }
+
+    log_.close();
+    log_.open(dir_ + "/index.log", std::ios::trunc);
+    log_records_ = 0;
+    return log_.is_open();
+}
+
+bool Chunk_Store::commit()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    log_.flush();
+    if (!log_.good()) {
+        std::cout << "Failed to write chunk index log in " << dir_ << std::endl;
+        return false;
+    }
+
+    if (log_records_ > index_.size() + COMPACT_RECORDS)
+        return compact();
+
+    return true;
+}
+
+bool Chunk_Store::remove_set(const std::string& set_dir)
+{
+    bool found = false;
+    std::error_code ec;
+    for (const auto& f : std::filesystem::directory_iterator(set_dir, ec)) {
+        if (f.path().extension() == CHUNKS_SUFFIX)
+            found = true;
+    }
+
+    if (!found)
+        return true;
+
+    auto store = get((std::filesystem::path(set_dir).parent_path() / CHUNK_STORE_DIR).string());
+    store->release_set(set_dir);
+    const size_t n = store->gc();
+    std::cout << "removed " << n << " unused chunks" << std::endl;
+    return store->commit();
+}
+
+bool load_manifest(const std::string& file, std::vector<struct chunk_ref>& chunks)
+{
+    std::ifstream in(file);
+    std::string line;
+    if (!std::getline(in, line) || line != MANIFEST_HEADER) {
+        std::cout << "Failed to load manifest " << file << std::endl;
+        return false;
+    }
+
+    struct chunk_ref c;
+    while (in >> c.hash >> c.size)
+        chunks.push_back(c);
+
+    return in.eof();
+}
+
+Chunk_Sink::Chunk_Sink(const std::string& file, size_t avg_size, int level)
+    : file_(file),
+      store_(Chunk_Store::get(Chunk_Store::dir_of(file))),
+      chunker_(avg_size),
+      level_(level)
+{
+    chunk_.reserve(chunker_.max_size());
+}
+
+Chunk_Sink::~Chunk_Sink()
+{
+    // references without a manifest would never be released
+    if (!closed_) {
+        for (const auto& c : chunks_)
+            store_->release(c.hash);
+        store_->commit();
+    }
+}
+
+bool Chunk_Sink::cut()
+{
+    Sha256 h;
+    h.update(chunk_.data(), chunk_.size());
+    struct chunk_ref c = {h.hex(), (uint32_t)chunk_.size()};
+    if (!store_->put(c.hash, chunk_.data(), chunk_.size(), level_)) {
+        failed_ = true;
+        return false;
+    }
+
+    chunks_.push_back(std::move(c));
+    chunk_.clear();
+    return true;
+}
+
+bool Chunk_Sink::write(const struct buffer& b)
+{
+    const char* p = b.data.data();
+    size_t len = b.size;
+    while (len > 0 && !failed_) {
+        size_t n = 0;
+        const bool at_cut = chunker_.next(p, len, n);
+        chunk_.insert(chunk_.end(), p, p + n);
+        p += n;
+        len -= n;
+        if (at_cut)
+            cut();
+    }
+
+    return !failed_;
+}
+
+bool Chunk_Sink::close()
+{
+    if (!failed_ && !chunk_.empty())
+        cut();
+
+    if (failed_)
+        return false;
+
+    // the references must be durable before a manifest points at them
+    if (!store_->commit())
+        return false;
+
+    const std::string tmp = file_ + ".tmp";
+    std::ofstream out(tmp, std::ios::trunc);
+    out << MANIFEST_HEADER << "\n";
+    for (const auto& c : chunks_)
+        out << c.hash << " " << c.size << "\n";
+    out.close();
+
+    std::error_code ec;
+    if (!out.fail())
+        std::filesystem::rename(tmp, file_, ec);
+    if (out.fail() || ec) {
+        std::cout << "Failed to write manifest " << file_ << std::endl;
+        std::filesystem::remove(tmp, ec);
+        return false;
+    }
+
+    closed_ = true;
+    return true;
+}
+
+Chunk_Source::Chunk_Source(const std::string& file)
+    : store_(Chunk_Store::get(Chunk_Store::dir_of(file)))
+{
+    if (!load_manifest(file, chunks_))
+        return;
+
+    for (const auto& c : chunks_) {
+        offsets_.push_back(size_);
+        size_ += c.size;
+    }
+    offsets_.push_back(size_);
+    ok_ = true;
+}
+
+bool Chunk_Source::read_at(int64_t offset, char* dst, size_t len)
+{
+    if (!ok_ || offset < 0 || offset + (int64_t)len > size_)
+        return false;
+
+    while (len > 0) {
+        auto it = std::upper_bound(offsets_.begin(), offsets_.end(), offset);
+        const size_t index = (it - offsets_.begin()) - 1;
+        if (index != cached_) {
+            cached_ = (size_t)-1;
+            if (!store_->read(chunks_[index].hash, data_) || data_.size() != chunks_[index].size)
+                return false;
+            cached_ = index;
+        }
+
+        const size_t skip = offset - offsets_[index];
+        const size_t n = std::min<size_t>(len, offsets_[index + 1] - offset);
+        memcpy(dst, data_.data() + skip, n);
+        dst += n;
+        offset += n;
+        len -= n;
+    }
+
+    return true;
+}
@@ -0,0 +1,129 @@
+#ifndef CHUNK_STORE_
+#define CHUNK_STORE_
+
+#include "pipeline.h"
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <memory>
+#include <fstream>
+
+// With storage.dedup a vdi is stored as a manifest <uuid>.vhd.chunks listing
+// content defined chunks by sha-256. The chunks live once in
+// <storage_dir>/.chunks and are reference counted by the manifests.
+#define CHUNKS_SUFFIX ".chunks"
+#define CHUNK_STORE_DIR ".chunks"
+
+// Gear rolling hash chunker, cuts where the hash matches a mask so the same
+// data gives the same chunks wherever it is in the stream.
+class Chunker
+{
+public:
+    explicit Chunker(size_t avg_size);
+
+    // n is set to the bytes of data that belong to the current chunk,
+    // true if the chunk ends there, false if it goes on in the next call
+    bool next(const char* data, size_t len, size_t& n);
+    size_t max_size() const { return max_; }
+private:
+    size_t min_;
+    size_t max_;
+    uint64_t mask_;
+    uint64_t hash_ = 0;
+    size_t size_ = 0;   // bytes of the current chunk seen so far
+};
+
+class Chunk_Store
+{
+public:
+    explicit Chunk_Store(const std::string& dir);
+
+    // one store per directory in the process
+    static std::shared_ptr<Chunk_Store> get(const std::string& dir);
+    // store directory used by a set file in <storage_dir>/<set_id>/
+    static std::string dir_of(const std::string& file);
+
+    // adds a reference, writes the chunk if it is new
+    bool put(const std::string& hash, const char* data, size_t len, int level);
+    bool read(const std::string& hash, std::vector<char>& out);
+    void release(const std::string& hash);
+    // drops the references of every manifest in a set directory
+    void release_set(const std::string& set_dir);
+    // deletes chunks nobody references, returns how many
+    size_t gc();
+    // makes every reference change so far durable
+    bool commit();
+
+    // releases the manifests of a set directory about to be removed and
+    // deletes the chunks that are no longer used, no-op without manifests
+    static bool remove_set(const std::string& set_dir);
+private:
+    struct entry {
+        uint32_t refs = 0;
+        uint32_t size = 0;
+        uint32_t stored = 0;    // smaller than size if zstd compressed
+    };
+
+    std::string path(const std::string& hash) const;
+    void load();
+    void log(char op, const std::string& hash, const struct entry& e);
+    bool compact();
+
+private:
+    // index is a snapshot of the table, index.log the changes since then
+    std::string dir_;
+    std::mutex mutex_;
+    std::unordered_map<std::string, struct entry> index_;
+    std::ofstream log_;
+    size_t log_records_ = 0;
+};
+
+struct chunk_ref {
+    std::string hash;
+    uint32_t size;
+};
+
+bool load_manifest(const std::string& file, std::vector<struct chunk_ref>& chunks);
+
+// Chunks the stream and writes the manifest on close
+class Chunk_Sink : public Sink
+{
+public:
+    Chunk_Sink(const std::string& file, size_t avg_size, int level);
+    ~Chunk_Sink();
+    bool write(const struct buffer& b) override;
+    bool close() override;
+private:
+    bool cut();
+
+private:
+    std::string file_;
+    std::shared_ptr<Chunk_Store> store_;
+    Chunker chunker_;
+    int level_;
+    std::vector<char> chunk_;
+    std::vector<struct chunk_ref> chunks_;
+    bool failed_ = false;
+    bool closed_ = false;
+};
+
+// Raw stream rebuilt from a manifest
+class Chunk_Source : public Source
+{
+public:
+    explicit Chunk_Source(const std::string& file);
+    bool is_open() const { return ok_; }
+    int64_t size() const override { return size_; }
+    bool read_at(int64_t offset, char* dst, size_t len) override;
+private:
+    std::shared_ptr<Chunk_Store> store_;
+    std::vector<struct chunk_ref> chunks_;
+    std::vector<int64_t> offsets_;
+    bool ok_ = false;
+    int64_t size_ = 0;
+    size_t cached_ = (size_t)-1;
+    std::vector<char> data_;
+};
+
+#endif // CHUNK_STORE_
@@ -0,0 +1,219 @@
+#include "compress.h"
+#include "chunk_store.h"
+#include <zstd.h>
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+#include <filesystem>
+
+#define SEEK_TABLE_MAGIC 0x184D2A5E
+#define SEEK_FOOTER_MAGIC 0x8F92EAB1
+// frame count, descriptor, magic
+#define SEEK_FOOTER_SIZE 9
+#define SEEK_ENTRY_SIZE 8
+
+static void put32(std::string& s, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+        s.push_back((char)((v >> (8 * i)) & 0xff));
+}
+
+static uint32_t get32(const char* p)
+{
+    const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+    return u[0] | (u[1] << 8) | (u[2] << 16) | ((uint32_t)u[3] << 24);
+}
+
+bool Zstd_Codec::encode(const struct buffer& in, struct buffer& out)
+{
+    // contexts are expensive to create, keep one per codec thread
+    thread_local std::unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx*)> cctx(ZSTD_createCCtx(),
+                                                                           ZSTD_freeCCtx);
+    const size_t bound = ZSTD_compressBound(in.size);
+    if (out.data.size() < bound)
+        out.data.resize(bound);
+
+    const size_t n = ZSTD_compressCCtx(cctx.get(), out.data.data(), out.data.size(),
+                                       in.data.data(), in.size, level_);
+    if (ZSTD_isError(n)) {
+        std::cout << "Failed to compress: " << ZSTD_getErrorName(n) << std::endl;
+        return false;
+    }
+
+    out.size = n;
+    return true;
+}
+
+Zstd_Sink::Zstd_Sink(const std::string& file)
+    : file_(file), out_(file, std::ios::binary | std::ios::trunc)
+{
+    if (!out_.is_open()) {
+        std::cout << "Failed to open file: " << file_ << std::endl;
+    }
+}
+
+bool Zstd_Sink::write(const struct buffer& b)
+{
+    if (!out_.is_open())
+        return false;
+
+    out_.write(b.data.data(), b.size);
+    frames_.emplace_back((uint32_t)b.size, (uint32_t)b.raw_size);
+    return out_.good();
+}
+
+bool Zstd_Sink::close()
+{
+    if (!out_.is_open())
+        return false;
+
+    std::string table;
+    put32(table, SEEK_TABLE_MAGIC);
+    put32(table, (uint32_t)(frames_.size() * SEEK_ENTRY_SIZE + SEEK_FOOTER_SIZE));
+    for (const auto& f : frames_) {
+        put32(table, f.first);
+        put32(table, f.second);
+    }
+    put32(table, (uint32_t)frames_.size());
+    table.push_back(0);
+    put32(table, SEEK_FOOTER_MAGIC);
+
+    out_.write(table.data(), table.size());
+    out_.close();
+    return !out_.fail();
+}
+
+Zstd_Source::Zstd_Source(const std::string& file)
+    : file_(file)
+{
+    if (!file_.is_open())
+        return;
+
+    char footer[SEEK_FOOTER_SIZE];
+    if (file_.size() < SEEK_FOOTER_SIZE + 8
+        || !file_.read_at(file_.size() - SEEK_FOOTER_SIZE, footer, SEEK_FOOTER_SIZE)
+        || get32(footer + 5) != SEEK_FOOTER_MAGIC || (footer[4] & 0x80)) {
+        std::cout << "Failed to find seek table in " << file << std::endl;
+        return;
+    }
+
+    const uint32_t n = get32(footer);
+    const int64_t table_size = 8 + (int64_t)n * SEEK_ENTRY_SIZE + SEEK_FOOTER_SIZE;
+    if (table_size > file_.size()) {
+        std::cout << "Invalid seek table in " << file << std::endl;
+        return;
+    }
+
+    std::vector<char> table(n * SEEK_ENTRY_SIZE);
+    if (!file_.read_at(file_.size() - table_size + 8, table.data(), table.size())) {
+        std::cout << "Failed to read seek table in " << file << std::endl;
+        return;
+    }
+
+    int64_t comp = 0;
+    size_t max_comp = 0;
+    size_t max_raw = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        const uint32_t c = get32(&table[i * SEEK_ENTRY_SIZE]);
+        const uint32_t r = get32(&table[i * SEEK_ENTRY_SIZE + 4]);
+        comp_offsets_.push_back(comp);
+        raw_offsets_.push_back(size_);
+        comp += c;
+        size_ += r;
+        max_comp = std::max<size_t>(max_comp, c);
+        max_raw = std::max<size_t>(max_raw, r);
+    }
+    comp_offsets_.push_back(comp);
+    raw_offsets_.push_back(size_);
+
+    if (comp + table_size != file_.size()) {
+        std::cout << "Seek table does not match " << file << std::endl;
+        return;
+    }
+
+    comp_.resize(max_comp);
+    raw_.resize(max_raw);
+    ok_ = true;
+}
+
+bool Zstd_Source::load_frame(size_t index)
+{
+    if (index == cached_)
+        return true;
+
+    const size_t comp_size = comp_offsets_[index + 1] - comp_offsets_[index];
+    const size_t raw_size = raw_offsets_[index + 1] - raw_offsets_[index];
+    if (!file_.read_at(comp_offsets_[index], comp_.data(), comp_size))
+        return false;
+
+    const size_t n = ZSTD_decompress(raw_.data(), raw_size, comp_.data(), comp_size);
+    if (ZSTD_isError(n) || n != raw_size) {
+        std::cout << "Failed to decompress frame " << index << std::endl;
+        cached_ = (size_t)-1;
+        return false;
+    }
+
+    cached_ = index;
+    return true;
+}
+
+bool Zstd_Source::read_at(int64_t offset, char* dst, size_t len)
+{
+    if (!ok_ || offset < 0 || offset + (int64_t)len > size_)
+        return false;
+
+    while (len > 0) {
+        // last frame starting at or before offset
+        auto it = std::upper_bound(raw_offsets_.begin(), raw_offsets_.end(), offset);
+        const size_t index = (it - raw_offsets_.begin()) - 1;
+        if (!load_frame(index))
+            return false;
+
+        const size_t skip = offset - raw_offsets_[index];
+        const size_t n = std::min<size_t>(len, raw_offsets_[index + 1] - offset);
+        memcpy(dst, raw_.data() + skip, n);
+        dst += n;
+        offset += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+std::string stored_file(const std::string& file)
+{
+    for (const char* suffix : {ZSTD_SUFFIX, CHUNKS_SUFFIX}) {
+        const std::string f = file + suffix;
+        if (std::filesystem::exists(f))
+            return f;
+    }
+    return file;
+}
+
+static bool has_suffix(const std::string& file, const std::string& suffix)
+{
+    return file.size() > suffix.size()
+        && file.compare(file.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+std::unique_ptr<Source> open_source(const std::string& file)
+{
+    if (has_suffix(file, ZSTD_SUFFIX)) {
+        std::unique_ptr<Zstd_Source> s(new Zstd_Source(file));
+        if (!s->is_open())
+            return nullptr;
+        return s;
+    }
+
+    if (has_suffix(file, CHUNKS_SUFFIX)) {
+        std::unique_ptr<Chunk_Source> s(new Chunk_Source(file));
+        if (!s->is_open())
+            return nullptr;
+        return s;
+    }
+
+    std::unique_ptr<File_Source> s(new File_Source(file));
+    if (!s->is_open())
+        return nullptr;
+    return s;
+}
@@ -0,0 +1,67 @@
+#ifndef COMPRESS_
+#define COMPRESS_
+
+#include "pipeline.h"
+#include <string>
+#include <vector>
+#include <fstream>
+
+// Stored vdi files are either raw (<uuid>.vhd) or compressed in the zstd
+// seekable format (<uuid>.vhd.zst): every pipeline buffer is one independent
+// zstd frame, and a skippable frame at the end lists the compressed and raw
+// size of every frame, so any offset can be read without decompressing the
+// frames before it.
+#define ZSTD_SUFFIX ".zst"
+
+// Compresses one buffer into one frame, safe to call from several threads
+class Zstd_Codec : public Codec
+{
+public:
+    explicit Zstd_Codec(int level) : level_(level) {}
+    bool encode(const struct buffer& in, struct buffer& out) override;
+private:
+    int level_;
+};
+
+// Writes the frames and appends the seek table on close
+class Zstd_Sink : public Sink
+{
+public:
+    explicit Zstd_Sink(const std::string& file);
+    bool write(const struct buffer& b) override;
+    bool close() override;
+private:
+    std::string file_;
+    std::ofstream out_;
+    std::vector<std::pair<uint32_t, uint32_t>> frames_; // compressed, raw size
+};
+
+// Raw stream of a .zst file, decompresses one frame at a time
+class Zstd_Source : public Source
+{
+public:
+    explicit Zstd_Source(const std::string& file);
+    bool is_open() const { return ok_; }
+    int64_t size() const override { return size_; }
+    bool read_at(int64_t offset, char* dst, size_t len) override;
+private:
+    bool load_frame(size_t index);
+
+private:
+    File_Source file_;
+    bool ok_ = false;
+    int64_t size_ = 0;
+    std::vector<int64_t> comp_offsets_;  // frame start in the file
+    std::vector<int64_t> raw_offsets_;   // frame start in the raw stream
+    size_t cached_ = (size_t)-1;
+    std::vector<char> comp_;
+    std::vector<char> raw_;
+};
+
+// stored file for a raw file name: file.zst or file.chunks if it exists,
+// else file
+std::string stored_file(const std::string& file);
+// opens a stored file of any format, nullptr on failure
+std::unique_ptr<Source> open_source(const std::string& file);
+
+#endif // COMPRESS_
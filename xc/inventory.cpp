@@ -0,0 +1,320 @@
+#include "inventory.h"
+#include <iostream>
+
+static std::string ref_of(const void* handle)
+{
+    return handle ? std::string((const char*)handle) : std::string();
+}
+
+void vm_from_record(const xen_vm_record* r, struct vm& v)
+{
+    for (int m = 0; m < r->allowed_operations->size; m++) {
+        v.allowed_operations.push_back(r->allowed_operations->contents[m]);
+    }
+
+    v.uuid = r->uuid;
+    v.power_state = (int)r->power_state;
+    v.name_label = r->name_label;
+    v.name_description = r->name_description;
+    v.user_version = r->user_version;
+    v.is_a_template = r->is_a_template;
+    v.memory_overhead = r->memory_overhead;
+    v.memory_target = r->memory_target;
+    v.memory_static_max = r->memory_static_max;
+    v.memory_dynamic_max = r->memory_dynamic_max;
+    v.memory_dynamic_min = r->memory_dynamic_min;
+    v.memory_static_min = r->memory_static_min;
+
+    for (int m = 0; m < r->vcpus_params->size; m++) {
+        xen_string_string_map_contents pair = r->vcpus_params->contents[m];
+        v.vcpus_params[pair.key] = pair.val;
+    }
+    v.vcpus_max = r->vcpus_max;
+    v.vcpus_at_startup = r->vcpus_at_startup;
+    v.actions_after_shutdown = (int)r->actions_after_shutdown;
+    v.actions_after_reboot = (int)r->actions_after_reboot;
+    v.actions_after_crash = (int)r->actions_after_crash;
+
+    v.pv_bootloader = r->pv_bootloader;
+    v.pv_kernel = r->pv_kernel;
+    v.pv_ramdisk = r->pv_ramdisk;
+    v.pv_args = r->pv_args;
+    v.pv_bootloader_args = r->pv_bootloader_args;
+    v.pv_legacy_args = r->pv_legacy_args;
+    v.hvm_boot_policy = r->hvm_boot_policy;
+
+    for (int m = 0; m < r->hvm_boot_params->size; m++) {
+        xen_string_string_map_contents pair = r->hvm_boot_params->contents[m];
+        v.hvm_boot_params[pair.key] = pair.val;
+    }
+
+    v.hvm_shadow_multiplier = r->hvm_shadow_multiplier;
+
+    for (int m = 0; m < r->platform->size; m++) {
+        xen_string_string_map_contents pair = r->platform->contents[m];
+        v.platform[pair.key] = pair.val;
+    }
+
+    for (int m = 0; m < r->other_config->size; m++) {
+        xen_string_string_map_contents pair = r->other_config->contents[m];
+        v.other_config[pair.key] = pair.val;
+    }
+
+    if (r->tags) {
+        for (int m = 0; m < r->tags->size; m++) {
+            v.tags.emplace_back(r->tags->contents[m]);
+        }
+    }
+}
+
+void vbd_from_record(const xen_vbd_record* r, struct vbd& vb)
+{
+    vb.uuid = r->uuid;
+    vb.bootable = r->bootable;
+    vb.device = r->device;
+    vb.userdevice = r->userdevice;
+}
+
+void vdi_from_record(const xen_vdi_record* r, const char* ref, struct vdi& vdi)
+{
+    vdi.vdi = ref;
+    vdi.uuid = r->uuid;
+    vdi.name_label = r->name_label;
+    vdi.name_description = r->name_description;
+    vdi.virtual_size = r->virtual_size;
+    vdi.physical_utilisation = r->physical_utilisation;
+    vdi.type = r->type;
+    vdi.sharable = r->sharable;
+    vdi.read_only = r->read_only;
+}
+
+void vif_from_record(const xen_vif_record* r, struct vif& vf)
+{
+    vf.uuid = r->uuid;
+    vf.device = r->device;
+    vf.mac = r->mac;
+    vf.mtu = r->mtu;
+}
+
+void network_from_record(const xen_network_record* r, struct network& n)
+{
+    n.uuid = r->uuid;
+    n.name_label = r->name_label;
+    n.name_description = r->name_description;
+    n.mtu = r->mtu;
+    n.bridge = r->bridge;
+    n.managed = r->managed;
+}
+
+void sr_from_record(const xen_sr_record* r, struct sr& s)
+{
+    s.uuid = r->uuid;
+    s.name_label = r->name_label;
+    s.name_description = r->name_description;
+    s.type = r->type;
+    s.physical_utilisation = r->physical_utilisation;
+    s.physical_size = r->physical_size;
+}
+
+Inventory::Inventory(xen_session* session)
+    : session_(session)
+{
+}
+
+Inventory::~Inventory()
+{
+    if (vm_map_)
+        xen_vm_xen_vm_record_map_free(vm_map_);
+    if (vbd_map_)
+        xen_vbd_xen_vbd_record_map_free(vbd_map_);
+    if (vdi_map_)
+        xen_vdi_xen_vdi_record_map_free(vdi_map_);
+    if (vif_map_)
+        xen_vif_xen_vif_record_map_free(vif_map_);
+    if (network_map_)
+        xen_network_xen_network_record_map_free(network_map_);
+    if (host_map_)
+        xen_host_xen_host_record_map_free(host_map_);
+    if (sr_map_)
+        xen_sr_xen_sr_record_map_free(sr_map_);
+    if (pif_map_)
+        xen_pif_xen_pif_record_map_free(pif_map_);
+}
+
+template<class M>
+void Inventory::index(M* map, std::unordered_map<std::string, decltype(map->contents[0].val)>& by_ref)
+{
+    by_ref.reserve(map->size);
+    for (int i = 0; i < map->size; i++) {
+        by_ref.emplace(ref_of(map->contents[i].key), map->contents[i].val);
+    }
+}
+
+bool Inventory::load()
+{
+    if (!xen_vm_get_all_records(session_, &vm_map_)) {
+        std::cout << "Failed to get vm records" << std::endl;
+        return false;
+    }
+
+    if (!xen_vbd_get_all_records(session_, &vbd_map_)) {
+        std::cout << "Failed to get vbd records" << std::endl;
+        return false;
+    }
+
+    if (!xen_vdi_get_all_records(session_, &vdi_map_)) {
+        std::cout << "Failed to get vdi records" << std::endl;
+        return false;
+    }
+
+    if (!xen_vif_get_all_records(session_, &vif_map_)) {
+        std::cout << "Failed to get vif records" << std::endl;
+        return false;
+    }
+
+    if (!xen_network_get_all_records(session_, &network_map_)) {
+        std::cout << "Failed to get network records" << std::endl;
+        return false;
+    }
+
+    if (!xen_host_get_all_records(session_, &host_map_)) {
+        std::cout << "Failed to get host records" << std::endl;
+        return false;
+    }
+
+    if (!xen_sr_get_all_records(session_, &sr_map_)) {
+        std::cout << "Failed to get sr records" << std::endl;
+        return false;
+    }
+
+    // only listed, the vms do not need them
+    if (!xen_pif_get_all_records(session_, &pif_map_)) {
+        std::cout << "Failed to get pif records" << std::endl;
+        xen_session_clear_error(session_);
+        pif_map_ = nullptr;
+    }
+
+    index(vbd_map_, vbds_);
+    index(vdi_map_, vdis_);
+    index(vif_map_, vifs_);
+    index(network_map_, networks_);
+    index(host_map_, hosts_);
+    index(sr_map_, srs_);
+
+    std::cout << "inventory: " << vm_map_->size << " vms, " << vbd_map_->size << " vbds, "
+              << vdi_map_->size << " vdis, " << vif_map_->size << " vifs, "
+              << host_map_->size << " hosts, " << sr_map_->size << " srs" << std::endl;
+    return true;
+}
+
+std::string Inventory::host_uuid(const xen_host_record_opt* opt) const
+{
+    if (!opt)
+        return std::string();
+
+    auto it = hosts_.find(ref_of(opt->u.handle));
+    return it == hosts_.end() ? std::string() : std::string(it->second->uuid);
+}
+
+bool Inventory::get_vm(const xen_vm_record* r, struct vm& v) const
+{
+    vm_from_record(r, v);
+
+    for (int m = 0; m < r->vbds->size; m++) {
+        const xen_vbd_record_opt *opt = r->vbds->contents[m];
+        if (opt->is_record)
+            continue;
+
+        auto b = vbds_.find(ref_of(opt->u.handle));
+        if (b == vbds_.end() || b->second->type != XEN_VBD_TYPE_DISK)
+            continue;
+
+        const xen_vbd_record *vrec = b->second;
+        struct vbd vb;
+        vbd_from_record(vrec, vb);
+
+        if (vrec->vdi) {
+            const std::string ref = ref_of(vrec->vdi->u.handle);
+            auto d = vdis_.find(ref);
+            if (d != vdis_.end()) {
+                vdi_from_record(d->second, ref.c_str(), vb.vdi);
+                if (d->second->sr) {
+                    auto s = srs_.find(ref_of(d->second->sr->u.handle));
+                    if (s != srs_.end())
+                        vb.vdi.sr_uuid = s->second->uuid;
+                }
+            }
+        }
+
+        v.vbds.push_back(std::move(vb));
+    }
+
+    for (int m = 0; m < r->vifs->size; m++) {
+        const xen_vif_record_opt *opt = r->vifs->contents[m];
+        if (opt->is_record)
+            continue;
+
+        auto f = vifs_.find(ref_of(opt->u.handle));
+        if (f == vifs_.end())
+            continue;
+
+        struct vif vf;
+        vif_from_record(f->second, vf);
+        if (f->second->network) {
+            auto n = networks_.find(ref_of(f->second->network->u.handle));
+            if (n != networks_.end())
+                network_from_record(n->second, vf.network);
+        }
+
+        v.vifs.push_back(std::move(vf));
+    }
+
+    v.host_uuid = host_uuid(r->resident_on);
+    v.affinity_uuid = host_uuid(r->affinity);
+
+    return true;
+}
+
+void Inventory::vms(std::vector<struct vm>& vms) const
+{
+    if (!vm_map_)
+        return;
+
+    vms.reserve(vms.size() + vm_map_->size);
+    for (int i = 0; i < vm_map_->size; i++) {
+        const xen_vm_record *r = vm_map_->contents[i].val;
+        if (r->is_a_template || r->is_control_domain || r->is_a_snapshot)
+            continue;
+
+        struct vm v;
+        if (get_vm(r, v))
+            vms.emplace_back(std::move(v));
+    }
+}
+
+void Inventory::hosts(std::map<std::string, struct host>& hosts) const
+{
+    if (!host_map_)
+        return;
+
+    for (int i = 0; i < host_map_->size; i++) {
+        const xen_host_record *r = host_map_->contents[i].val;
+        struct host& h = hosts[r->uuid];
+        h.uuid = r->uuid;
+        h.address = r->address;
+        h.host = r->hostname;
+        std::cout << "== host " << h.host << std::endl;
+        if (!pif_map_)
+            continue;
+
+        const std::string ref = ref_of(host_map_->contents[i].key);
+        for (int k = 0; k < pif_map_->size; k++) {
+            const xen_pif_record *pif = pif_map_->contents[k].val;
+            if (!pif->host || ref_of(pif->host->u.handle) != ref)
+                continue;
+
+            std::cout << "== ip " << pif->ip << std::endl;
+            std::cout << "== device " << pif->device << std::endl;
+        }
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef INVENTORY_
+#define INVENTORY_
+
+#include "xe_client.h"
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+
+// record -> struct conversions, shared by the per object and the bulk path
+void vm_from_record(const xen_vm_record* r, struct vm& v);
+void vbd_from_record(const xen_vbd_record* r, struct vbd& vb);
+void vdi_from_record(const xen_vdi_record* r, const char* ref, struct vdi& vdi);
+void vif_from_record(const xen_vif_record* r, struct vif& vf);
+void network_from_record(const xen_network_record* r, struct network& n);
+void sr_from_record(const xen_sr_record* r, struct sr& s);
+
+// Pool wide snapshot of the vm, vbd, vdi, vif, network, host and sr tables.
+// Every table is fetched with one get_all_records call and joined locally
+// by ref, so building the vm list costs a fixed number of round trips no
+// matter how many vms and devices the pool has.
+class Inventory
+{
+public:
+    explicit Inventory(xen_session* session);
+    ~Inventory();
+
+    Inventory(const Inventory&) = delete;
+    Inventory& operator=(const Inventory&) = delete;
+
+    bool load();
+
+    // every vm which is not a template, snapshot or control domain
+    void vms(std::vector<struct vm>& vms) const;
+    // also prints the pifs of every host
+    void hosts(std::map<std::string, struct host>& hosts) const;
+private:
+    bool get_vm(const xen_vm_record* r, struct vm& v) const;
+    std::string host_uuid(const xen_host_record_opt* opt) const;
+
+    template<class M>
+    static void index(M* map, std::unordered_map<std::string, decltype(map->contents[0].val)>& by_ref);
+
+private:
+    xen_session* session_;
+
+    xen_vm_xen_vm_record_map* vm_map_ = nullptr;
+    xen_vbd_xen_vbd_record_map* vbd_map_ = nullptr;
+    xen_vdi_xen_vdi_record_map* vdi_map_ = nullptr;
+    xen_vif_xen_vif_record_map* vif_map_ = nullptr;
+    xen_network_xen_network_record_map* network_map_ = nullptr;
+    xen_host_xen_host_record_map* host_map_ = nullptr;
+    xen_sr_xen_sr_record_map* sr_map_ = nullptr;
+    xen_pif_xen_pif_record_map* pif_map_ = nullptr;
+
+    std::unordered_map<std::string, xen_vbd_record*> vbds_;
+    std::unordered_map<std::string, xen_vdi_record*> vdis_;
+    std::unordered_map<std::string, xen_vif_record*> vifs_;
+    std::unordered_map<std::string, xen_network_record*> networks_;
+    std::unordered_map<std::string, xen_host_record*> hosts_;
+    std::unordered_map<std::string, xen_sr_record*> srs_;
+};
+
+#endif // INVENTORY_
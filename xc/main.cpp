@@ -1,7 +1,13 @@
 #include "xe_client.h"
+#include "scheduler.h"
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <filesystem>
+#include <chrono>
+#include <memory>
+#include <iomanip>
+#include <cstdio>
 #include <json/json.h>
 
 extern "C"
@@ -14,70 +20,271 @@ struct args {
     std::string username;
     std::string password;
     std::string storage_dir;
+    struct options options;
 };
 
 void dump_vm(const struct args& args)
 {
-    Xe_Client c(args.url, args.username, args.password);
+    Xe_Client c(args.url, args.username, args.password, args.options);
     c.connect();
     c.scan_vms();
 }
 
 void dump_all(const struct args& args)
 {
-    Xe_Client c(args.url, args.username, args.password);
+    Xe_Client c(args.url, args.username, args.password, args.options);
     c.connect();
     c.scan_all();
 }
 
 void backup_vm(const struct args& args, const std::string& vm_uuid)
 {
-    Xe_Client c(args.url, args.username, args.password);
+    Xe_Client c(args.url, args.username, args.password, args.options);
     c.connect();
     c.backup_vm(vm_uuid, args.storage_dir);
 }
 
 void backup_vm_diff(const struct args& args, const std::string& vm_uuid)
 {
-    Xe_Client c(args.url, args.username, args.password);
+    Xe_Client c(args.url, args.username, args.password, args.options);
     c.connect();
     c.backup_vm_diff(vm_uuid, args.storage_dir);
 }
 
+void backup_vm_incr(const struct args& args, const std::string& vm_uuid)
+{
+    Xe_Client c(args.url, args.username, args.password, args.options);
+    c.connect();
+    c.backup_vm_incr(args.storage_dir, vm_uuid);
+}
+
+void synth_vm(const struct args& args, const std::string& vm_uuid)
+{
+    // offline, no xenserver session needed
+    Xe_Client c(args.url, args.username, args.password, args.options);
+    c.synth_vm(args.storage_dir, vm_uuid);
+}
+
+// type is full, diff or incr
+void backup_batch(const struct args& args, const std::string& tag, const std::string& type)
+{
+    std::vector<struct job> jobs;
+    {
+        Xe_Client c(args.url, args.username, args.password, args.options);
+        if (!c.connect()) {
+            std::cout << "Failed to connect " << args.url << std::endl;
+            return;
+        }
+
+        if (!c.backup_jobs(tag, jobs)) {
+            std::cout << "Failed to plan backup jobs" << std::endl;
+            return;
+        }
+    }
+
+    if (jobs.empty()) {
+        std::cout << "No vm to backup" << std::endl;
+        return;
+    }
+
+    // one session per worker, shared by every vm the worker backs up
+    struct options opts = args.options;
+    const int workers = std::min(opts.jobs, (int)jobs.size());
+    std::vector<std::unique_ptr<Xe_Client>> clients;
+    for (int i = 0; i < workers; i++) {
+        clients.emplace_back(new Xe_Client(args.url, args.username, args.password, opts));
+        if (!clients.back()->connect()) {
+            std::cout << "Failed to connect " << args.url << std::endl;
+            return;
+        }
+    }
+
+    // snapshots every vm up front and deletes the snapshots the workers are
+    // done with, so neither waits in line behind the exports
+    const auto start = std::chrono::steady_clock::now();
+    Xe_Client control(args.url, args.username, args.password, opts);
+    if (!control.connect()) {
+        std::cout << "Failed to connect " << args.url << std::endl;
+        return;
+    }
+    std::vector<std::string> vm_uuids;
+    for (const auto& j : jobs)
+        vm_uuids.push_back(j.id);
+    control.start_control(vm_uuids);
+
+    Job_Scheduler scheduler(workers, opts.per_host, opts.per_sr);
+    scheduler.run(jobs, [&](struct job& j, int worker) {
+        Xe_Client& c = *clients[worker];
+        const int64_t before = c.bytes_transferred();
+        bool ok;
+        if (type == "diff")
+            ok = c.backup_vm_diff(args.storage_dir, j.id);
+        else if (type == "incr")
+            ok = c.backup_vm_incr(args.storage_dir, j.id);
+        else
+            ok = c.backup_vm(j.id, args.storage_dir);
+        j.bytes = c.bytes_transferred() - before;
+        return ok;
+    });
+    control.stop_control();
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    Job_Scheduler::report(jobs, seconds);
+}
+
 void restore_vm(const struct args& args,
-                const std::string& set_id)
+                const std::string& set_id,
+                bool boot_first)
 {
-    Xe_Client c(args.url, args.username, args.password);
+    struct options opts = args.options;
+    opts.boot_first = opts.boot_first || boot_first;
+    Xe_Client c(args.url, args.username, args.password, opts);
     c.connect();
     c.restore_vm(args.storage_dir, set_id);
 }
 
+// restore map: {"sr": default sr, "networks": {source: target}, "sets": [set_id
+// or {"set_id": .., "sr": ..}]}, one job per set with its sr
+bool parse_restore_map(const std::string& file_name, struct restore_target& target,
+                       std::vector<struct job>& jobs)
+{
+    std::ifstream file(file_name);
+    Json::CharReaderBuilder reader;
+    Json::Value root;
+    JSONCPP_STRING errs;
+
+    if (!Json::parseFromStream(reader, file, &root, &errs)) {
+        std::cout << "Error parsing JSON: " << errs << std::endl;
+        return false;
+    }
+
+    target.sr_uuid = root["sr"].asString();
+    const Json::Value& networks = root["networks"];
+    for (const auto& from : networks.getMemberNames())
+        target.networks[from] = networks[from].asString();
+
+    for (const auto& s : root["sets"]) {
+        struct job j;
+        j.id = s.isString() ? s.asString() : s["set_id"].asString();
+        const std::string sr = s.isObject() ? s.get("sr", target.sr_uuid).asString() : target.sr_uuid;
+        if (j.id.empty() || sr.empty()) {
+            std::cout << "Set without set_id or sr in " << file_name << std::endl;
+            return false;
+        }
+
+        j.srs.push_back(sr);
+        jobs.emplace_back(std::move(j));
+    }
+
+    return true;
+}
+
+void restore_batch(const struct args& args, const std::string& map_file)
+{
+    struct restore_target target;
+    std::vector<struct job> jobs;
+    if (!parse_restore_map(map_file, target, jobs))
+        return;
+
+    if (jobs.empty()) {
+        std::cout << "No set to restore" << std::endl;
+        return;
+    }
+
+    struct options opts = args.options;
+    const int workers = std::min(opts.jobs, (int)jobs.size());
+    std::vector<std::unique_ptr<Xe_Client>> clients;
+    for (int i = 0; i < workers; i++) {
+        clients.emplace_back(new Xe_Client(args.url, args.username, args.password, opts));
+        if (!clients.back()->connect()) {
+            std::cout << "Failed to connect " << args.url << std::endl;
+            return;
+        }
+    }
+
+    if (!clients.front()->restore_jobs(args.storage_dir, jobs)) {
+        std::cout << "Failed to plan restore jobs" << std::endl;
+        return;
+    }
+
+    // per_sr bounds how many vms are written to one sr at a time
+    const auto start = std::chrono::steady_clock::now();
+    Job_Scheduler scheduler(workers, opts.per_host, opts.per_sr);
+    scheduler.run(jobs, [&](struct job& j, int worker) {
+        Xe_Client& c = *clients[worker];
+        struct restore_target t = target;
+        t.sr_uuid = j.srs.front();
+        const int64_t before = c.bytes_transferred();
+        const bool ok = c.restore_vm(args.storage_dir, j.id, &t);
+        j.bytes = c.bytes_transferred() - before;
+        return ok;
+    });
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    Job_Scheduler::report(jobs, seconds);
+}
+
+// userdevices is a comma separated list, where is --sr <sr_uuid> or --vdi <vdi_uuid>
+bool restore_disks(const struct args& args, const std::string& set_id, const std::string& userdevices,
+                   const std::string& where, const std::string& uuid)
+{
+    std::vector<std::string> devices;
+    std::stringstream ss(userdevices);
+    std::string d;
+    while (std::getline(ss, d, ',')) {
+        if (!d.empty())
+            devices.push_back(d);
+    }
+
+    Xe_Client c(args.url, args.username, args.password, args.options);
+    if (!c.connect()) {
+        std::cout << "Failed to connect " << args.url << std::endl;
+        return false;
+    }
+
+    if (where == "--sr")
+        return c.restore_disks(args.storage_dir, set_id, devices, uuid);
+
+    if (devices.size() != 1) {
+        std::cout << "Only one userdevice can be restored into a vdi" << std::endl;
+        return false;
+    }
+
+    return c.restore_disk_in_place(args.storage_dir, set_id, devices.front(), uuid);
+}
+
 void dump_srs(const struct args& args)
 {
-    Xe_Client c(args.url, args.username, args.password);
+    Xe_Client c(args.url, args.username, args.password, args.options);
     c.connect();
     c.scan_srs();
 }
 
 void dump_backupsets(const struct args& args)
 {
-    Xe_Client c(args.url, args.username, args.password);
+    Xe_Client c(args.url, args.username, args.password, args.options);
     c.scan_backsets();
 }
 
 void dump_host_networks(const struct args& args)
 {
-    Xe_Client c(args.url, args.username, args.password);
+    Xe_Client c(args.url, args.username, args.password, args.options);
     c.connect();
     c.scan_networks();
 }
 
 void rm_backup_set(const struct args& args, const std::string& set_id)
 {
-    Xe_Client c(args.url, args.username, args.password);
+    Xe_Client c(args.url, args.username, args.password, args.options);
     c.rm_backupset(args.storage_dir, set_id);
 }
 
+bool verify_backup_set(const struct args& args, const std::string& set_id)
+{
+    Xe_Client c(args.url, args.username, args.password, args.options);
+    return c.verify_backupset(args.storage_dir, set_id);
+}
+
 void usage()
 {
     std::cout << "Usage: " << std::endl;
@@ -85,11 +292,42 @@ void usage()
     std::cout << "   vms: list hosts and vms" << std::endl;
     std::cout << "   backup <vm_uuid>: backup vm by uuid" << std::endl;
     std::cout << "   backup_diff <vm_uuid>: backup diff vm by uuid" << std::endl;
-    std::cout << "   restore <set_id>: restore vm from set_id" << std::endl;
+    std::cout << "   backup_incr <vm_uuid>: backup changes since the last full or incr of vm" << std::endl;
+    std::cout << "   backup --all | --tag <tag>: backup every vm, or every vm with tag" << std::endl;
+    std::cout << "   backup_diff --all | --tag <tag>: backup diff every vm, or every vm with tag" << std::endl;
+    std::cout << "   backup_incr --all | --tag <tag>: backup incr every vm, or every vm with tag" << std::endl;
+    std::cout << "   synth <vm_uuid>: merge the newest backup chain of vm into a new full set" << std::endl;
+    std::cout << "   restore <set_id> [--boot-first]: restore vm from set_id, optionally start it before its data disks are in" << std::endl;
+    std::cout << "   restore_disk <set_id> <userdevice,...> --sr <sr_uuid>: restore disks into new vdis on sr" << std::endl;
+    std::cout << "   restore_disk <set_id> <userdevice> --vdi <vdi_uuid>: overwrite an unattached vdi with a disk" << std::endl;
+    std::cout << "   restore_batch <map_file>: restore the sets of map_file in parallel, no prompts" << std::endl;
     std::cout << "   srs: list storage repository" << std::endl;
     std::cout << "   networks: list network of host" << std::endl;
     std::cout << "   sets: list backupset" << std::endl;
     std::cout << "   rm <set_id>: remove backupset, if set_id is all, rm all" << std::endl;
+    std::cout << "   verify <set_id>: check vhd structure and checksum of a backupset" << std::endl;
+}
+
+// mb per second, missing keys keep base
+static struct throttle_limits parse_limits(const Json::Value& v, const struct throttle_limits& base)
+{
+    struct throttle_limits limits;
+    limits.global = v.get("global_mb", (Json::Int64)(base.global >> 20)).asInt64() << 20;
+    limits.per_host = v.get("per_host_mb", (Json::Int64)(base.per_host >> 20)).asInt64() << 20;
+    limits.per_job = v.get("per_job_mb", (Json::Int64)(base.per_job >> 20)).asInt64() << 20;
+    return limits;
+}
+
+// "HH:MM" to minutes since midnight
+static bool parse_minute(const std::string& s, int& minute)
+{
+    int h = 0;
+    int m = 0;
+    if (sscanf(s.c_str(), "%d:%d", &h, &m) != 2 || h < 0 || h > 24 || m < 0 || m > 59)
+        return false;
+
+    minute = h * 60 + m;
+    return true;
 }
 
 bool parse_config(struct args& args)
@@ -110,11 +348,75 @@ bool parse_config(struct args& args)
     args.username = root["xenserver"]["username"].asString();
     args.password = root["xenserver"]["password"].asString();
     args.storage_dir = root["storage"]["dir"].asString();
+    args.options.vdi_parallel = root["backup"].get("vdi_parallel", args.options.vdi_parallel).asInt();
+    args.options.cbt = root["backup"].get("cbt", args.options.cbt).asBool();
+    args.options.probe_mb = root["backup"].get("probe_mb", args.options.probe_mb).asInt();
+    args.options.snapshot_ahead = root["backup"].get("snapshot_ahead", args.options.snapshot_ahead).asBool();
+    args.options.restore_parallel = root["restore"].get("vdi_parallel", args.options.restore_parallel).asInt();
+    args.options.boot_first = root["restore"].get("boot_first", args.options.boot_first).asBool();
+    args.options.jobs = root["scheduler"].get("jobs", args.options.jobs).asInt();
+    args.options.per_host = root["scheduler"].get("per_host", args.options.per_host).asInt();
+    args.options.per_sr = root["scheduler"].get("per_sr", args.options.per_sr).asInt();
+    args.options.rpc_pool_size = root["rpc"].get("pool_size", args.options.rpc_pool_size).asInt();
+    args.options.rpc_idle_timeout = root["rpc"].get("idle_timeout", args.options.rpc_idle_timeout).asInt();
+    args.options.rpc_tls_session_reuse = root["rpc"].get("tls_session_reuse",
+                                                         args.options.rpc_tls_session_reuse).asBool();
+    args.options.buffer_mb = root["pipeline"].get("buffer_mb", args.options.buffer_mb).asInt();
+    args.options.buffers = root["pipeline"].get("buffers", args.options.buffers).asInt();
+    args.options.sparse = root["storage"].get("sparse", args.options.sparse).asBool();
+    args.options.compress = root["storage"].get("compress", args.options.compress).asBool();
+    args.options.compress_level = root["storage"].get("compress_level", args.options.compress_level).asInt();
+    args.options.compress_threads = root["storage"].get("compress_threads",
+                                                        args.options.compress_threads).asInt();
+    args.options.dedup = root["storage"].get("dedup", args.options.dedup).asBool();
+    args.options.chunk_kb = root["storage"].get("chunk_kb", args.options.chunk_kb).asInt();
+    args.options.retries = root["transfer"].get("retries", args.options.retries).asInt();
+    args.options.resume = root["transfer"].get("resume", args.options.resume).asBool();
+    args.options.journal_mb = root["transfer"].get("journal_mb", args.options.journal_mb).asInt();
+    args.options.segment_mb = root["transfer"].get("segment_mb", args.options.segment_mb).asInt();
+    args.options.transfer_threads = root["transfer"].get("threads", args.options.transfer_threads).asInt();
+    args.options.throttle = parse_limits(root["throttle"], args.options.throttle);
+    for (const auto& w : root["throttle"]["schedule"]) {
+        struct throttle_window window;
+        if (!parse_minute(w["from"].asString(), window.from) || !parse_minute(w["to"].asString(), window.to)) {
+            std::cout << "Invalid throttle schedule, from and to are HH:MM" << std::endl;
+            return false;
+        }
+        window.limits = parse_limits(w, args.options.throttle);
+        args.options.throttle_schedule.push_back(window);
+    }
     std::cout << "=================== args ======================" << std::endl;
     std::cout << "url: " << args.url << std::endl;
     std::cout << "username: " << args.username << std::endl;
     std::cout << "password: " << args.password << std::endl;
     std::cout << "storage_dir: " << args.storage_dir << std::endl;
+    std::cout << "vdi_parallel: " << args.options.vdi_parallel << ", restore vdi_parallel: "
+              << args.options.restore_parallel << ", boot_first: " << args.options.boot_first << std::endl;
+    std::cout << "jobs: " << args.options.jobs << ", per_host: " << args.options.per_host
+              << ", per_sr: " << args.options.per_sr << std::endl;
+    std::cout << "rpc pool_size: " << args.options.rpc_pool_size << ", idle_timeout: "
+              << args.options.rpc_idle_timeout << ", tls_session_reuse: "
+              << args.options.rpc_tls_session_reuse << std::endl;
+    std::cout << "pipeline buffer_mb: " << args.options.buffer_mb << ", buffers: "
+              << args.options.buffers << std::endl;
+    std::cout << "sparse: " << args.options.sparse << std::endl;
+    std::cout << "compress: " << args.options.compress << ", level: " << args.options.compress_level
+              << ", threads: " << args.options.compress_threads << std::endl;
+    std::cout << "cbt: " << args.options.cbt << ", probe_mb: " << args.options.probe_mb
+              << ", snapshot_ahead: " << args.options.snapshot_ahead << std::endl;
+    std::cout << "dedup: " << args.options.dedup << ", chunk_kb: " << args.options.chunk_kb << std::endl;
+    std::cout << "transfer retries: " << args.options.retries << ", resume: " << args.options.resume
+              << ", journal_mb: " << args.options.journal_mb << ", segment_mb: "
+              << args.options.segment_mb << ", threads: " << args.options.transfer_threads << std::endl;
+    std::cout << "throttle global_mb: " << (args.options.throttle.global >> 20) << ", per_host_mb: "
+              << (args.options.throttle.per_host >> 20) << ", per_job_mb: "
+              << (args.options.throttle.per_job >> 20) << std::endl;
+    for (const auto& w : args.options.throttle_schedule) {
+        std::cout << "throttle " << w.from / 60 << ":" << std::setw(2) << std::setfill('0') << w.from % 60
+                  << "-" << w.to / 60 << ":" << std::setw(2) << w.to % 60 << std::setfill(' ')
+                  << " global_mb: " << (w.limits.global >> 20) << ", per_host_mb: "
+                  << (w.limits.per_host >> 20) << ", per_job_mb: " << (w.limits.per_job >> 20) << std::endl;
+    }
     std::cout << "===============================================" << std::endl;
     std::cout << std::endl;
     return true;
@@ -138,15 +440,43 @@ int main(int argc, char*argv[])
                 dump_vm(args);
                 return 0;
             } else if (strcmp(argv[i], "backup") == 0) {
-                if (argc == 3) {
+                if (argc == 3 && strcmp(argv[2], "--all") == 0) {
+                    backup_batch(args, "", "full");
+                    return 0;
+                } else if (argc == 4 && strcmp(argv[2], "--tag") == 0) {
+                    backup_batch(args, argv[3], "full");
+                    return 0;
+                } else if (argc == 3) {
                     backup_vm(args, argv[2]);
                     return 0;
                 }
             } else if (strcmp(argv[i], "backup_diff") == 0) {
-                if (argc == 3) {
+                if (argc == 3 && strcmp(argv[2], "--all") == 0) {
+                    backup_batch(args, "", "diff");
+                    return 0;
+                } else if (argc == 4 && strcmp(argv[2], "--tag") == 0) {
+                    backup_batch(args, argv[3], "diff");
+                    return 0;
+                } else if (argc == 3) {
                     backup_vm_diff(args, argv[2]);
                     return 0;
                 }
+            } else if (strcmp(argv[i], "backup_incr") == 0) {
+                if (argc == 3 && strcmp(argv[2], "--all") == 0) {
+                    backup_batch(args, "", "incr");
+                    return 0;
+                } else if (argc == 4 && strcmp(argv[2], "--tag") == 0) {
+                    backup_batch(args, argv[3], "incr");
+                    return 0;
+                } else if (argc == 3) {
+                    backup_vm_incr(args, argv[2]);
+                    return 0;
+                }
+            } else if (strcmp(argv[i], "synth") == 0) {
+                if (argc == 3) {
+                    synth_vm(args, argv[2]);
+                    return 0;
+                }
             } else if (strcmp(argv[i], "srs") == 0) {
                 dump_srs(args);
                 return 0;
@@ -161,7 +491,18 @@ int main(int argc, char*argv[])
                 return 0;
             } else if (strcmp(argv[i], "restore") == 0) {
                 if (argc == 3) {
-                    restore_vm(args, argv[2]);
+                    restore_vm(args, argv[2], false);
+                    return 0;
+                } else if (argc == 4 && strcmp(argv[3], "--boot-first") == 0) {
+                    restore_vm(args, argv[2], true);
+                    return 0;
+                }
+            } else if (strcmp(argv[i], "restore_disk") == 0) {
+                if (argc == 6 && (strcmp(argv[4], "--sr") == 0 || strcmp(argv[4], "--vdi") == 0))
+                    return restore_disks(args, argv[2], argv[3], argv[4], argv[5]) ? 0 : 1;
+            } else if (strcmp(argv[i], "restore_batch") == 0) {
+                if (argc == 3) {
+                    restore_batch(args, argv[2]);
                     return 0;
                 }
             } else if (strcmp(argv[i], "rm") == 0) {
@@ -169,6 +510,9 @@ int main(int argc, char*argv[])
                     rm_backup_set(args, argv[2]);
                     return 0;
                 }
+            } else if (strcmp(argv[i], "verify") == 0) {
+                if (argc == 3)
+                    return verify_backup_set(args, argv[2]) ? 0 : 1;
             }
         }
     }
@@ -0,0 +1,357 @@
+#include "nbd.h"
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+#define NBD_MAGIC 0x4e42444d41474943ULL        // "NBDMAGIC"
+#define NBD_OPT_MAGIC 0x49484156454f5054ULL    // "IHAVEOPT"
+#define NBD_REP_MAGIC 0x3e889045565a9ULL
+#define NBD_REQUEST_MAGIC 0x25609513
+#define NBD_REPLY_MAGIC 0x67446698
+
+#define NBD_FLAG_FIXED_NEWSTYLE 1
+#define NBD_FLAG_NO_ZEROES 2
+
+#define NBD_OPT_EXPORT_NAME 1
+#define NBD_OPT_STARTTLS 5
+#define NBD_OPT_GO 7
+
+#define NBD_REP_ACK 1
+#define NBD_REP_INFO 3
+#define NBD_REP_FLAG_ERROR 0x80000000U
+#define NBD_REP_ERR_UNSUP 0x80000001U
+#define NBD_INFO_EXPORT 0
+
+#define NBD_CMD_READ 0
+#define NBD_CMD_DISC 2
+
+// larger option replies are not something a sane server sends
+#define NBD_MAX_REPLY (1 << 20)
+#define NBD_MAX_READ (32 << 20)
+
+static void put_be16(char* p, uint16_t v)
+{
+    p[0] = (char)(v >> 8);
+    p[1] = (char)v;
+}
+
+static void put_be32(char* p, uint32_t v)
+{
+    p[0] = (char)(v >> 24);
+    p[1] = (char)(v >> 16);
+    p[2] = (char)(v >> 8);
+    p[3] = (char)v;
+}
+
+static void put_be64(char* p, uint64_t v)
+{
+    put_be32(p, (uint32_t)(v >> 32));
+    put_be32(p + 4, (uint32_t)v);
+}
+
+static uint16_t get_be16(const char* p)
+{
+    const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+    return (uint16_t)((u[0] << 8) | u[1]);
+}
+
+static uint32_t get_be32(const char* p)
+{
+    const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+    return ((uint32_t)u[0] << 24) | ((uint32_t)u[1] << 16) | ((uint32_t)u[2] << 8) | u[3];
+}
+
+static uint64_t get_be64(const char* p)
+{
+    return ((uint64_t)get_be32(p) << 32) | get_be32(p + 4);
+}
+
+Nbd_Client::~Nbd_Client()
+{
+    close();
+}
+
+bool Nbd_Client::connect(const std::string& address, int port,
+                         const std::string& export_name, const std::string& cert)
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo* res = nullptr;
+    if (getaddrinfo(address.c_str(), std::to_string(port).c_str(), &hints, &res) != 0) {
+        std::cout << "Failed to resolve nbd server " << address << std::endl;
+        return false;
+    }
+
+    for (struct addrinfo* ai = res; ai && fd_ < 0; ai = ai->ai_next) {
+        fd_ = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd_ >= 0 && ::connect(fd_, ai->ai_addr, ai->ai_addrlen) != 0) {
+            ::close(fd_);
+            fd_ = -1;
+        }
+    }
+    freeaddrinfo(res);
+
+    if (fd_ < 0) {
+        std::cout << "Failed to connect nbd server " << address << ":" << port << std::endl;
+        return false;
+    }
+
+    const int one = 1;
+    setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    char hello[18];
+    if (!recv_all(hello, sizeof(hello)) || get_be64(hello) != NBD_MAGIC
+        || get_be64(hello + 8) != NBD_OPT_MAGIC) {
+        std::cout << "Failed to read nbd handshake from " << address << std::endl;
+        close();
+        return false;
+    }
+
+    const uint16_t flags = get_be16(hello + 16);
+    if (!(flags & NBD_FLAG_FIXED_NEWSTYLE)) {
+        std::cout << "nbd server " << address << " is not fixed newstyle" << std::endl;
+        close();
+        return false;
+    }
+
+    no_zeroes_ = flags & NBD_FLAG_NO_ZEROES;
+    char client_flags[4];
+    put_be32(client_flags, NBD_FLAG_FIXED_NEWSTYLE | (no_zeroes_ ? NBD_FLAG_NO_ZEROES : 0));
+    if (!send_all(client_flags, sizeof(client_flags))) {
+        close();
+        return false;
+    }
+
+    if (!cert.empty() && !start_tls(cert)) {
+        close();
+        return false;
+    }
+
+    bool unsupported = false;
+    if (!go(export_name, unsupported) && (!unsupported || !this->export_name(export_name))) {
+        std::cout << "Failed to open nbd export " << export_name << std::endl;
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+void Nbd_Client::close()
+{
+    if (fd_ >= 0 && size_ > 0) {
+        // polite disconnect, the server may already be gone
+        char req[28];
+        put_be32(req, NBD_REQUEST_MAGIC);
+        put_be16(req + 4, 0);
+        put_be16(req + 6, NBD_CMD_DISC);
+        put_be64(req + 8, handle_++);
+        put_be64(req + 16, 0);
+        put_be32(req + 24, 0);
+        send_all(req, sizeof(req));
+    }
+
+    if (ssl_) {
+        SSL_shutdown(ssl_);
+        SSL_free(ssl_);
+        ssl_ = nullptr;
+    }
+
+    if (ctx_) {
+        SSL_CTX_free(ctx_);
+        ctx_ = nullptr;
+    }
+
+    if (fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+    }
+    size_ = 0;
+}
+
+bool Nbd_Client::send_all(const void* p, size_t len)
+{
+    const char* c = static_cast<const char*>(p);
+    while (len > 0) {
+        const int n = ssl_ ? SSL_write(ssl_, c, (int)std::min<size_t>(len, 1 << 30))
+                           : (int)::send(fd_, c, len, MSG_NOSIGNAL);
+        if (n <= 0)
+            return false;
+        c += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+bool Nbd_Client::recv_all(void* p, size_t len)
+{
+    char* c = static_cast<char*>(p);
+    while (len > 0) {
+        const int n = ssl_ ? SSL_read(ssl_, c, (int)std::min<size_t>(len, 1 << 30))
+                           : (int)::recv(fd_, c, len, 0);
+        if (n <= 0)
+            return false;
+        c += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+bool Nbd_Client::send_option(uint32_t option, const std::string& data)
+{
+    char head[16];
+    put_be64(head, NBD_OPT_MAGIC);
+    put_be32(head + 8, option);
+    put_be32(head + 12, (uint32_t)data.size());
+    return send_all(head, sizeof(head)) && send_all(data.data(), data.size());
+}
+
+bool Nbd_Client::recv_reply(uint32_t option, uint32_t& type, std::string& data)
+{
+    char head[20];
+    if (!recv_all(head, sizeof(head)) || get_be64(head) != NBD_REP_MAGIC || get_be32(head + 8) != option)
+        return false;
+
+    type = get_be32(head + 12);
+    const uint32_t len = get_be32(head + 16);
+    if (len > NBD_MAX_REPLY)
+        return false;
+
+    data.resize(len);
+    return recv_all(&data[0], len);
+}
+
+bool Nbd_Client::start_tls(const std::string& cert)
+{
+    uint32_t type = 0;
+    std::string data;
+    if (!send_option(NBD_OPT_STARTTLS, "") || !recv_reply(NBD_OPT_STARTTLS, type, data)
+        || type != NBD_REP_ACK) {
+        std::cout << "nbd server refused STARTTLS" << std::endl;
+        return false;
+    }
+
+    ctx_ = SSL_CTX_new(TLS_client_method());
+    if (!ctx_)
+        return false;
+
+    // the cert from xapi is the only one trusted, it need not be a root
+    BIO* bio = BIO_new_mem_buf(cert.data(), (int)cert.size());
+    X509* x509 = bio ? PEM_read_bio_X509(bio, nullptr, nullptr, nullptr) : nullptr;
+    BIO_free(bio);
+    if (!x509) {
+        std::cout << "Failed to parse nbd server cert" << std::endl;
+        return false;
+    }
+
+    X509_STORE* store = SSL_CTX_get_cert_store(ctx_);
+    X509_STORE_add_cert(store, x509);
+    X509_STORE_set_flags(store, X509_V_FLAG_PARTIAL_CHAIN);
+    X509_free(x509);
+    SSL_CTX_set_verify(ctx_, SSL_VERIFY_PEER, nullptr);
+
+    ssl_ = SSL_new(ctx_);
+    if (!ssl_ || SSL_set_fd(ssl_, fd_) != 1 || SSL_connect(ssl_) != 1) {
+        std::cout << "Failed tls handshake with nbd server" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool Nbd_Client::go(const std::string& name, bool& unsupported)
+{
+    std::string req(4, '\0');
+    put_be32(&req[0], (uint32_t)name.size());
+    req.append(name);
+    req.append(2, '\0');        // no info requests, the export size always comes
+    if (!send_option(NBD_OPT_GO, req))
+        return false;
+
+    for (;;) {
+        uint32_t type = 0;
+        std::string data;
+        if (!recv_reply(NBD_OPT_GO, type, data))
+            return false;
+
+        if (type == NBD_REP_ACK)
+            return size_ > 0;
+
+        if (type & NBD_REP_FLAG_ERROR) {
+            unsupported = type == NBD_REP_ERR_UNSUP;
+            if (!unsupported)
+                std::cout << "nbd server rejected export " << name << ": " << data << std::endl;
+            return false;
+        }
+
+        if (type == NBD_REP_INFO && data.size() >= 12 && get_be16(data.data()) == NBD_INFO_EXPORT)
+            size_ = (int64_t)get_be64(data.data() + 2);
+    }
+}
+
+bool Nbd_Client::export_name(const std::string& name)
+{
+    if (!send_option(NBD_OPT_EXPORT_NAME, name))
+        return false;
+
+    // size, transmission flags and, for old clients, 124 zero bytes
+    char reply[10 + 124];
+    if (!recv_all(reply, no_zeroes_ ? 10 : sizeof(reply)))
+        return false;
+
+    size_ = (int64_t)get_be64(reply);
+    return size_ > 0;
+}
+
+bool Nbd_Client::read_at(int64_t offset, char* dst, size_t len)
+{
+    if (fd_ < 0 || offset < 0 || offset + (int64_t)len > size_)
+        return false;
+
+    while (len > 0) {
+        const uint32_t n = (uint32_t)std::min<size_t>(len, NBD_MAX_READ);
+        const uint64_t handle = handle_++;
+        char req[28];
+        put_be32(req, NBD_REQUEST_MAGIC);
+        put_be16(req + 4, 0);
+        put_be16(req + 6, NBD_CMD_READ);
+        put_be64(req + 8, handle);
+        put_be64(req + 16, (uint64_t)offset);
+        put_be32(req + 24, n);
+
+        char reply[16];
+        if (!send_all(req, sizeof(req)) || !recv_all(reply, sizeof(reply))
+            || get_be32(reply) != NBD_REPLY_MAGIC || get_be64(reply + 8) != handle) {
+            std::cout << "Failed nbd read at " << offset << std::endl;
+            return false;
+        }
+
+        if (get_be32(reply + 4) != 0) {
+            std::cout << "nbd read at " << offset << " failed with error " << get_be32(reply + 4) << std::endl;
+            return false;
+        }
+
+        if (!recv_all(dst, n))
+            return false;
+
+        bytes_read_ += n;
+        dst += n;
+        offset += n;
+        len -= n;
+    }
+
+    return true;
+}
@@ -0,0 +1,51 @@
+#ifndef NBD_
+#define NBD_
+
+#include "pipeline.h"
+#include <string>
+#include <cstdint>
+
+struct ssl_st;
+struct ssl_ctx_st;
+
+// Client of the nbd export xapi offers for a vdi, see VDI.get_nbd_info:
+// fixed newstyle handshake, NBD_OPT_GO with a fallback to
+// NBD_OPT_EXPORT_NAME, and plain reads. With a cert the connection is
+// upgraded by NBD_OPT_STARTTLS and the server has to present that cert.
+class Nbd_Client : public Source
+{
+public:
+    Nbd_Client() {}
+    ~Nbd_Client();
+
+    Nbd_Client(const Nbd_Client&) = delete;
+    Nbd_Client& operator=(const Nbd_Client&) = delete;
+
+    // cert empty means no tls, for insecure_nbd networks
+    bool connect(const std::string& address, int port,
+                 const std::string& export_name, const std::string& cert);
+    void close();
+
+    int64_t size() const override { return size_; }
+    bool read_at(int64_t offset, char* dst, size_t len) override;
+    int64_t bytes_read() const { return bytes_read_; }
+private:
+    bool send_all(const void* p, size_t len);
+    bool recv_all(void* p, size_t len);
+    bool send_option(uint32_t option, const std::string& data);
+    bool recv_reply(uint32_t option, uint32_t& type, std::string& data);
+    bool start_tls(const std::string& cert);
+    bool go(const std::string& name, bool& unsupported);
+    bool export_name(const std::string& name);
+
+private:
+    int fd_ = -1;
+    struct ssl_ctx_st* ctx_ = nullptr;
+    struct ssl_st* ssl_ = nullptr;
+    bool no_zeroes_ = false;
+    int64_t size_ = 0;
+    uint64_t handle_ = 0;
+    int64_t bytes_read_ = 0;
+};
+
+#endif // NBD_
@@ -0,0 +1,532 @@
+#include "pipeline.h"
+#include "zero.h"
+#include "throttle.h"
+#include <curl/curl.h>
+#include <iostream>
+#include <map>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <cerrno>
+
+Buffer_Pool::Buffer_Pool(size_t count, size_t size)
+    : size_(size)
+{
+    for (size_t i = 0; i < count; i++) {
+        all_.emplace_back(new buffer());
+        all_.back()->data.resize(size);
+        free_.push_back(all_.back().get());
+    }
+}
+
+struct buffer* Buffer_Pool::get()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [this]() { return !free_.empty(); });
+    struct buffer* b = free_.back();
+    free_.pop_back();
+    b->size = 0;
+    b->offset = 0;
+    b->raw_size = 0;
+    b->hash_state.clear();
+    return b;
+}
+
+struct buffer* Buffer_Pool::try_get(std::function<void()> ready)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (free_.empty()) {
+        ready_ = std::move(ready);
+        return nullptr;
+    }
+
+    struct buffer* b = free_.back();
+    free_.pop_back();
+    b->size = 0;
+    b->offset = 0;
+    b->raw_size = 0;
+    b->hash_state.clear();
+    return b;
+}
+
+void Buffer_Pool::put(struct buffer* b)
+{
+    std::function<void()> ready;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        free_.push_back(b);
+        cond_.notify_one();
+        ready.swap(ready_);
+    }
+
+    // outside the lock, ready may well take a buffer right away
+    if (ready)
+        ready();
+}
+
+File_Sink::File_Sink(const std::string& file, bool sparse, int64_t resume_at)
+    : file_(file), sparse_(sparse), pos_(resume_at)
+{
+    fd_ = ::open(file.c_str(), O_WRONLY | O_CREAT | (resume_at > 0 ? 0 : O_TRUNC), 0644);
+    if (fd_ < 0) {
+        std::cout << "Failed to open file: " << file_ << std::endl;
+        return;
+    }
+
+    // drop whatever was written after the journaled offset
+    if (resume_at > 0 && ftruncate(fd_, resume_at) != 0) {
+        std::cout << "Failed to truncate file: " << file_ << std::endl;
+        ::close(fd_);
+        fd_ = -1;
+    }
+}
+
+File_Sink::~File_Sink()
+{
+    if (fd_ >= 0)
+        ::close(fd_);
+}
+
+bool File_Sink::write_at(const char* p, size_t len, int64_t offset)
+{
+    while (len > 0) {
+        const ssize_t n = pwrite(fd_, p, len, offset);
+        if (n <= 0)
+            return false;
+
+        p += n;
+        offset += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+bool File_Sink::write(const struct buffer& b)
+{
+    if (fd_ < 0)
+        return false;
+
+    const char* p = b.data.data();
+    const size_t len = b.size;
+    if (!sparse_) {
+        if (!write_at(p, len, pos_))
+            return false;
+        pos_ += len;
+        return true;
+    }
+
+    // write runs of non zero blocks, the file ends at pos_ so skipped blocks are holes
+    size_t i = 0;
+    while (i < len) {
+        while (i < len && is_zero(p + i, std::min<size_t>(ZERO_BLOCK, len - i)))
+            i += std::min<size_t>(ZERO_BLOCK, len - i);
+
+        const size_t start = i;
+        while (i < len && !is_zero(p + i, std::min<size_t>(ZERO_BLOCK, len - i)))
+            i += std::min<size_t>(ZERO_BLOCK, len - i);
+
+        if (i > start && !write_at(p + start, i - start, pos_ + start))
+            return false;
+    }
+
+    pos_ += len;
+    return true;
+}
+
+bool File_Sink::close()
+{
+    if (fd_ < 0)
+        return false;
+
+    // a trailing hole only exists once the size is set
+    const bool ok = ftruncate(fd_, pos_) == 0;
+    const bool closed = ::close(fd_) == 0;
+    fd_ = -1;
+    return ok && closed;
+}
+
+bool File_Sink::sync()
+{
+    return fd_ >= 0 && fdatasync(fd_) == 0;
+}
+
+bool load_journal(const std::string& file, struct transfer_journal& j)
+{
+    std::ifstream in(file);
+    std::string state;
+    int done = 0;
+    if (!(in >> j.offset >> state >> done) || j.offset < 0)
+        return false;
+
+    Xxh64 check;
+    if (!check.set_state(state))
+        return false;
+
+    j.hash_state = state;
+    j.done = done != 0;
+    return true;
+}
+
+bool save_journal(const std::string& file, const struct transfer_journal& j)
+{
+    // a crash leaves either the old or the new journal, never half of one
+    const std::string tmp = file + ".tmp";
+    const int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+
+    const std::string line = std::to_string(j.offset) + " " + j.hash_state + " "
+                             + (j.done ? "1" : "0") + "\n";
+    const bool ok = ::write(fd, line.data(), line.size()) == (ssize_t)line.size()
+                    && fdatasync(fd) == 0;
+    ::close(fd);
+    return ok && rename(tmp.c_str(), file.c_str()) == 0;
+}
+
+File_Source::File_Source(const std::string& file)
+{
+    fd_ = ::open(file.c_str(), O_RDONLY);
+    if (fd_ < 0) {
+        std::cout << "Failed to open file: " << file << std::endl;
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fd_, &st) == 0)
+        size_ = st.st_size;
+}
+
+File_Source::~File_Source()
+{
+    if (fd_ >= 0)
+        ::close(fd_);
+}
+
+void File_Source::find_extent(int64_t offset)
+{
+    extent_start_ = offset;
+    extent_end_ = size_;
+    extent_data_ = true;
+
+#ifdef SEEK_DATA
+    const off_t data = lseek(fd_, offset, SEEK_DATA);
+    if (data < 0) {
+        // ENXIO: only a hole is left, anything else: holes are not supported
+        extent_data_ = errno != ENXIO;
+        return;
+    }
+
+    if (data > offset) {
+        extent_end_ = std::min<int64_t>(data, size_);
+        extent_data_ = false;
+        return;
+    }
+
+    const off_t hole = lseek(fd_, offset, SEEK_HOLE);
+    if (hole > offset)
+        extent_end_ = std::min<int64_t>(hole, size_);
+#endif
+}
+
+bool File_Source::read_at(int64_t offset, char* dst, size_t len)
+{
+    if (fd_ < 0 || offset < 0 || offset + (int64_t)len > size_)
+        return false;
+
+    while (len > 0) {
+        if (offset < extent_start_ || offset >= extent_end_)
+            find_extent(offset);
+
+        size_t n = std::min<int64_t>(len, extent_end_ - offset);
+        if (extent_data_) {
+            const ssize_t r = pread(fd_, dst, n, offset);
+            if (r <= 0)
+                return false;
+            n = r;
+        } else {
+            memset(dst, 0, n);
+        }
+
+        dst += n;
+        offset += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+size_t source_reader::curl_read(char* buffer, size_t size, size_t nitems, void* userp)
+{
+    source_reader* r = static_cast<source_reader*>(userp);
+    const int64_t left = r->source->size() - r->pos;
+    const size_t n = (size_t)std::min<int64_t>(left, (int64_t)(size * nitems));
+    if (n == 0)
+        return 0;
+
+    if (r->throttle && !r->throttle->take(n, r->ready))
+        return CURL_READFUNC_PAUSE;
+
+    if (!r->source->read_at(r->pos, buffer, n)) {
+        std::cout << "Failed to read source at " << r->pos << std::endl;
+        return CURL_READFUNC_ABORT;
+    }
+
+    r->pos += n;
+    return n;
+}
+
+Download_Pipeline::Download_Pipeline(std::unique_ptr<Sink> sink,
+                                     std::unique_ptr<Codec> codec,
+                                     const struct pipeline_options& opts)
+    : sink_(std::move(sink)),
+      codec_(std::move(codec)),
+      opts_(opts),
+      pool_(std::max<size_t>(2, opts.buffers), opts.buffer_size),
+      codec_pool_(codec_ ? std::max<size_t>(2, opts.buffers) : 0, opts.buffer_size),
+      // room for every buffer, so feed only ever waits for the pool
+      hash_queue_(std::max<size_t>(2, opts.buffers)),
+      codec_queue_(std::max<size_t>(1, opts.buffers / 2)),
+      write_queue_(std::max<size_t>(2, opts.buffers))
+{
+    threads_.emplace_back(&Download_Pipeline::hash_stage, this);
+    if (codec_) {
+        const int n = std::max(1, opts_.codec_threads);
+        for (int i = 0; i < n; i++)
+            threads_.emplace_back(&Download_Pipeline::codec_stage, this);
+    }
+    threads_.emplace_back(&Download_Pipeline::write_stage, this);
+}
+
+Download_Pipeline::~Download_Pipeline()
+{
+    if (!finished_)
+        finish(false);
+}
+
+void Download_Pipeline::fail()
+{
+    failed_ = true;
+}
+
+bool Download_Pipeline::resume(const struct transfer_journal& j)
+{
+    if (seq_ > 0 || current_ || !hash_.set_state(j.hash_state))
+        return false;
+
+    offset_ = j.offset;
+    journaled_ = j.offset;
+    return true;
+}
+
+bool Download_Pipeline::feed(const char* data, size_t len)
+{
+    while (len > 0) {
+        if (failed_)
+            return false;
+
+        if (!current_) {
+            current_ = next_buffer();
+            current_->offset = offset_;
+            current_->seq = seq_++;
+        }
+
+        const size_t n = std::min(len, pool_.buffer_size() - current_->size);
+        memcpy(current_->data.data() + current_->size, data, n);
+        current_->size += n;
+        current_->raw_size = current_->size;
+        offset_ += n;
+        data += n;
+        len -= n;
+
+        if (current_->size == pool_.buffer_size()) {
+            hash_queue_.push(current_);
+            current_ = nullptr;
+        }
+    }
+
+    return !failed_;
+}
+
+bool Download_Pipeline::try_feed(const char* data, size_t len, std::function<void()> ready)
+{
+    if (failed_)
+        return false;
+
+    // every buffer the data needs is taken first, so feed does not block
+    const size_t room = current_ ? pool_.buffer_size() - current_->size : 0;
+    if (len > room) {
+        const size_t need = (len - room + pool_.buffer_size() - 1) / pool_.buffer_size();
+        while (spare_.size() < need) {
+            struct buffer* b = pool_.try_get(ready);
+            if (!b)
+                return false;
+            spare_.push_back(b);
+        }
+    }
+
+    return feed(data, len);
+}
+
+struct buffer* Download_Pipeline::next_buffer()
+{
+    if (spare_.empty())
+        return pool_.get();
+
+    struct buffer* b = spare_.back();
+    spare_.pop_back();
+    return b;
+}
+
+void Download_Pipeline::hash_stage()
+{
+    struct buffer* b = nullptr;
+    while (hash_queue_.pop(b)) {
+        if (!failed_) {
+            hash_.update(b->data.data(), b->size);
+            if (!opts_.journal.empty())
+                b->hash_state = hash_.state();
+        }
+
+        if (codec_)
+            codec_queue_.push(b);
+        else
+            write_queue_.push({b, nullptr});
+    }
+
+    if (codec_)
+        codec_queue_.close();
+    else
+        write_queue_.close();
+}
+
+void Download_Pipeline::codec_stage()
+{
+    struct buffer* b = nullptr;
+    while (codec_queue_.pop(b)) {
+        struct buffer* out = codec_pool_.get();
+        out->seq = b->seq;
+        out->offset = b->offset;
+        out->raw_size = b->size;
+        if (!failed_ && !codec_->encode(*b, *out)) {
+            std::cout << "Failed to encode buffer at " << b->offset << std::endl;
+            fail();
+        }
+        write_queue_.push({b, out});
+    }
+
+    // tell the writer this codec thread is done
+    write_queue_.push({nullptr, nullptr});
+}
+
+void Download_Pipeline::write_stage()
+{
+    // codec threads finish out of order, write strictly by seq
+    std::map<uint64_t, std::pair<struct buffer*, struct buffer*>> pending;
+    uint64_t next = 0;
+    int producers = codec_ ? std::max(1, opts_.codec_threads) : 1;
+
+    std::pair<struct buffer*, struct buffer*> item;
+    while (producers > 0 && write_queue_.pop(item)) {
+        if (!item.first) {
+            producers--;
+            continue;
+        }
+
+        pending.emplace(item.first->seq, item);
+        for (auto it = pending.begin(); it != pending.end() && it->first == next;
+             it = pending.erase(it), next++) {
+            struct buffer* raw = it->second.first;
+            struct buffer* enc = it->second.second;
+            if (!failed_ && !sink_->write(enc ? *enc : *raw)) {
+                std::cout << "Failed to write buffer at " << raw->offset << std::endl;
+                fail();
+            }
+
+            if (!failed_ && !opts_.journal.empty()
+                && raw->offset + (int64_t)raw->size - journaled_ >= opts_.journal_bytes)
+                journal(*raw, false);
+
+            if (enc)
+                codec_pool_.put(enc);
+            pool_.put(raw);
+        }
+    }
+
+    // only left over after a failure upstream
+    for (auto& p : pending) {
+        if (p.second.second)
+            codec_pool_.put(p.second.second);
+        pool_.put(p.second.first);
+    }
+}
+
+bool Download_Pipeline::finish(bool complete)
+{
+    if (finished_)
+        return !failed_;
+    finished_ = true;
+
+    if (current_) {
+        if (current_->size > 0) {
+            hash_queue_.push(current_);
+        } else {
+            pool_.put(current_);
+        }
+        current_ = nullptr;
+    }
+
+    for (struct buffer* b : spare_)
+        pool_.put(b);
+    spare_.clear();
+
+    hash_queue_.close();
+    for (auto& t : threads_)
+        t.join();
+    threads_.clear();
+
+    if (complete && !failed_ && !opts_.journal.empty() && !sink_->sync()) {
+        std::cout << "Failed to sync sink" << std::endl;
+        fail();
+    }
+
+    if (!sink_->close()) {
+        std::cout << "Failed to close sink" << std::endl;
+        fail();
+    }
+
+    if (complete && !failed_ && !opts_.journal.empty()) {
+        struct buffer end;
+        end.offset = offset_;
+        end.hash_state = hash_.state();
+        journal(end, true);
+    }
+
+    return !failed_;
+}
+
+void Download_Pipeline::journal(const struct buffer& b, bool done)
+{
+    // data first, so the journal never points past what is on disk
+    if (!done && !sink_->sync())
+        return;
+
+    struct transfer_journal j;
+    j.offset = b.offset + (int64_t)b.size;
+    j.hash_state = b.hash_state;
+    j.done = done;
+    if (save_journal(opts_.journal, j))
+        journaled_ = j.offset;
+    else
+        std::cout << "Failed to save journal " << opts_.journal << std::endl;
+}
+
+size_t Download_Pipeline::curl_write(void* contents, size_t size, size_t nmemb, void* userp)
+{
+    const size_t total = size * nmemb;
+    Download_Pipeline* p = static_cast<Download_Pipeline*>(userp);
+    return p->feed(static_cast<const char*>(contents), total) ? total : 0;
+}
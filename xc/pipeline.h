@@ -0,0 +1,259 @@
+#ifndef PIPELINE_
+#define PIPELINE_
+
+#include "checksum.h"
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <functional>
+
+struct buffer {
+    std::vector<char> data;     // capacity is fixed by the pool
+    size_t size = 0;            // bytes used in data
+    int64_t offset = 0;         // offset of the raw bytes in the stream
+    size_t raw_size = 0;        // raw bytes this buffer stands for
+    uint64_t seq = 0;
+    std::string hash_state;     // of the stream up to the end of this buffer, for the journal
+};
+
+// Fixed set of large buffers reused for the whole transfer. get() blocks
+// while every buffer is in flight, which is what pushes back on the network.
+class Buffer_Pool
+{
+public:
+    Buffer_Pool(size_t count, size_t size);
+
+    struct buffer* get();
+    // null if no buffer is free, ready is then called once one is put back
+    struct buffer* try_get(std::function<void()> ready);
+    void put(struct buffer* b);
+    size_t buffer_size() const { return size_; }
+private:
+    size_t size_;
+    std::vector<std::unique_ptr<struct buffer>> all_;
+    std::vector<struct buffer*> free_;
+    std::function<void()> ready_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+};
+
+template<class T>
+class Bounded_Queue
+{
+public:
+    explicit Bounded_Queue(size_t capacity) : capacity_(capacity) {}
+
+    void push(T v)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(lock, [this]() { return items_.size() < capacity_; });
+        items_.push_back(std::move(v));
+        not_empty_.notify_one();
+    }
+
+    // false once the queue is closed and drained
+    bool pop(T& v)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [this]() { return !items_.empty() || closed_; });
+        if (items_.empty())
+            return false;
+
+        v = std::move(items_.front());
+        items_.pop_front();
+        not_full_.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        not_empty_.notify_all();
+    }
+private:
+    size_t capacity_;
+    bool closed_ = false;
+    std::deque<T> items_;
+    std::mutex mutex_;
+    std::condition_variable not_empty_;
+    std::condition_variable not_full_;
+};
+
+// Where a pipeline stores the stream. Buffers arrive in stream order.
+class Sink
+{
+public:
+    virtual ~Sink() {}
+    virtual bool write(const struct buffer& b) = 0;
+    virtual bool close() = 0;
+    // makes what was written durable, false if the sink can not be resumed
+    virtual bool sync() { return false; }
+};
+
+// With sparse, all zero blocks are seeked over instead of written, so the
+// file only allocates its data. resume_at keeps that many bytes of an
+// existing file and appends after them.
+class File_Sink : public Sink
+{
+public:
+    File_Sink(const std::string& file, bool sparse, int64_t resume_at = 0);
+    ~File_Sink();
+    bool write(const struct buffer& b) override;
+    bool close() override;
+    bool sync() override;
+private:
+    bool write_at(const char* p, size_t len, int64_t offset);
+
+private:
+    std::string file_;
+    bool sparse_;
+    int fd_ = -1;
+    int64_t pos_ = 0;
+};
+
+// Random access to the raw stream of a stored file, whatever its format
+class Source
+{
+public:
+    virtual ~Source() {}
+    virtual int64_t size() const = 0;
+    virtual bool read_at(int64_t offset, char* dst, size_t len) = 0;
+};
+
+// Holes of a sparse file are returned as zeros without reading them
+class File_Source : public Source
+{
+public:
+    explicit File_Source(const std::string& file);
+    ~File_Source();
+    bool is_open() const { return fd_ >= 0; }
+    int64_t size() const override { return size_; }
+    bool read_at(int64_t offset, char* dst, size_t len) override;
+private:
+    void find_extent(int64_t offset);
+
+private:
+    int fd_ = -1;
+    int64_t size_ = 0;
+    // data or hole extent around the last read
+    int64_t extent_start_ = 0;
+    int64_t extent_end_ = 0;
+    bool extent_data_ = true;
+};
+
+class Throttle_Stream;
+
+// Sequential reader over a source for uploads
+struct source_reader {
+    Source* source;
+    int64_t pos;
+    Throttle_Stream* throttle = nullptr;    // pauses the upload while it is over its rate
+    std::function<void()> ready;            // continues a paused upload
+
+    // curl CURLOPT_READFUNCTION, userp is a source_reader
+    static size_t curl_read(char* buffer, size_t size, size_t nitems, void* userp);
+};
+
+// Turns a raw buffer into its stored form, e.g. compresses it
+class Codec
+{
+public:
+    virtual ~Codec() {}
+    virtual bool encode(const struct buffer& in, struct buffer& out) = 0;
+};
+
+// Progress of a transfer, kept next to the file it is stored in. offset is
+// the first byte not known to be durable, hash_state the xxh64 of the
+// stream before it.
+struct transfer_journal {
+    int64_t offset = 0;
+    std::string hash_state;
+    bool done = false;
+};
+
+#define JOURNAL_SUFFIX ".journal"
+
+bool load_journal(const std::string& file, struct transfer_journal& j);
+bool save_journal(const std::string& file, const struct transfer_journal& j);
+
+struct pipeline_options {
+    size_t buffer_size = 4 << 20;
+    size_t buffers = 8;
+    int codec_threads = 2;
+    std::string journal;        // empty means no journal
+    int64_t journal_bytes = 256 << 20;  // synced and journaled every that many bytes
+};
+
+// receive -> hash -> encode -> write, every stage on its own thread and
+// connected by bounded queues. The receive stage is the caller (the curl
+// write callback) and only copies into pool buffers, so the socket keeps
+// draining while hashing, encoding or the disk catch up.
+class Download_Pipeline
+{
+public:
+    Download_Pipeline(std::unique_ptr<Sink> sink,
+                      std::unique_ptr<Codec> codec,
+                      const struct pipeline_options& opts);
+    ~Download_Pipeline();
+
+    Download_Pipeline(const Download_Pipeline&) = delete;
+    Download_Pipeline& operator=(const Download_Pipeline&) = delete;
+
+    // receive stage, false once a later stage failed
+    bool feed(const char* data, size_t len);
+    // receive stage for an event loop, never blocks. Takes all of data or,
+    // if the buffers it needs are in flight, nothing; then false is returned
+    // and ready is called once a buffer is free. Also false after failed().
+    bool try_feed(const char* data, size_t len, std::function<void()> ready);
+    // flushes and drains every stage, true if all bytes were stored.
+    // complete is false if the stream broke off, the journal then stays
+    // at the last durable offset.
+    bool finish(bool complete = true);
+    // continues the stream of a journal, before the first feed. The sink
+    // has to hold the first j.offset bytes already.
+    bool resume(const struct transfer_journal& j);
+
+    bool failed() const { return failed_; }
+    int64_t bytes() const { return offset_; }
+    std::string checksum() const { return hash_.hex(); }
+
+    // curl CURLOPT_WRITEFUNCTION, userp is the pipeline
+    static size_t curl_write(void* contents, size_t size, size_t nmemb, void* userp);
+private:
+    void hash_stage();
+    void codec_stage();
+    void write_stage();
+    void fail();
+    void journal(const struct buffer& b, bool done);
+    struct buffer* next_buffer();
+
+private:
+    std::unique_ptr<Sink> sink_;
+    std::unique_ptr<Codec> codec_;
+    struct pipeline_options opts_;
+
+    Buffer_Pool pool_;
+    Buffer_Pool codec_pool_;
+    Bounded_Queue<struct buffer*> hash_queue_;
+    Bounded_Queue<struct buffer*> codec_queue_;
+    Bounded_Queue<std::pair<struct buffer*, struct buffer*>> write_queue_;
+
+    struct buffer* current_ = nullptr;
+    std::vector<struct buffer*> spare_;     // taken by try_feed, not used yet
+    int64_t offset_ = 0;
+    uint64_t seq_ = 0;
+    Xxh64 hash_;
+    std::atomic<bool> failed_{false};
+    bool finished_ = false;
+    int64_t journaled_ = 0;
+
+    std::vector<std::thread> threads_;
+};
+
+#endif // PIPELINE_
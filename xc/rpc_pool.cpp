@@ -0,0 +1,166 @@
+#include "rpc_pool.h"
+#include <iostream>
+#include <map>
+#include <algorithm>
+
+typedef struct
+{
+    xen_result_func func;
+    void *handle;
+} xen_comms;
+
+static size_t write_func(void *ptr, size_t size, size_t nmemb, xen_comms *comms)
+{
+    size_t n = size * nmemb;
+    return comms->func(ptr, n, comms->handle) ? n : 0;
+}
+
+Rpc_Pool::Rpc_Pool(std::string url, int size, int idle_timeout, bool tls_session_reuse)
+    : url_(std::move(url)),
+      size_(std::max(1, size)),
+      idle_timeout_(std::max(1, idle_timeout)),
+      tls_session_reuse_(tls_session_reuse)
+{
+    share_ = curl_share_init();
+    if (share_) {
+        curl_share_setopt(share_, CURLSHOPT_LOCKFUNC, lock_func);
+        curl_share_setopt(share_, CURLSHOPT_UNLOCKFUNC, unlock_func);
+        curl_share_setopt(share_, CURLSHOPT_USERDATA, this);
+        curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+        if (tls_session_reuse_)
+            curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    }
+
+    // xapi answers straight away, don't wait for 100-continue on big posts
+    headers_ = curl_slist_append(headers_, "Expect:");
+    headers_ = curl_slist_append(headers_, "Content-Type: text/xml");
+}
+
+Rpc_Pool::~Rpc_Pool()
+{
+    for (auto curl : idle_)
+        curl_easy_cleanup(curl);
+
+    if (share_)
+        curl_share_cleanup(share_);
+
+    curl_slist_free_all(headers_);
+}
+
+std::shared_ptr<Rpc_Pool> Rpc_Pool::get(const std::string& url, int size,
+                                        int idle_timeout, bool tls_session_reuse)
+{
+    static std::mutex pools_mutex;
+    static std::map<std::string, std::shared_ptr<Rpc_Pool>> pools;
+
+    std::lock_guard<std::mutex> lock(pools_mutex);
+    auto& p = pools[url];
+    if (!p)
+        p = std::make_shared<Rpc_Pool>(url, size, idle_timeout, tls_session_reuse);
+
+    return p;
+}
+
+void Rpc_Pool::lock_func(CURL *handle, curl_lock_data data,
+                         curl_lock_access access, void *userptr)
+{
+    (void) handle;
+    (void) access;
+    static_cast<Rpc_Pool*>(userptr)->share_mutex_[data].lock();
+}
+
+void Rpc_Pool::unlock_func(CURL *handle, curl_lock_data data, void *userptr)
+{
+    (void) handle;
+    static_cast<Rpc_Pool*>(userptr)->share_mutex_[data].unlock();
+}
+
+CURL* Rpc_Pool::create()
+{
+    CURL *curl = curl_easy_init();
+    if (!curl)
+        return nullptr;
+
+    curl_easy_setopt(curl, CURLOPT_URL, url_.c_str());
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_POST, 1L);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers_);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &write_func);
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
+    curl_easy_setopt(curl, CURLOPT_SSL_SESSIONID_CACHE, tls_session_reuse_ ? 1L : 0L);
+    curl_easy_setopt(curl, CURLOPT_TCP_NODELAY, 1L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPIDLE, (long)idle_timeout_);
+    // connections idle for longer than this are not reused
+    curl_easy_setopt(curl, CURLOPT_MAXAGE_CONN, (long)idle_timeout_);
+    if (share_)
+        curl_easy_setopt(curl, CURLOPT_SHARE, share_);
+
+    return curl;
+}
+
+CURL* Rpc_Pool::acquire()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [this]() {
+        return !idle_.empty() || created_ < size_;
+    });
+
+    if (!idle_.empty()) {
+        CURL *curl = idle_.back();
+        idle_.pop_back();
+        return curl;
+    }
+
+    created_++;
+    lock.unlock();
+
+    CURL *curl = create();
+    if (!curl) {
+        lock.lock();
+        created_--;
+        cond_.notify_one();
+    }
+
+    return curl;
+}
+
+void Rpc_Pool::release(CURL* curl)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        idle_.push_back(curl);
+    }
+    cond_.notify_one();
+}
+
+int Rpc_Pool::call_func(const void *data, size_t len, void *user_handle,
+                        void *result_handle, xen_result_func result_func)
+{
+    Rpc_Pool *pool = static_cast<Rpc_Pool*>(user_handle);
+    CURL *curl = pool->acquire();
+    if (!curl)
+        return -1;
+
+    xen_comms comms = {
+        .func = result_func,
+        .handle = result_handle
+    };
+
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &comms);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, data);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)len);
+
+    CURLcode result = curl_easy_perform(curl);
+    if (result != CURLE_OK) {
+        std::cout << "xml-rpc call failed: " << curl_easy_strerror(result) << std::endl;
+    }
+
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, nullptr);
+    pool->release(curl);
+
+    return result;
+}
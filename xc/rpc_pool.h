@@ -0,0 +1,58 @@
+#ifndef RPC_POOL_
+#define RPC_POOL_
+
+extern "C"
+{
+#include <xen/api/xen_all.h>
+}
+#include <curl/curl.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+
+// Keep-alive transport for xml-rpc calls. Easy handles are created once and
+// handed out per call, connections, dns and tls sessions are shared between
+// them, so a call only pays a handshake when the server closed the socket.
+class Rpc_Pool
+{
+public:
+    Rpc_Pool(std::string url, int size, int idle_timeout, bool tls_session_reuse);
+    ~Rpc_Pool();
+
+    // one pool per url for the whole process
+    static std::shared_ptr<Rpc_Pool> get(const std::string& url, int size,
+                                         int idle_timeout, bool tls_session_reuse);
+
+    // xen_call_func, user_handle is the Rpc_Pool
+    static int call_func(const void *data, size_t len, void *user_handle,
+                         void *result_handle, xen_result_func result_func);
+
+    const std::string& url() const { return url_; }
+private:
+    CURL* acquire();
+    void release(CURL* curl);
+    CURL* create();
+
+    static void lock_func(CURL *handle, curl_lock_data data,
+                          curl_lock_access access, void *userptr);
+    static void unlock_func(CURL *handle, curl_lock_data data, void *userptr);
+
+private:
+    std::string url_;
+    int size_;
+    int idle_timeout_;
+    bool tls_session_reuse_;
+
+    CURLSH* share_ = nullptr;
+    struct curl_slist* headers_ = nullptr;
+    std::mutex share_mutex_[CURL_LOCK_DATA_LAST];
+
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::vector<CURL*> idle_;
+    int created_ = 0;
+};
+
+#endif // RPC_POOL_
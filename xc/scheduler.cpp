@@ -0,0 +1,133 @@
+#include "scheduler.h"
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+
+Job_Scheduler::Job_Scheduler(int workers, int per_host, int per_sr)
+    : workers_(std::max(1, workers)),
+      per_host_(std::max(1, per_host)),
+      per_sr_(std::max(1, per_sr))
+{
+}
+
+bool Job_Scheduler::runnable(const struct job& j) const
+{
+    if (!j.host.empty()) {
+        auto it = host_running_.find(j.host);
+        if (it != host_running_.end() && it->second >= per_host_)
+            return false;
+    }
+
+    for (const auto& s : j.srs) {
+        auto it = sr_running_.find(s);
+        if (it != sr_running_.end() && it->second >= per_sr_)
+            return false;
+    }
+
+    return true;
+}
+
+void Job_Scheduler::acquire(const struct job& j)
+{
+    if (!j.host.empty())
+        host_running_[j.host]++;
+
+    for (const auto& s : j.srs)
+        sr_running_[s]++;
+}
+
+void Job_Scheduler::release(const struct job& j)
+{
+    if (!j.host.empty())
+        host_running_[j.host]--;
+
+    for (const auto& s : j.srs)
+        sr_running_[s]--;
+}
+
+void Job_Scheduler::worker(std::vector<struct job>& jobs, const job_func& func, int id)
+{
+    for (;;) {
+        size_t k = jobs.size();
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cond_.wait(lock, [&]() {
+                if (pending_ == 0)
+                    return true;
+
+                for (size_t i = 0; i < jobs.size(); i++) {
+                    if (!started_[i] && runnable(jobs[i])) {
+                        k = i;
+                        return true;
+                    }
+                }
+                return false;
+            });
+
+            if (pending_ == 0)
+                return;
+
+            started_[k] = true;
+            pending_--;
+            acquire(jobs[k]);
+        }
+
+        struct job& j = jobs[k];
+        std::cout << "[worker " << id << "] start " << j.name << " (" << j.id << ")" << std::endl;
+        const auto start = std::chrono::steady_clock::now();
+        j.ok = func(j, id);
+        j.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "[worker " << id << "] " << (j.ok ? "done " : "failed ") << j.name
+                  << " in " << j.seconds << "s" << std::endl;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            release(j);
+        }
+        cond_.notify_all();
+    }
+}
+
+bool Job_Scheduler::run(std::vector<struct job>& jobs, const job_func& func)
+{
+    started_.assign(jobs.size(), false);
+    pending_ = jobs.size();
+    host_running_.clear();
+    sr_running_.clear();
+
+    const int n = std::min(workers_, (int)jobs.size());
+    std::vector<std::thread> threads;
+    for (int i = 0; i < n; i++) {
+        threads.emplace_back(&Job_Scheduler::worker, this, std::ref(jobs), std::cref(func), i);
+    }
+
+    for (auto& t : threads)
+        t.join();
+
+    return std::all_of(jobs.begin(), jobs.end(), [](const struct job& j) {
+        return j.ok;
+    });
+}
+
+void Job_Scheduler::report(const std::vector<struct job>& jobs, double seconds)
+{
+    int64_t total = 0;
+    int failed = 0;
+    std::cout << "================== jobs ==================" << std::endl;
+    for (const auto& j : jobs) {
+        std::cout << (j.ok ? "  ok     " : "  failed ") << j.name << " (" << j.id << ")"
+                  << ", bytes: " << j.bytes << ", seconds: " << j.seconds << std::endl;
+        total += j.bytes;
+        if (!j.ok)
+            failed++;
+    }
+
+    const double mb = (double)total / (1024 * 1024);
+    std::cout << "jobs: " << jobs.size() << ", failed: " << failed << std::endl;
+    std::cout << "total: " << std::fixed << std::setprecision(1) << mb << " MiB in "
+              << seconds << "s, " << (seconds > 0 ? mb / seconds : 0) << " MiB/s" << std::endl;
+    std::cout << std::defaultfloat;
+    std::cout << "==========================================" << std::endl;
+}
@@ -0,0 +1,55 @@
+#ifndef SCHEDULER_
+#define SCHEDULER_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+struct job {
+    std::string id;                 // vm uuid or set id
+    std::string name;
+    std::string host;               // host the job runs against, may be empty
+    std::vector<std::string> srs;   // srs the job reads from or writes to
+
+    bool ok = false;
+    int64_t bytes = 0;
+    double seconds = 0;
+};
+
+// Runs jobs on a fixed number of workers. A job is only started when its
+// host and every one of its srs are below their limits, so one xapi or one
+// disk array is never handed more than per_host / per_sr jobs at a time.
+class Job_Scheduler
+{
+public:
+    typedef std::function<bool(struct job& j, int worker)> job_func;
+
+    Job_Scheduler(int workers, int per_host, int per_sr);
+
+    // blocks until every job has run, returns false if any job failed
+    bool run(std::vector<struct job>& jobs, const job_func& func);
+
+    static void report(const std::vector<struct job>& jobs, double seconds);
+private:
+    bool runnable(const struct job& j) const;
+    void acquire(const struct job& j);
+    void release(const struct job& j);
+    void worker(std::vector<struct job>& jobs, const job_func& func, int id);
+
+private:
+    int workers_;
+    int per_host_;
+    int per_sr_;
+
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::vector<bool> started_;
+    size_t pending_ = 0;
+    std::map<std::string, int> host_running_;
+    std::map<std::string, int> sr_running_;
+};
+
+#endif // SCHEDULER_
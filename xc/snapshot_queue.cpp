@@ -0,0 +1,90 @@
+#include "snapshot_queue.h"
+
+std::shared_ptr<Snapshot_Queue> Snapshot_Queue::get()
+{
+    static std::mutex queue_mutex;
+    static std::shared_ptr<Snapshot_Queue> queue;
+
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    if (!queue)
+        queue = std::make_shared<Snapshot_Queue>();
+
+    return queue;
+}
+
+void Snapshot_Queue::expect(const std::string& vm_uuid, const std::string& name)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    struct ahead& a = ahead_[vm_uuid];
+    a.name = name;
+    a.ref.clear();
+    a.done = false;
+}
+
+void Snapshot_Queue::taken(const std::string& vm_uuid, const std::string& ref)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = ahead_.find(vm_uuid);
+    if (it == ahead_.end())
+        return;
+
+    it->second.ref = ref;
+    it->second.done = true;
+    cond_.notify_all();
+}
+
+bool Snapshot_Queue::take(const std::string& vm_uuid, std::string& name, std::string& ref)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!ahead_.count(vm_uuid))
+        return false;
+
+    cond_.wait(lock, [&]() { return ahead_[vm_uuid].done; });
+    name = ahead_[vm_uuid].name;
+    ref = ahead_[vm_uuid].ref;
+    ahead_.erase(vm_uuid);
+    return !ref.empty();
+}
+
+void Snapshot_Queue::open()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    open_ = true;
+}
+
+bool Snapshot_Queue::reap(const std::string& ref)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!open_)
+        return false;
+
+    reap_.push_back(ref);
+    cond_.notify_all();
+    return true;
+}
+
+bool Snapshot_Queue::next(std::string& ref)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [this]() { return !reap_.empty() || !open_; });
+    if (reap_.empty())
+        return false;
+
+    ref = reap_.front();
+    reap_.pop_front();
+    return true;
+}
+
+void Snapshot_Queue::close()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    // taken ahead for a vm whose backup never got to it
+    for (const auto& a : ahead_) {
+        if (a.second.done && !a.second.ref.empty())
+            reap_.push_back(a.second.ref);
+    }
+    ahead_.clear();
+
+    open_ = false;
+    cond_.notify_all();
+}
@@ -0,0 +1,58 @@
+#ifndef SNAPSHOT_QUEUE_
+#define SNAPSHOT_QUEUE_
+
+#include <string>
+#include <map>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+
+// Hands snapshots between the clients of a batch. A control client takes
+// the snapshots of every vm of the batch ahead, as async tasks that run at
+// the same time, and the worker backing a vm up picks its snapshot here
+// instead of taking one. Snapshots the workers are done with are queued
+// for the control client to delete, so cleanup does not hold up the next
+// export.
+class Snapshot_Queue
+{
+public:
+    Snapshot_Queue() {}
+
+    Snapshot_Queue(const Snapshot_Queue&) = delete;
+    Snapshot_Queue& operator=(const Snapshot_Queue&) = delete;
+
+    // one queue for the whole process
+    static std::shared_ptr<Snapshot_Queue> get();
+
+    // a snapshot of vm named name is being taken
+    void expect(const std::string& vm_uuid, const std::string& name);
+    // its task finished, ref is empty if it failed
+    void taken(const std::string& vm_uuid, const std::string& ref);
+    // waits for the snapshot taken ahead for vm, false if there is none or
+    // it failed. Every snapshot is only handed out once.
+    bool take(const std::string& vm_uuid, std::string& name, std::string& ref);
+
+    // from now on reap() queues snapshots instead of leaving them to the caller
+    void open();
+    // false if nobody deletes queued snapshots, the caller has to
+    bool reap(const std::string& ref);
+    // blocks for the next snapshot to delete, false once closed and empty
+    bool next(std::string& ref);
+    // after the last taken(), queues the snapshots never handed out
+    void close();
+private:
+    struct ahead {
+        std::string name;
+        std::string ref;
+        bool done = false;
+    };
+
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::map<std::string, struct ahead> ahead_;
+    std::deque<std::string> reap_;
+    bool open_ = false;
+};
+
+#endif // SNAPSHOT_QUEUE_
@@ -0,0 +1,77 @@
+#include "stripe.h"
+
+// weight of the newest measurement in the rate of a link
+#define RATE_WEIGHT 0.5
+// streams shorter than that say more about the export than the link
+#define MIN_SECONDS 1.0
+// how much faster another link has to be for a running stream to move
+#define MOVE_GAIN 2.0
+
+Stripe::Stripe(const std::vector<struct host_path>& paths)
+{
+    for (const auto& p : paths) {
+        struct link l;
+        l.ip = p.ip;
+        // unprobed links start out equal and are taken in turn
+        l.rate = p.mbps > 0 ? p.mbps : 1;
+        links_.push_back(l);
+    }
+}
+
+std::string Stripe::acquire(const std::string& avoid)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    struct link* best = nullptr;
+    for (auto& l : links_) {
+        if (l.ip == avoid && links_.size() > 1)
+            continue;
+        if (!best || l.rate / (l.streams + 1) > best->rate / (best->streams + 1))
+            best = &l;
+    }
+
+    if (!best)
+        return "";
+
+    best->streams++;
+    return best->ip;
+}
+
+void Stripe::release(const std::string& ip, int64_t bytes, double seconds)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& l : links_) {
+        if (l.ip != ip)
+            continue;
+
+        // streams of a link share it about evenly, so one of them times
+        // their number is what the link moves
+        if (seconds >= MIN_SECONDS && bytes > 0) {
+            const double sample = (double)bytes / (1 << 20) / seconds * l.streams;
+            l.rate = (1 - RATE_WEIGHT) * l.rate + RATE_WEIGHT * sample;
+        }
+
+        l.streams--;
+        return;
+    }
+}
+
+bool Stripe::faster(const std::string& ip, double mbps) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& l : links_) {
+        if (l.ip != ip && l.rate / (l.streams + 1) > mbps * MOVE_GAIN)
+            return true;
+    }
+
+    return false;
+}
+
+std::vector<std::string> Stripe::ips() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<std::string> ips;
+    for (const auto& l : links_)
+        ips.push_back(l.ip);
+
+    return ips;
+}
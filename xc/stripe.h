@@ -0,0 +1,58 @@
+#ifndef STRIPE_
+#define STRIPE_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <mutex>
+
+// an ip of a host to export from, with what its probe measured
+struct host_path {
+    std::string ip;
+    double mbps = 0;        // MiB/s of the probe, 0 if not probed
+    double latency_ms = 0;  // tcp connect
+};
+
+// Spreads the concurrent export streams of a host over its ips. A new
+// stream goes to the ip where it gets the biggest share of the link, by
+// what the links moved so far, so a slower link gets fewer streams. A
+// running stream moves when another link has become much faster.
+class Stripe
+{
+public:
+    // paths fastest first
+    explicit Stripe(const std::vector<struct host_path>& paths);
+
+    Stripe(const Stripe&) = delete;
+    Stripe& operator=(const Stripe&) = delete;
+
+    // ip for the next stream, not avoid if there is another
+    std::string acquire(const std::string& avoid = "");
+    // the stream on ip ended after moving bytes in seconds
+    void release(const std::string& ip, int64_t bytes, double seconds);
+    // true if a new stream on another ip would move well more than mbps,
+    // what a stream on ip moves now
+    bool faster(const std::string& ip, double mbps) const;
+
+    std::vector<std::string> ips() const;
+private:
+    struct link {
+        std::string ip;
+        double rate;        // MiB/s of the whole link
+        int streams = 0;
+    };
+
+    mutable std::mutex mutex_;
+    std::vector<struct link> links_;
+};
+
+// a stream on an ip of a stripe, which is dropped for a faster ip and
+// continued there at a range
+struct stripe_stream {
+    Stripe* stripe = nullptr;   // null if the stream stays
+    std::string ip;
+    bool movable = true;        // false once the server ignored a range
+    bool moved = false;
+};
+
+#endif // STRIPE_
@@ -0,0 +1,201 @@
+#include "task_waiter.h"
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+
+// event.from returns after this many seconds even without events
+#define EVENT_TIMEOUT 5.0
+// polling fallback starts here and doubles up to the max
+#define POLL_MIN_MS 50
+#define POLL_MAX_MS 2000
+
+Task_Waiter::Task_Waiter(xen_session* session, std::mutex* session_mutex,
+                         xen_session* caller, std::mutex* caller_mutex)
+    : session_(session),
+      session_mutex_(session_mutex),
+      caller_(caller ? caller : session),
+      caller_mutex_(caller ? caller_mutex : session_mutex),
+      // never long poll on a shared session, it would block every other call
+      events_(session_mutex == nullptr),
+      thread_(&Task_Waiter::run, this)
+{
+}
+
+Task_Waiter::~Task_Waiter()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cond_.notify_all();
+    thread_.join();
+}
+
+void Task_Waiter::wait(xen_task task, struct task_result& r)
+{
+    const std::string ref((char*)task);
+    std::unique_lock<std::mutex> lock(mutex_);
+    tasks_[ref];
+    cond_.notify_all();
+    lock.unlock();
+
+    // the watcher may already have seen the last event of the task
+    struct task_result now;
+    double progress = 0;
+    const bool done = check(ref, caller_, caller_mutex_, now, progress);
+
+    lock.lock();
+    if (done && !tasks_[ref].done) {
+        tasks_[ref].done = true;
+        tasks_[ref].r = std::move(now);
+    }
+
+    cond_.wait(lock, [&]() {
+        return tasks_[ref].done;
+    });
+
+    r = tasks_[ref].r;
+    tasks_.erase(ref);
+}
+
+bool Task_Waiter::check(const std::string& ref, xen_session* session, std::mutex* session_mutex,
+                        struct task_result& r, double& progress)
+{
+    xen_task task = (xen_task)ref.c_str();
+    std::unique_lock<std::mutex> session_lock;
+    if (session_mutex)
+        session_lock = std::unique_lock<std::mutex>(*session_mutex);
+
+    if (!xen_task_get_status(session, &r.status, task)) {
+        // the task is gone, nobody can complete it anymore
+        r.status = XEN_TASK_STATUS_TYPE_FAILURE;
+        r.error = "Failed to get task status";
+        xen_session_clear_error(session);
+    } else if (r.status == XEN_TASK_STATUS_TYPE_PENDING
+               || r.status == XEN_TASK_STATUS_TYPE_CANCELLING) {
+        if (!xen_task_get_progress(session, &progress, task))
+            xen_session_clear_error(session);
+    } else if (r.status == XEN_TASK_STATUS_TYPE_SUCCESS) {
+        char *result = nullptr;
+        if (xen_task_get_result(session, &result, task) && result) {
+            r.result = result;
+            free(result);
+        } else {
+            xen_session_clear_error(session);
+        }
+    } else {
+        xen_string_set *error_info = nullptr;
+        if (xen_task_get_error_info(session, &error_info, task) && error_info) {
+            for (int i = 0; i < error_info->size; i++) {
+                if (i)
+                    r.error.append(" ");
+                r.error.append(error_info->contents[i]);
+            }
+            xen_string_set_free(error_info);
+        } else {
+            xen_session_clear_error(session);
+        }
+    }
+
+    return r.status != XEN_TASK_STATUS_TYPE_PENDING
+           && r.status != XEN_TASK_STATUS_TYPE_CANCELLING;
+}
+
+void Task_Waiter::poll()
+{
+    std::vector<std::string> refs;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& t : tasks_) {
+            if (!t.second.done)
+                refs.push_back(t.first);
+        }
+    }
+
+    for (const auto& ref : refs) {
+        struct task_result r;
+        double progress = 0;
+        check(ref, session_, session_mutex_, r, progress);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = tasks_.find(ref);
+        if (it == tasks_.end())
+            continue;
+
+        if (r.status == XEN_TASK_STATUS_TYPE_PENDING
+            || r.status == XEN_TASK_STATUS_TYPE_CANCELLING) {
+            if (progress - it->second.progress >= 0.1) {
+                std::cout << "progress: " << progress << std::endl;
+                it->second.progress = progress;
+            }
+            continue;
+        }
+
+        it->second.done = true;
+        it->second.r = std::move(r);
+        cond_.notify_all();
+    }
+}
+
+bool Task_Waiter::wait_events()
+{
+    xen_string_set *classes = xen_string_set_alloc(1);
+    classes->size = 1;
+    classes->contents[0] = strdup("task");
+
+    xen_event_batch *batch = nullptr;
+    const bool ok = xen_event_from(session_, &batch, classes, (char*)token_.c_str(), EVENT_TIMEOUT);
+    xen_string_set_free(classes);
+
+    if (!ok) {
+        std::cout << "event.from not available, poll tasks instead" << std::endl;
+        xen_session_clear_error(session_);
+        return false;
+    }
+
+    if (batch) {
+        if (batch->token)
+            token_ = batch->token;
+        xen_event_batch_free(batch);
+    }
+
+    return true;
+}
+
+void Task_Waiter::run()
+{
+    int delay = POLL_MIN_MS;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cond_.wait(lock, [this]() {
+                return stop_ || std::any_of(tasks_.begin(), tasks_.end(), [](const auto& t) {
+                    return !t.second.done;
+                });
+            });
+
+            if (stop_)
+                return;
+        }
+
+        poll();
+
+        if (events_) {
+            // returns as soon as any task changed, including ours
+            if (wait_events())
+                continue;
+
+            events_ = false;
+        }
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        const size_t n = tasks_.size();
+        cond_.wait_for(lock, std::chrono::milliseconds(delay), [&]() {
+            return stop_ || tasks_.size() > n;
+        });
+
+        // new tasks start again with a short delay
+        delay = tasks_.size() > n ? POLL_MIN_MS : std::min(delay * 2, POLL_MAX_MS);
+    }
+}
@@ -0,0 +1,71 @@
+#ifndef TASK_WAITER_
+#define TASK_WAITER_
+
+extern "C"
+{
+#include <xen/api/xen_all.h>
+}
+#include <string>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+struct task_result {
+    xen_task_status_type status = XEN_TASK_STATUS_TYPE_PENDING;
+    std::string error;      // error_info of a failed task
+    std::string result;     // xml value of a successful task
+};
+
+// Waits for xapi tasks to reach a terminal state. One watcher thread blocks
+// in event.from on the task class and re-checks the registered tasks as soon
+// as any of them changes. When event.from is not available it falls back to
+// polling with an adaptive backoff, short for quick tasks and growing for
+// long ones.
+class Task_Waiter
+{
+public:
+    // session is used by the watcher only, unless session_mutex is given,
+    // then it is shared and every call is made under the mutex. wait()
+    // checks its task once on caller, under caller_mutex, so a task that
+    // finished before it was registered is not left to the next event;
+    // without caller it uses session.
+    Task_Waiter(xen_session* session, std::mutex* session_mutex,
+                xen_session* caller = nullptr, std::mutex* caller_mutex = nullptr);
+    ~Task_Waiter();
+
+    Task_Waiter(const Task_Waiter&) = delete;
+    Task_Waiter& operator=(const Task_Waiter&) = delete;
+
+    // blocks until the task succeeded, failed or was cancelled
+    void wait(xen_task task, struct task_result& r);
+private:
+    struct waiting {
+        bool done = false;
+        double progress = 0;
+        struct task_result r;
+    };
+
+    void run();
+    void poll();
+    // false while the task is pending
+    static bool check(const std::string& ref, xen_session* session, std::mutex* session_mutex,
+                      struct task_result& r, double& progress);
+    bool wait_events();
+
+private:
+    xen_session* session_;
+    std::mutex* session_mutex_;
+    xen_session* caller_;
+    std::mutex* caller_mutex_;
+    bool events_;
+    std::string token_;
+
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::map<std::string, struct waiting> tasks_;
+    bool stop_ = false;
+    std::thread thread_;
+};
+
+#endif // TASK_WAITER_
@@ -0,0 +1,273 @@
+#include "throttle.h"
+#include <chrono>
+#include <ctime>
+#include <algorithm>
+
+#define TICK_MS 20
+// a bucket never saves up more than this many seconds of its rate
+#define BURST_SECONDS 1
+
+Throttle_Stream::Throttle_Stream(Throttle* owner, std::string job, std::string host)
+    : owner_(owner), job_(std::move(job)), host_(std::move(host))
+{
+    owner_->enter(this);
+}
+
+Throttle_Stream::~Throttle_Stream()
+{
+    owner_->leave(this);
+}
+
+bool Throttle_Stream::take(size_t n, std::function<void()> ready)
+{
+    return owner_->take(this, n, std::move(ready));
+}
+
+void Throttle_Stream::wait(size_t n)
+{
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool go = false;
+    if (take(n, [&]() {
+            std::lock_guard<std::mutex> lock(mutex);
+            go = true;
+            cond.notify_one();
+        }))
+        return;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [&go]() { return go; });
+    take(n, nullptr);
+}
+
+void Throttle_Stream::refund(size_t n)
+{
+    owner_->refund(this, n);
+}
+
+Throttle::~Throttle()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+        cond_.notify_all();
+    }
+
+    if (thread_.joinable())
+        thread_.join();
+}
+
+std::shared_ptr<Throttle> Throttle::get()
+{
+    static std::mutex throttle_mutex;
+    static std::shared_ptr<Throttle> throttle;
+
+    std::lock_guard<std::mutex> lock(throttle_mutex);
+    if (!throttle)
+        throttle = std::make_shared<Throttle>();
+
+    return throttle;
+}
+
+void Throttle::configure(const struct throttle_limits& limits,
+                         const std::vector<struct throttle_window>& schedule)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    limits_ = limits;
+    schedule_ = schedule;
+    apply(current());
+
+    const bool limited = limits_.global > 0 || limits_.per_host > 0 || limits_.per_job > 0
+                         || !schedule_.empty();
+    if (limited && !thread_.joinable())
+        thread_ = std::thread(&Throttle::run, this);
+}
+
+std::unique_ptr<Throttle_Stream> Throttle::open(const std::string& job, const std::string& host)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!thread_.joinable())
+            return nullptr;
+    }
+
+    return std::unique_ptr<Throttle_Stream>(new Throttle_Stream(this, job, host));
+}
+
+void Throttle::enter(Throttle_Stream* s)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    global_.streams++;
+    hosts_[s->host_].streams++;
+    jobs_[s->job_].streams++;
+    apply(current());
+}
+
+void Throttle::leave(Throttle_Stream* s)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    waiters_.erase(std::remove_if(waiters_.begin(), waiters_.end(), [s](const struct waiter& w) {
+        return w.stream == s;
+    }), waiters_.end());
+
+    global_.streams--;
+    if (--hosts_[s->host_].streams == 0)
+        hosts_.erase(s->host_);
+    if (--jobs_[s->job_].streams == 0)
+        jobs_.erase(s->job_);
+    apply(current());
+}
+
+bool Throttle::take(Throttle_Stream* s, size_t n, std::function<void()> ready)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (s->granted_ > 0) {
+        // let go by the ticker, which already took what it was asked for
+        if ((int64_t)n > s->granted_)
+            consume(s, (int64_t)n - s->granted_);
+        s->granted_ = 0;
+        return true;
+    }
+
+    if (s->waiting_) {
+        for (auto& w : waiters_) {
+            if (w.stream == s) {
+                w.n = n;
+                w.ready = std::move(ready);
+            }
+        }
+        return false;
+    }
+
+    // whoever waits in line was served by the last refill already, what
+    // is left may be taken right away
+    if (available(s)) {
+        consume(s, (int64_t)n);
+        return true;
+    }
+
+    s->waiting_ = true;
+    waiters_.push_back({s, n, std::move(ready)});
+    return false;
+}
+
+void Throttle::refund(Throttle_Stream* s, size_t n)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    consume(s, -(int64_t)n);
+}
+
+void Throttle::run()
+{
+    auto last = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stop_) {
+        cond_.wait_for(lock, std::chrono::milliseconds(TICK_MS));
+        if (stop_)
+            break;
+
+        const auto now = std::chrono::steady_clock::now();
+        apply(current());
+        refill(std::chrono::duration<double>(now - last).count());
+        last = now;
+
+        // in the order they came, one whose buckets are empty does not hold
+        // up those behind it on other buckets
+        std::vector<std::function<void()>> ready;
+        for (auto it = waiters_.begin(); it != waiters_.end();) {
+            if (!available(it->stream)) {
+                ++it;
+                continue;
+            }
+
+            consume(it->stream, (int64_t)it->n);
+            it->stream->granted_ = std::max<int64_t>(1, it->n);
+            it->stream->waiting_ = false;
+            ready.push_back(std::move(it->ready));
+            it = waiters_.erase(it);
+        }
+
+        lock.unlock();
+        for (auto& r : ready) {
+            if (r)
+                r();
+        }
+        lock.lock();
+    }
+}
+
+void Throttle::refill(double seconds)
+{
+    auto fill = [seconds](struct bucket& b) {
+        if (b.rate > 0)
+            b.tokens = std::min<double>(b.tokens + b.rate * seconds, (double)b.rate * BURST_SECONDS);
+    };
+
+    fill(global_);
+    for (auto& h : hosts_)
+        fill(h.second);
+    for (auto& j : jobs_)
+        fill(j.second);
+}
+
+void Throttle::apply(const struct throttle_limits& limits)
+{
+    // the smaller of two limits, 0 is none
+    auto tighter = [](int64_t a, int64_t b) {
+        return a == 0 ? b : b == 0 ? a : std::min(a, b);
+    };
+
+    // every job gets the same share of the global rate
+    const int64_t share = limits.global > 0 && !jobs_.empty() ? limits.global / (int64_t)jobs_.size() : 0;
+
+    global_.rate = limits.global;
+    for (auto& h : hosts_)
+        h.second.rate = limits.per_host;
+    for (auto& j : jobs_)
+        j.second.rate = tighter(limits.per_job, std::max<int64_t>(share, limits.global > 0 ? 1 : 0));
+}
+
+bool Throttle::available(const Throttle_Stream* s) const
+{
+    auto open = [](const struct bucket& b) {
+        return b.rate == 0 || b.tokens > 0;
+    };
+
+    auto h = hosts_.find(s->host_);
+    auto j = jobs_.find(s->job_);
+    return open(global_) && (h == hosts_.end() || open(h->second))
+           && (j == jobs_.end() || open(j->second));
+}
+
+void Throttle::consume(const Throttle_Stream* s, int64_t n)
+{
+    // buckets may go into debt, the next refills pay it back
+    const double d = (double)n;
+    if (global_.rate > 0)
+        global_.tokens -= d;
+
+    auto h = hosts_.find(s->host_);
+    if (h != hosts_.end() && h->second.rate > 0)
+        h->second.tokens -= d;
+
+    auto j = jobs_.find(s->job_);
+    if (j != jobs_.end() && j->second.rate > 0)
+        j->second.tokens -= d;
+}
+
+struct throttle_limits Throttle::current() const
+{
+    const time_t now = time(nullptr);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    const int minute = tm.tm_hour * 60 + tm.tm_min;
+
+    for (const auto& w : schedule_) {
+        const bool in = w.from <= w.to ? minute >= w.from && minute < w.to
+                                       : minute >= w.from || minute < w.to;
+        if (in)
+            return w.limits;
+    }
+
+    return limits_;
+}
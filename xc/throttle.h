@@ -0,0 +1,122 @@
+#ifndef THROTTLE_
+#define THROTTLE_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <thread>
+
+// bytes per second, 0 is no limit
+struct throttle_limits {
+    int64_t global = 0;
+    int64_t per_host = 0;
+    int64_t per_job = 0;
+};
+
+// limits for a time of day, minutes since midnight, to before from spans midnight
+struct throttle_window {
+    int from = 0;
+    int to = 0;
+    struct throttle_limits limits;
+};
+
+class Throttle;
+
+// What one transfer takes from the buckets of its job, its host and the
+// whole process. Leaving the job frees its share for the others.
+class Throttle_Stream
+{
+public:
+    Throttle_Stream(Throttle* owner, std::string job, std::string host);
+    ~Throttle_Stream();
+
+    Throttle_Stream(const Throttle_Stream&) = delete;
+    Throttle_Stream& operator=(const Throttle_Stream&) = delete;
+
+    // true if n bytes may go now. Otherwise the stream waits in line and
+    // ready is called once it may, the same take then succeeds.
+    bool take(size_t n, std::function<void()> ready);
+    // take for a blocking reader, returns once n bytes may go
+    void wait(size_t n);
+    // gives back bytes taken but not moved
+    void refund(size_t n);
+private:
+    friend class Throttle;
+    Throttle* owner_;
+    std::string job_;
+    std::string host_;
+    int64_t granted_ = 0;
+    bool waiting_ = false;
+};
+
+// Token buckets for every transfer of the process: one global, one per host
+// and one per job. Buckets may run into debt, a transfer only waits while
+// one of its buckets is empty. Jobs split the global rate evenly, and
+// waiting transfers are let go in the order they came, so a job with many
+// disks does not starve the others.
+class Throttle
+{
+public:
+    Throttle() {}
+    ~Throttle();
+
+    Throttle(const Throttle&) = delete;
+    Throttle& operator=(const Throttle&) = delete;
+
+    // one throttle for the whole process
+    static std::shared_ptr<Throttle> get();
+
+    void configure(const struct throttle_limits& limits,
+                   const std::vector<struct throttle_window>& schedule);
+    // null if nothing is ever limited
+    std::unique_ptr<Throttle_Stream> open(const std::string& job, const std::string& host);
+private:
+    friend class Throttle_Stream;
+
+    struct bucket {
+        double tokens = 0;
+        int64_t rate = 0;
+        int streams = 0;
+    };
+
+    struct waiter {
+        Throttle_Stream* stream;
+        size_t n;
+        std::function<void()> ready;
+    };
+
+    bool take(Throttle_Stream* s, size_t n, std::function<void()> ready);
+    void refund(Throttle_Stream* s, size_t n);
+    void enter(Throttle_Stream* s);
+    void leave(Throttle_Stream* s);
+
+    void run();
+    // mutex_ must be held
+    void refill(double seconds);
+    void apply(const struct throttle_limits& limits);
+    bool available(const Throttle_Stream* s) const;
+    // negative n gives back
+    void consume(const Throttle_Stream* s, int64_t n);
+    struct throttle_limits current() const;
+
+private:
+    struct throttle_limits limits_;
+    std::vector<struct throttle_window> schedule_;
+
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    struct bucket global_;
+    std::map<std::string, struct bucket> hosts_;
+    std::map<std::string, struct bucket> jobs_;
+    std::deque<struct waiter> waiters_;
+    bool stop_ = false;
+    std::thread thread_;
+};
+
+#endif // THROTTLE_
@@ -0,0 +1,310 @@
+#include "transfer_engine.h"
+#include <iostream>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define MAX_EVENTS 64
+
+Transfer_Engine::Transfer_Engine(int threads)
+{
+    const int n = std::max(1, threads);
+    for (int i = 0; i < n; i++) {
+        std::unique_ptr<struct loop> l(new loop());
+        l->epfd = epoll_create1(EPOLL_CLOEXEC);
+        l->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        l->multi = curl_multi_init();
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = l->wakefd;
+        if (l->epfd < 0 || l->wakefd < 0 || !l->multi
+            || epoll_ctl(l->epfd, EPOLL_CTL_ADD, l->wakefd, &ev) != 0) {
+            std::cout << "Failed to create transfer loop: " << strerror(errno) << std::endl;
+            if (l->multi)
+                curl_multi_cleanup(l->multi);
+            if (l->wakefd >= 0)
+                close(l->wakefd);
+            if (l->epfd >= 0)
+                close(l->epfd);
+            continue;
+        }
+
+        curl_multi_setopt(l->multi, CURLMOPT_SOCKETFUNCTION, socket_func);
+        curl_multi_setopt(l->multi, CURLMOPT_SOCKETDATA, l.get());
+        curl_multi_setopt(l->multi, CURLMOPT_TIMERFUNCTION, timer_func);
+        curl_multi_setopt(l->multi, CURLMOPT_TIMERDATA, l.get());
+
+        load_[l.get()] = 0;
+        l->thread = std::thread(&Transfer_Engine::run, this, l.get());
+        loops_.push_back(std::move(l));
+    }
+}
+
+Transfer_Engine::~Transfer_Engine()
+{
+    for (auto& l : loops_) {
+        {
+            std::lock_guard<std::mutex> lock(l->mutex);
+            l->stop = true;
+        }
+        wake(l.get());
+        l->thread.join();
+
+        curl_multi_cleanup(l->multi);
+        close(l->wakefd);
+        close(l->epfd);
+    }
+}
+
+std::shared_ptr<Transfer_Engine> Transfer_Engine::get(int threads)
+{
+    static std::mutex engine_mutex;
+    static std::shared_ptr<Transfer_Engine> engine;
+
+    std::lock_guard<std::mutex> lock(engine_mutex);
+    if (!engine)
+        engine = std::make_shared<Transfer_Engine>(threads);
+
+    return engine;
+}
+
+void Transfer_Engine::add(CURL* easy, std::function<void(CURLcode)> done)
+{
+    struct loop* l = nullptr;
+    {
+        // the loop with the fewest transfers
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& e : load_) {
+            if (!l || e.second < load_[l])
+                l = e.first;
+        }
+
+        if (l) {
+            load_[l]++;
+            owner_[easy] = l;
+        }
+    }
+
+    if (!l) {
+        done(CURLE_FAILED_INIT);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(l->mutex);
+        l->adds.emplace_back(easy, std::move(done));
+    }
+    wake(l);
+}
+
+CURLcode Transfer_Engine::perform(CURL* easy)
+{
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool finished = false;
+    CURLcode res = CURLE_OK;
+
+    add(easy, [&](CURLcode r) {
+        std::lock_guard<std::mutex> lock(mutex);
+        res = r;
+        finished = true;
+        cond.notify_one();
+    });
+
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [&finished]() { return finished; });
+    return res;
+}
+
+void Transfer_Engine::resume(CURL* easy)
+{
+    struct loop* l = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = owner_.find(easy);
+        if (it == owner_.end())
+            return;
+        l = it->second;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(l->mutex);
+        l->resumes.push_back(easy);
+    }
+    wake(l);
+}
+
+void Transfer_Engine::wake(struct loop* l)
+{
+    const uint64_t one = 1;
+    if (write(l->wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        std::cout << "Failed to wake transfer loop: " << strerror(errno) << std::endl;
+}
+
+void Transfer_Engine::run(struct loop* l)
+{
+    std::vector<struct epoll_event> events(MAX_EVENTS);
+    std::chrono::steady_clock::time_point deadline;
+    long armed = -1;
+    int still = 0;
+
+    for (;;) {
+        std::vector<std::pair<CURL*, std::function<void(CURLcode)>>> adds;
+        std::vector<CURL*> resumes;
+        bool stop = false;
+        {
+            std::lock_guard<std::mutex> lock(l->mutex);
+            adds.swap(l->adds);
+            resumes.swap(l->resumes);
+            stop = l->stop;
+        }
+
+        if (stop) {
+            // only at exit, nobody should be waiting any more
+            for (auto& a : adds)
+                a.second(CURLE_ABORTED_BY_CALLBACK);
+            break;
+        }
+
+        for (auto& a : adds) {
+            l->running[a.first] = std::move(a.second);
+            if (curl_multi_add_handle(l->multi, a.first) != CURLM_OK) {
+                std::cout << "Failed to add transfer to loop" << std::endl;
+                auto done = std::move(l->running[a.first]);
+                l->running.erase(a.first);
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    owner_.erase(a.first);
+                    load_[l]--;
+                }
+                done(CURLE_FAILED_INIT);
+            }
+        }
+
+        for (CURL* easy : resumes) {
+            if (l->running.count(easy))
+                curl_easy_pause(easy, CURLPAUSE_CONT);
+        }
+        finished(l);
+
+        // the curl timer restarts whenever curl sets a timeout
+        if (l->timer_set) {
+            l->timer_set = false;
+            armed = l->timeout_ms;
+            deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(std::max(0L, armed));
+        }
+
+        int wait_ms = -1;
+        if (armed >= 0) {
+            const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now()).count();
+            wait_ms = (int)std::max<long long>(0, left);
+        }
+
+        const int n = epoll_wait(l->epfd, events.data(), (int)events.size(), wait_ms);
+        if (n < 0 && errno != EINTR) {
+            std::cout << "Failed to wait for transfer events: " << strerror(errno) << std::endl;
+            continue;
+        }
+
+        for (int i = 0; i < n; i++) {
+            const int fd = events[i].data.fd;
+            if (fd == l->wakefd) {
+                uint64_t v;
+                while (read(l->wakefd, &v, sizeof(v)) > 0) {}
+                continue;
+            }
+
+            int flags = 0;
+            if (events[i].events & EPOLLIN)
+                flags |= CURL_CSELECT_IN;
+            if (events[i].events & EPOLLOUT)
+                flags |= CURL_CSELECT_OUT;
+            if (events[i].events & (EPOLLERR | EPOLLHUP))
+                flags |= CURL_CSELECT_ERR;
+            curl_multi_socket_action(l->multi, fd, flags, &still);
+        }
+
+        if (armed >= 0 && std::chrono::steady_clock::now() >= deadline) {
+            armed = -1;
+            curl_multi_socket_action(l->multi, CURL_SOCKET_TIMEOUT, 0, &still);
+        }
+        finished(l);
+    }
+
+    for (auto& r : l->running) {
+        curl_multi_remove_handle(l->multi, r.first);
+        r.second(CURLE_ABORTED_BY_CALLBACK);
+    }
+    l->running.clear();
+}
+
+void Transfer_Engine::finished(struct loop* l)
+{
+    CURLMsg* msg = nullptr;
+    int left = 0;
+    while ((msg = curl_multi_info_read(l->multi, &left))) {
+        if (msg->msg != CURLMSG_DONE)
+            continue;
+
+        // msg is gone once the handle is removed
+        CURL* easy = msg->easy_handle;
+        const CURLcode res = msg->data.result;
+        curl_multi_remove_handle(l->multi, easy);
+
+        auto it = l->running.find(easy);
+        if (it == l->running.end())
+            continue;
+
+        auto done = std::move(it->second);
+        l->running.erase(it);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            owner_.erase(easy);
+            load_[l]--;
+        }
+        done(res);
+    }
+}
+
+int Transfer_Engine::socket_func(CURL* easy, curl_socket_t s, int what, void* userp, void* socketp)
+{
+    (void) easy;
+    (void) socketp;
+    struct loop* l = static_cast<struct loop*>(userp);
+    if (what == CURL_POLL_REMOVE) {
+        epoll_ctl(l->epfd, EPOLL_CTL_DEL, s, nullptr);
+        return 0;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.data.fd = s;
+    if (what & CURL_POLL_IN)
+        ev.events |= EPOLLIN;
+    if (what & CURL_POLL_OUT)
+        ev.events |= EPOLLOUT;
+
+    if (epoll_ctl(l->epfd, EPOLL_CTL_MOD, s, &ev) != 0 && errno == ENOENT
+        && epoll_ctl(l->epfd, EPOLL_CTL_ADD, s, &ev) != 0) {
+        std::cout << "Failed to watch transfer socket: " << strerror(errno) << std::endl;
+        return -1;
+    }
+
+    return 0;
+}
+
+int Transfer_Engine::timer_func(CURLM* multi, long timeout_ms, void* userp)
+{
+    (void) multi;
+    struct loop* l = static_cast<struct loop*>(userp);
+    l->timeout_ms = timeout_ms;
+    l->timer_set = true;
+    return 0;
+}
@@ -0,0 +1,69 @@
+#ifndef TRANSFER_ENGINE_
+#define TRANSFER_ENGINE_
+
+#include <curl/curl.h>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Runs the http transfers of the whole process on a few event loop threads.
+// Every loop drives a curl multi handle from epoll, so a stream costs a
+// socket and its buffers, not a thread. Callbacks of a transfer run on its
+// loop and must not block: a stream that can not take data returns
+// CURL_WRITEFUNC_PAUSE and is woken by resume() once it can.
+class Transfer_Engine
+{
+public:
+    explicit Transfer_Engine(int threads);
+    ~Transfer_Engine();
+
+    Transfer_Engine(const Transfer_Engine&) = delete;
+    Transfer_Engine& operator=(const Transfer_Engine&) = delete;
+
+    // one engine for the whole process, threads only counts for the first call
+    static std::shared_ptr<Transfer_Engine> get(int threads);
+
+    // starts the transfer, done is called on the loop once it finished
+    void add(CURL* easy, std::function<void(CURLcode)> done);
+    // add and wait for the result
+    CURLcode perform(CURL* easy);
+    // continues a paused transfer, from any thread. A transfer that already
+    // finished is ignored.
+    void resume(CURL* easy);
+private:
+    struct loop {
+        int epfd = -1;
+        int wakefd = -1;
+        CURLM* multi = nullptr;
+        long timeout_ms = -1;   // of the curl timer, -1 is none
+        bool timer_set = false; // timeout_ms changed since the loop looked
+
+        std::mutex mutex;
+        std::vector<std::pair<CURL*, std::function<void(CURLcode)>>> adds;
+        std::vector<CURL*> resumes;
+        bool stop = false;
+
+        // only touched by the loop thread
+        std::map<CURL*, std::function<void(CURLcode)>> running;
+        std::thread thread;
+    };
+
+    void run(struct loop* l);
+    void wake(struct loop* l);
+    void finished(struct loop* l);
+
+    static int socket_func(CURL* easy, curl_socket_t s, int what, void* userp, void* socketp);
+    static int timer_func(CURLM* multi, long timeout_ms, void* userp);
+
+private:
+    std::vector<std::unique_ptr<struct loop>> loops_;
+
+    std::mutex mutex_;
+    std::map<CURL*, struct loop*> owner_;
+    std::map<struct loop*, size_t> load_;
+};
+
+#endif // TRANSFER_ENGINE_
@@ -0,0 +1,580 @@
+#include "vhd.h"
+#include <iostream>
+#include <cstring>
+#include <ctime>
+#include <random>
+#include <algorithm>
+
+// seconds between the unix epoch and the vhd epoch, 2000-01-01 utc
+#define VHD_EPOCH 946684800
+#define FOOTER_CHECKSUM_OFFSET 64
+#define HEADER_CHECKSUM_OFFSET 36
+
+static uint32_t get_be32(const char* p)
+{
+    const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+    return ((uint32_t)u[0] << 24) | ((uint32_t)u[1] << 16) | ((uint32_t)u[2] << 8) | u[3];
+}
+
+static uint64_t get_be64(const char* p)
+{
+    return ((uint64_t)get_be32(p) << 32) | get_be32(p + 4);
+}
+
+static void put_be32(char* p, uint32_t v)
+{
+    p[0] = (char)(v >> 24);
+    p[1] = (char)(v >> 16);
+    p[2] = (char)(v >> 8);
+    p[3] = (char)v;
+}
+
+static void put_be64(char* p, uint64_t v)
+{
+    put_be32(p, (uint32_t)(v >> 32));
+    put_be32(p + 4, (uint32_t)v);
+}
+
+// one's complement of the byte sum, the checksum field counts as zero
+static uint32_t vhd_checksum(const char* p, size_t len, size_t checksum_offset)
+{
+    uint32_t sum = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (i >= checksum_offset && i < checksum_offset + 4)
+            continue;
+        sum += (unsigned char)p[i];
+    }
+    return ~sum;
+}
+
+// cylinders, heads and sectors per track as in the vhd specification
+static uint32_t vhd_geometry(uint64_t size)
+{
+    uint64_t sectors = size / VHD_SECTOR;
+    if (sectors > 65535ULL * 16 * 255)
+        sectors = 65535ULL * 16 * 255;
+
+    uint32_t spt, heads;
+    uint64_t cth;
+    if (sectors >= 65535ULL * 16 * 63) {
+        spt = 255;
+        heads = 16;
+        cth = sectors / spt;
+    } else {
+        spt = 17;
+        cth = sectors / spt;
+        heads = (uint32_t)((cth + 1023) / 1024);
+        if (heads < 4)
+            heads = 4;
+        if (cth >= heads * 1024ULL || heads > 16) {
+            spt = 31;
+            heads = 16;
+            cth = sectors / spt;
+        }
+        if (cth >= heads * 1024ULL) {
+            spt = 63;
+            heads = 16;
+            cth = sectors / spt;
+        }
+    }
+
+    const uint32_t cylinders = (uint32_t)(cth / heads);
+    return (cylinders << 16) | (heads << 8) | spt;
+}
+
+void vhd_init_footer(struct vhd_footer& f, uint64_t size, uint32_t disk_type)
+{
+    memcpy(f.cookie, "conectix", 8);
+    memcpy(f.creator_app, "xc  ", 4);
+    f.creator_os = 0x5769326b;  // Wi2k
+    f.timestamp = (uint32_t)(time(nullptr) - VHD_EPOCH);
+    f.original_size = size;
+    f.current_size = size;
+    f.geometry = vhd_geometry(size);
+    f.disk_type = disk_type;
+    f.data_offset = disk_type == VHD_TYPE_FIXED ? ~0ULL : VHD_FOOTER_SIZE;
+
+    std::random_device rd;
+    for (auto& b : f.uuid)
+        b = (unsigned char)rd();
+    f.uuid[6] = (f.uuid[6] & 0x0f) | 0x40;
+    f.uuid[8] = (f.uuid[8] & 0x3f) | 0x80;
+}
+
+bool vhd_parse_footer(const char* p, struct vhd_footer& f)
+{
+    if (memcmp(p, "conectix", 8) != 0)
+        return false;
+
+    memcpy(f.cookie, p, 8);
+    f.features = get_be32(p + 8);
+    f.version = get_be32(p + 12);
+    f.data_offset = get_be64(p + 16);
+    f.timestamp = get_be32(p + 24);
+    memcpy(f.creator_app, p + 28, 4);
+    f.creator_version = get_be32(p + 32);
+    f.creator_os = get_be32(p + 36);
+    f.original_size = get_be64(p + 40);
+    f.current_size = get_be64(p + 48);
+    f.geometry = get_be32(p + 56);
+    f.disk_type = get_be32(p + 60);
+    f.checksum = get_be32(p + 64);
+    memcpy(f.uuid, p + 68, 16);
+    f.saved_state = (uint8_t)p[84];
+    return true;
+}
+
+void vhd_pack_footer(struct vhd_footer& f, char* p)
+{
+    memset(p, 0, VHD_FOOTER_SIZE);
+    memcpy(p, f.cookie, 8);
+    put_be32(p + 8, f.features);
+    put_be32(p + 12, f.version);
+    put_be64(p + 16, f.data_offset);
+    put_be32(p + 24, f.timestamp);
+    memcpy(p + 28, f.creator_app, 4);
+    put_be32(p + 32, f.creator_version);
+    put_be32(p + 36, f.creator_os);
+    put_be64(p + 40, f.original_size);
+    put_be64(p + 48, f.current_size);
+    put_be32(p + 56, f.geometry);
+    put_be32(p + 60, f.disk_type);
+    memcpy(p + 68, f.uuid, 16);
+    p[84] = (char)f.saved_state;
+    f.checksum = vhd_checksum(p, VHD_FOOTER_SIZE, FOOTER_CHECKSUM_OFFSET);
+    put_be32(p + 64, f.checksum);
+}
+
+bool vhd_parse_header(const char* p, struct vhd_header& h)
+{
+    if (memcmp(p, "cxsparse", 8) != 0)
+        return false;
+
+    memcpy(h.cookie, p, 8);
+    h.data_offset = get_be64(p + 8);
+    h.table_offset = get_be64(p + 16);
+    h.version = get_be32(p + 24);
+    h.max_table_entries = get_be32(p + 28);
+    h.block_size = get_be32(p + 32);
+    h.checksum = get_be32(p + 36);
+    memcpy(h.parent_uuid, p + 40, 16);
+    h.parent_timestamp = get_be32(p + 56);
+    return true;
+}
+
+void vhd_pack_header(struct vhd_header& h, char* p)
+{
+    memcpy(p, "cxsparse", 8);
+    put_be64(p + 8, h.data_offset);
+    put_be64(p + 16, h.table_offset);
+    put_be32(p + 24, h.version);
+    put_be32(p + 28, h.max_table_entries);
+    put_be32(p + 32, h.block_size);
+    memcpy(p + 40, h.parent_uuid, 16);
+    put_be32(p + 56, h.parent_timestamp);
+    h.checksum = vhd_checksum(p, VHD_HEADER_SIZE, HEADER_CHECKSUM_OFFSET);
+    put_be32(p + 36, h.checksum);
+}
+
+Vhd_Reader::Vhd_Reader(Source* source)
+    : source_(source)
+{
+}
+
+bool Vhd_Reader::open()
+{
+    char buf[VHD_HEADER_SIZE];
+    const int64_t size = source_->size();
+    if (size < VHD_FOOTER_SIZE
+        || !source_->read_at(size - VHD_FOOTER_SIZE, buf, VHD_FOOTER_SIZE)
+        || !vhd_parse_footer(buf, footer_)) {
+        // the trailing footer may be damaged, dynamic disks have a copy
+        if (size < VHD_FOOTER_SIZE || !source_->read_at(0, buf, VHD_FOOTER_SIZE)
+            || !vhd_parse_footer(buf, footer_)) {
+            std::cout << "Failed to find vhd footer" << std::endl;
+            return false;
+        }
+    }
+
+    if (footer_.disk_type == VHD_TYPE_FIXED) {
+        fixed_ = true;
+        header_.block_size = VHD_DEFAULT_BLOCK;
+        const uint64_t n = (footer_.current_size + header_.block_size - 1) / header_.block_size;
+        header_.max_table_entries = (uint32_t)n;
+        for (uint64_t i = 0; i < n; i++)
+            bat_.push_back((uint32_t)(i * header_.block_size / VHD_SECTOR));
+        return true;
+    }
+
+    if (footer_.disk_type != VHD_TYPE_DYNAMIC && footer_.disk_type != VHD_TYPE_DIFF) {
+        std::cout << "Unknown vhd disk type " << footer_.disk_type << std::endl;
+        return false;
+    }
+
+    if (!source_->read_at(footer_.data_offset, buf, VHD_HEADER_SIZE)
+        || !vhd_parse_header(buf, header_)) {
+        std::cout << "Failed to read vhd dynamic header" << std::endl;
+        return false;
+    }
+
+    if (header_.block_size < VHD_SECTOR || header_.block_size % VHD_SECTOR) {
+        std::cout << "Invalid vhd block size " << header_.block_size << std::endl;
+        return false;
+    }
+
+    std::vector<char> bat((size_t)header_.max_table_entries * 4);
+    if (!source_->read_at(header_.table_offset, bat.data(), bat.size())) {
+        std::cout << "Failed to read vhd BAT" << std::endl;
+        return false;
+    }
+
+    bat_.resize(header_.max_table_entries);
+    for (uint32_t i = 0; i < header_.max_table_entries; i++)
+        bat_[i] = get_be32(&bat[i * 4]);
+
+    bitmap_size_ = vhd_bitmap_size(header_.block_size);
+    return true;
+}
+
+uint32_t Vhd_Reader::allocated_blocks() const
+{
+    return (uint32_t)std::count_if(bat_.begin(), bat_.end(), [](uint32_t s) {
+        return s != VHD_BAT_UNUSED;
+    });
+}
+
+bool Vhd_Reader::for_each_allocated(const std::function<bool(uint32_t block)>& f) const
+{
+    for (uint32_t i = 0; i < bat_.size(); i++) {
+        if (bat_[i] != VHD_BAT_UNUSED && !f(i))
+            return false;
+    }
+    return true;
+}
+
+bool Vhd_Reader::read_bitmap(uint32_t block, uint8_t* bitmap)
+{
+    if (fixed_) {
+        memset(bitmap, 0xff, vhd_bitmap_size(header_.block_size));
+        return true;
+    }
+
+    return source_->read_at((int64_t)bat_[block] * VHD_SECTOR, (char*)bitmap, bitmap_size_);
+}
+
+bool Vhd_Reader::read_block(uint32_t block, char* data)
+{
+    const int64_t offset = (int64_t)bat_[block] * VHD_SECTOR + bitmap_size_;
+    if (fixed_) {
+        // the last block of a fixed disk may be short
+        const uint64_t n = std::min<uint64_t>(header_.block_size,
+                                              footer_.current_size - (uint64_t)block * header_.block_size);
+        memset(data + n, 0, header_.block_size - n);
+        return source_->read_at(offset, data, n);
+    }
+
+    return source_->read_at(offset, data, header_.block_size);
+}
+
+bool Vhd_Reader::verify(std::string& err)
+{
+    const int64_t size = source_->size();
+    char footer[VHD_FOOTER_SIZE];
+    if (!source_->read_at(size - VHD_FOOTER_SIZE, footer, VHD_FOOTER_SIZE)
+        || memcmp(footer, "conectix", 8) != 0) {
+        err = "trailing footer missing";
+        return false;
+    }
+
+    if (vhd_checksum(footer, VHD_FOOTER_SIZE, FOOTER_CHECKSUM_OFFSET) != get_be32(footer + 64)) {
+        err = "footer checksum mismatch";
+        return false;
+    }
+
+    if (fixed_) {
+        if ((uint64_t)size != footer_.current_size + VHD_FOOTER_SIZE) {
+            err = "fixed disk size does not match the footer";
+            return false;
+        }
+        return true;
+    }
+
+    char copy[VHD_FOOTER_SIZE];
+    if (!source_->read_at(0, copy, VHD_FOOTER_SIZE) || memcmp(copy, footer, VHD_FOOTER_SIZE) != 0) {
+        err = "footer copy differs from footer";
+        return false;
+    }
+
+    char header[VHD_HEADER_SIZE];
+    if (!source_->read_at(footer_.data_offset, header, VHD_HEADER_SIZE)
+        || vhd_checksum(header, VHD_HEADER_SIZE, HEADER_CHECKSUM_OFFSET) != header_.checksum) {
+        err = "dynamic header checksum mismatch";
+        return false;
+    }
+
+    if ((uint64_t)header_.max_table_entries * header_.block_size < footer_.current_size) {
+        err = "BAT does not cover the disk";
+        return false;
+    }
+
+    const int64_t table_end = header_.table_offset + (int64_t)header_.max_table_entries * 4;
+    const int64_t block_bytes = (int64_t)bitmap_size_ + header_.block_size;
+    std::vector<int64_t> starts;
+    for (uint32_t s : bat_) {
+        if (s == VHD_BAT_UNUSED)
+            continue;
+
+        const int64_t start = (int64_t)s * VHD_SECTOR;
+        if (start < table_end || start + block_bytes > size - VHD_FOOTER_SIZE) {
+            err = "BAT entry outside of the data area: sector " + std::to_string(s);
+            return false;
+        }
+        starts.push_back(start);
+    }
+
+    std::sort(starts.begin(), starts.end());
+    for (size_t i = 1; i < starts.size(); i++) {
+        if (starts[i] < starts[i - 1] + block_bytes) {
+            err = "overlapping blocks at " + std::to_string(starts[i]);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+Vhd_Stream::Vhd_Stream(const struct vhd_footer& footer,
+                       const struct vhd_header& header,
+                       std::vector<uint32_t> blocks,
+                       block_func fill)
+    : blocks_(std::move(blocks)),
+      fill_(std::move(fill)),
+      block_size_(header.block_size),
+      bitmap_size_(vhd_bitmap_size(header.block_size))
+{
+    struct vhd_footer f = footer;
+    if (f.disk_type == VHD_TYPE_FIXED)
+        f.disk_type = VHD_TYPE_DYNAMIC;
+    f.data_offset = VHD_FOOTER_SIZE;
+
+    struct vhd_header h = header;
+    h.data_offset = ~0ULL;
+    h.table_offset = VHD_FOOTER_SIZE + VHD_HEADER_SIZE;
+    h.max_table_entries = (uint32_t)((f.current_size + block_size_ - 1) / block_size_);
+
+    const size_t bat_size = ((size_t)h.max_table_entries * 4 + VHD_SECTOR - 1) / VHD_SECTOR * VHD_SECTOR;
+    head_.assign(h.table_offset + bat_size, 0);
+    vhd_pack_footer(f, head_.data());
+    vhd_pack_header(h, head_.data() + VHD_FOOTER_SIZE);
+    vhd_pack_footer(f, footer_);
+
+    char* bat = head_.data() + h.table_offset;
+    memset(bat, 0xff, bat_size);
+    const int64_t block_bytes = (int64_t)bitmap_size_ + block_size_;
+    for (size_t k = 0; k < blocks_.size(); k++) {
+        const int64_t offset = (int64_t)head_.size() + (int64_t)k * block_bytes;
+        put_be32(bat + (size_t)blocks_[k] * 4, (uint32_t)(offset / VHD_SECTOR));
+    }
+
+    size_ = (int64_t)head_.size() + (int64_t)blocks_.size() * block_bytes + VHD_FOOTER_SIZE;
+    block_.resize(block_bytes);
+}
+
+bool Vhd_Stream::load_block(size_t index)
+{
+    if (index == cached_)
+        return true;
+
+    cached_ = (size_t)-1;
+    memset(block_.data(), 0, bitmap_size_);
+    if (!fill_(blocks_[index], (uint8_t*)block_.data(), block_.data() + bitmap_size_)) {
+        std::cout << "Failed to fill vhd block " << blocks_[index] << std::endl;
+        return false;
+    }
+
+    cached_ = index;
+    return true;
+}
+
+bool Vhd_Stream::read_at(int64_t offset, char* dst, size_t len)
+{
+    if (offset < 0 || offset + (int64_t)len > size_)
+        return false;
+
+    const int64_t head = head_.size();
+    const int64_t block_bytes = block_.size();
+    const int64_t tail = size_ - VHD_FOOTER_SIZE;
+    while (len > 0) {
+        size_t n;
+        if (offset < head) {
+            n = std::min<int64_t>(len, head - offset);
+            memcpy(dst, head_.data() + offset, n);
+        } else if (offset < tail) {
+            const size_t index = (offset - head) / block_bytes;
+            const int64_t skip = (offset - head) % block_bytes;
+            if (!load_block(index))
+                return false;
+            n = std::min<int64_t>(len, block_bytes - skip);
+            memcpy(dst, block_.data() + skip, n);
+        } else {
+            n = len;
+            memcpy(dst, footer_ + (offset - tail), n);
+        }
+
+        dst += n;
+        offset += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+static bool full_bitmap(const uint8_t* bitmap, uint32_t sectors)
+{
+    for (uint32_t i = 0; i < sectors / 8; i++) {
+        if (bitmap[i] != 0xff)
+            return false;
+    }
+
+    for (uint32_t s = sectors / 8 * 8; s < sectors; s++) {
+        if (!vhd_bit(bitmap, s))
+            return false;
+    }
+
+    return true;
+}
+
+bool Vhd_Chain::add(std::unique_ptr<Source> source)
+{
+    std::unique_ptr<Vhd_Reader> r(new Vhd_Reader(source.get()));
+    if (!r->open())
+        return false;
+
+    if (!layers_.empty() && layers_.front()->block_size() != r->block_size()) {
+        std::cout << "Failed to chain vhds with block sizes " << layers_.front()->block_size()
+                  << " and " << r->block_size() << std::endl;
+        return false;
+    }
+
+    sources_.push_back(std::move(source));
+    layers_.push_back(std::move(r));
+    return true;
+}
+
+bool Vhd_Chain::open(bool all_blocks)
+{
+    if (layers_.empty())
+        return false;
+
+    all_blocks_ = all_blocks;
+    const Vhd_Reader& top = *layers_.back();
+    const uint32_t block_size = top.block_size();
+    const uint32_t blocks = (uint32_t)((top.disk_size() + block_size - 1) / block_size);
+
+    std::vector<bool> used(blocks, all_blocks_);
+    for (const auto& l : layers_) {
+        l->for_each_allocated([&](uint32_t b) {
+            if (b < blocks)
+                used[b] = true;
+            return true;
+        });
+    }
+
+    blocks_.clear();
+    for (uint32_t b = 0; b < blocks; b++) {
+        if (used[b])
+            blocks_.push_back(b);
+    }
+
+    layer_bitmap_.resize(vhd_bitmap_size(block_size));
+    layer_data_.resize(block_size);
+    if (layers_.size() == 1 && !all_blocks_)
+        return true;
+
+    struct vhd_footer footer;
+    struct vhd_header header;
+    shape(footer, header);
+    stream_.reset(new Vhd_Stream(footer, header, blocks_,
+        [this](uint32_t block, uint8_t* bitmap, char* data) {
+            return fill(block, bitmap, data);
+        }));
+    return true;
+}
+
+void Vhd_Chain::shape(struct vhd_footer& footer, struct vhd_header& header) const
+{
+    footer = layers_.back()->footer();
+    footer.disk_type = VHD_TYPE_DYNAMIC;
+    header.block_size = layers_.back()->block_size();
+}
+
+std::unique_ptr<Source> Vhd_Chain::segment(size_t first, size_t count)
+{
+    first = std::min(first, blocks_.size());
+    count = std::min(count, blocks_.size() - first);
+
+    struct vhd_footer footer;
+    struct vhd_header header;
+    shape(footer, header);
+    return std::unique_ptr<Source>(new Vhd_Stream(footer, header,
+        std::vector<uint32_t>(blocks_.begin() + first, blocks_.begin() + first + count),
+        [this](uint32_t block, uint8_t* bitmap, char* data) {
+            return fill(block, bitmap, data);
+        }));
+}
+
+int64_t Vhd_Chain::size() const
+{
+    if (stream_)
+        return stream_->size();
+    return sources_.empty() ? 0 : sources_.front()->size();
+}
+
+bool Vhd_Chain::read_at(int64_t offset, char* dst, size_t len)
+{
+    if (stream_)
+        return stream_->read_at(offset, dst, len);
+    return sources_.size() == 1 && sources_.front()->read_at(offset, dst, len);
+}
+
+bool Vhd_Chain::fill(uint32_t block, uint8_t* bitmap, char* data)
+{
+    const uint32_t block_size = layers_.back()->block_size();
+    const uint32_t sectors = block_size / VHD_SECTOR;
+    uint32_t missing = sectors;
+    memset(data, 0, block_size);
+
+    for (auto it = layers_.rbegin(); it != layers_.rend() && missing > 0; ++it) {
+        Vhd_Reader& l = **it;
+        if (block >= l.blocks() || !l.allocated(block))
+            continue;
+
+        uint8_t* lb = layer_bitmap_.data();
+        if (!l.read_bitmap(block, lb))
+            return false;
+
+        // the newest vhd with a full block wins outright, the usual case
+        if (missing == sectors && full_bitmap(lb, sectors)) {
+            memcpy(bitmap, lb, vhd_bitmap_size(block_size));
+            return l.read_block(block, data);
+        }
+
+        if (!l.read_block(block, layer_data_.data()))
+            return false;
+
+        for (uint32_t s = 0; s < sectors; s++) {
+            if (!vhd_bit(lb, s) || vhd_bit(bitmap, s))
+                continue;
+
+            memcpy(data + (size_t)s * VHD_SECTOR, layer_data_.data() + (size_t)s * VHD_SECTOR, VHD_SECTOR);
+            vhd_set_bit(bitmap, s);
+            missing--;
+        }
+    }
+
+    // sectors nobody has are written as the zeros data holds there
+    if (all_blocks_ && missing > 0)
+        memset(bitmap, 0xff, vhd_bitmap_size(block_size));
+
+    return true;
+}
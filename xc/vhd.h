@@ -0,0 +1,189 @@
+#ifndef VHD_
+#define VHD_
+
+#include "pipeline.h"
+#include <string>
+#include <vector>
+#include <functional>
+#include <memory>
+
+// Microsoft VHD as exported by xapi with format=vhd: a footer copy, the
+// dynamic header, the block allocation table (BAT) and the allocated blocks,
+// each a sector bitmap followed by the data, then the footer.
+#define VHD_SECTOR 512
+#define VHD_FOOTER_SIZE 512
+#define VHD_HEADER_SIZE 1024
+#define VHD_BAT_UNUSED 0xffffffff
+#define VHD_DEFAULT_BLOCK (2 << 20)
+
+#define VHD_TYPE_FIXED 2
+#define VHD_TYPE_DYNAMIC 3
+#define VHD_TYPE_DIFF 4
+
+// fields in host byte order, the file is big endian
+struct vhd_footer {
+    char cookie[8];
+    uint32_t features = 2;
+    uint32_t version = 0x00010000;
+    uint64_t data_offset = 0;
+    uint32_t timestamp = 0;
+    char creator_app[4];
+    uint32_t creator_version = 0;
+    uint32_t creator_os = 0;
+    uint64_t original_size = 0;
+    uint64_t current_size = 0;
+    uint32_t geometry = 0;
+    uint32_t disk_type = VHD_TYPE_DYNAMIC;
+    uint32_t checksum = 0;
+    unsigned char uuid[16] = {0};
+    uint8_t saved_state = 0;
+};
+
+struct vhd_header {
+    char cookie[8];
+    uint64_t data_offset = ~0ULL;
+    uint64_t table_offset = 0;
+    uint32_t version = 0x00010000;
+    uint32_t max_table_entries = 0;
+    uint32_t block_size = VHD_DEFAULT_BLOCK;
+    uint32_t checksum = 0;
+    unsigned char parent_uuid[16] = {0};
+    uint32_t parent_timestamp = 0;
+};
+
+void vhd_init_footer(struct vhd_footer& f, uint64_t size, uint32_t disk_type);
+bool vhd_parse_footer(const char* p, struct vhd_footer& f);
+void vhd_pack_footer(struct vhd_footer& f, char* p);
+bool vhd_parse_header(const char* p, struct vhd_header& h);
+// p must hold VHD_HEADER_SIZE zeroed or previously parsed bytes, the parent
+// name and locators in it are kept
+void vhd_pack_header(struct vhd_header& h, char* p);
+
+// sector bitmap of a block, most significant bit first
+inline bool vhd_bit(const uint8_t* bitmap, uint32_t sector)
+{
+    return bitmap[sector >> 3] & (0x80 >> (sector & 7));
+}
+
+inline void vhd_set_bit(uint8_t* bitmap, uint32_t sector)
+{
+    bitmap[sector >> 3] |= (0x80 >> (sector & 7));
+}
+
+// bytes of the bitmap in front of every block, whole sectors
+inline uint32_t vhd_bitmap_size(uint32_t block_size)
+{
+    const uint32_t bytes = (block_size / VHD_SECTOR + 7) / 8;
+    return (bytes + VHD_SECTOR - 1) / VHD_SECTOR * VHD_SECTOR;
+}
+
+// Reads a vhd through any source. Fixed disks are presented as if every
+// block was allocated with a full bitmap.
+class Vhd_Reader
+{
+public:
+    explicit Vhd_Reader(Source* source);
+
+    bool open();
+
+    const struct vhd_footer& footer() const { return footer_; }
+    const struct vhd_header& header() const { return header_; }
+    uint64_t disk_size() const { return footer_.current_size; }
+    uint32_t block_size() const { return header_.block_size; }
+    uint32_t blocks() const { return (uint32_t)bat_.size(); }
+    uint32_t bitmap_size() const { return bitmap_size_; }
+    bool allocated(uint32_t block) const { return bat_[block] != VHD_BAT_UNUSED; }
+    uint32_t allocated_blocks() const;
+
+    // calls f for every allocated block in order, stops when f returns false
+    bool for_each_allocated(const std::function<bool(uint32_t block)>& f) const;
+
+    // bitmap_size() bytes and block_size() bytes, the block must be allocated
+    bool read_bitmap(uint32_t block, uint8_t* bitmap);
+    bool read_block(uint32_t block, char* data);
+
+    // structure checks: checksums, footer copy, BAT inside the file and
+    // blocks not overlapping. err says what is wrong.
+    bool verify(std::string& err);
+private:
+    Source* source_;
+    struct vhd_footer footer_;
+    struct vhd_header header_;
+    std::vector<uint32_t> bat_;    // sector of every block, VHD_BAT_UNUSED if none
+    uint32_t bitmap_size_ = 0;
+    bool fixed_ = false;
+};
+
+// A dynamic or differencing vhd generated on the fly from a list of
+// allocated blocks. fill provides bitmap and data of a block when its bytes
+// are read, so the vhd can be streamed without ever being written out.
+class Vhd_Stream : public Source
+{
+public:
+    typedef std::function<bool(uint32_t block, uint8_t* bitmap, char* data)> block_func;
+
+    // blocks sorted by index, footer and header are used as templates
+    Vhd_Stream(const struct vhd_footer& footer,
+               const struct vhd_header& header,
+               std::vector<uint32_t> blocks,
+               block_func fill);
+
+    int64_t size() const override { return size_; }
+    bool read_at(int64_t offset, char* dst, size_t len) override;
+private:
+    bool load_block(size_t index);
+
+private:
+    std::vector<char> head_;        // footer copy, header and BAT
+    char footer_[VHD_FOOTER_SIZE];
+    std::vector<uint32_t> blocks_;
+    block_func fill_;
+    uint32_t block_size_;
+    uint32_t bitmap_size_;
+    int64_t size_ = 0;
+    size_t cached_ = (size_t)-1;
+    std::vector<char> block_;       // bitmap followed by data
+};
+
+// A chain of vhds merged into one, oldest first: every sector comes from
+// the newest vhd whose bitmap has it, sectors no vhd has are zero. Only
+// the BATs are read by open, block data when the chain is read. A single
+// vhd is passed through as it is.
+class Vhd_Chain : public Source
+{
+public:
+    Vhd_Chain() {}
+    Vhd_Chain(const Vhd_Chain&) = delete;
+    Vhd_Chain& operator=(const Vhd_Chain&) = delete;
+
+    bool add(std::unique_ptr<Source> source);
+    size_t layers() const { return layers_.size(); }
+    uint32_t block_size() const { return layers_.back()->block_size(); }
+    // call once every vhd is added. all_blocks allocates every block, zero
+    // where no vhd has data, for overwriting a disk that has old data.
+    bool open(bool all_blocks = false);
+
+    // the coalesced vhd, shaped like the newest vhd of the chain
+    int64_t size() const override;
+    bool read_at(int64_t offset, char* dst, size_t len) override;
+
+    // blocks the coalesced vhd allocates, by index
+    const std::vector<uint32_t>& blocks() const { return blocks_; }
+    // a vhd of only blocks()[first, first + count). Importing every segment
+    // into one vdi writes what importing the whole chain writes.
+    std::unique_ptr<Source> segment(size_t first, size_t count);
+private:
+    bool fill(uint32_t block, uint8_t* bitmap, char* data);
+    void shape(struct vhd_footer& footer, struct vhd_header& header) const;
+
+private:
+    std::vector<std::unique_ptr<Source>> sources_;
+    std::vector<std::unique_ptr<Vhd_Reader>> layers_;
+    std::unique_ptr<Vhd_Stream> stream_;
+    std::vector<uint32_t> blocks_;
+    std::vector<uint8_t> layer_bitmap_;
+    std::vector<char> layer_data_;
+    bool all_blocks_ = false;
+};
+
+#endif // VHD_
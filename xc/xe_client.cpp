@@ -1,7 +1,19 @@
 #include "xe_client.h"
+#include "rpc_pool.h"
+#include "inventory.h"
+#include "task_waiter.h"
+#include "pipeline.h"
+#include "compress.h"
+#include "chunk_store.h"
+#include "vhd.h"
+#include "catalog.h"
+#include "nbd.h"
+#include "transfer_engine.h"
+#include "snapshot_queue.h"
 #include <curl/curl.h>
 #include <libxml/parser.h>
 #include <iostream>
+#include <cstring>
 #include <fstream>
 #include <chrono>
 #include <ctime>
@@ -12,17 +24,21 @@
 #include <sys/stat.h>
 #include <filesystem>
 #include <memory>
+#include <atomic>
+#include <condition_variable>
 
 #define BACKUP_SET_CONF "backup_set.json"
 #define VM_META_CONF "vm_meta.json"
 
 #define BACKUP_TYPE_FULL "full"
 #define BACKUP_TYPE_DIFF "diff"
-typedef struct
-{
-    xen_result_func func;
-    void *handle;
-} xen_comms;
+#define BACKUP_TYPE_INCR "incr"
+
+// one bit of VDI.list_changed_blocks stands for this many bytes
+#define CBT_BLOCK (64 * 1024)
+
+// left in the directory of a set whose backup failed, names its snapshot
+#define RESUME_CONF "resume.json"
 
 template<class T, class Deleter>
 std::unique_ptr<T, Deleter> make_deleter(T* p, Deleter&& del)
@@ -48,63 +64,6 @@ void print_error(xen_session *session, char* format, ...)
     print_error(session);
 }
 
-size_t writefile(void* contents, size_t size, size_t nmemb, void* userp) {
-    size_t totalSize = size * nmemb;
-    std::ofstream* file = static_cast<std::ofstream*>(userp);
-    if (file && file->is_open()) {
-        file->write(static_cast<char*>(contents), totalSize);
-        return totalSize;
-    }
-    return 0;
-}
-
-size_t readfile(void* contents, size_t size, size_t nmemb, void* userp) {
-    size_t totalSize = size * nmemb;
-    std::ifstream* file = static_cast<std::ifstream*>(userp);
-    if (file && file->is_open()) {
-        file->read(static_cast<char*>(contents), totalSize);
-        return totalSize;
-    }
-    return 0;
-}
-
-static size_t write_func(void *ptr, size_t size, size_t nmemb, xen_comms *comms)
-{
-    size_t n = size * nmemb;
-    return comms->func(ptr, n, comms->handle) ? n : 0;
-}
-
-static int call_func(const void *data, size_t len, void *user_handle,
-                     void *result_handle, xen_result_func result_func)
-{
-    (void) user_handle;
-    CURL *curl = curl_easy_init();
-    if (!curl)
-        return -1;
-
-    xen_comms comms = {
-        .func = result_func,
-        .handle = result_handle
-    };
-
-    char* url = (char*)user_handle;
-    curl_easy_setopt(curl, CURLOPT_URL, url);
-    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &write_func);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &comms);
-    curl_easy_setopt(curl, CURLOPT_POST, 1);
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, data);
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, len);
-    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0);
-    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0);
-
-    CURLcode result = curl_easy_perform(curl);
-
-    curl_easy_cleanup(curl);
-
-    return result;
-}
-
 std::string current_time_str()
 {
     auto now = std::chrono::system_clock::now();
@@ -115,84 +74,70 @@ std::string current_time_str()
     return std::string(buffer);
 }
 
-Xe_Client::Xe_Client(std::string host, std::string user, std::string pass)
-    : host_(std::move(host)), user_(std::move(user)), pass_(std::move(pass))
+Xe_Client::Xe_Client(std::string host, std::string user, std::string pass,
+                     struct options opts)
+    : host_(std::move(host)), user_(std::move(user)), pass_(std::move(pass)),
+      opts_(std::move(opts))
 {
     xmlInitParser();
     xen_init();
     curl_global_init(CURL_GLOBAL_ALL);
+
+    rpc_ = Rpc_Pool::get(host_, opts_.rpc_pool_size, opts_.rpc_idle_timeout,
+                         opts_.rpc_tls_session_reuse);
+    catalog_ = Catalog::get(BACKUP_SET_CONF);
+    engine_ = Transfer_Engine::get(opts_.transfer_threads);
+    Throttle::get()->configure(opts_.throttle, opts_.throttle_schedule);
 }
 
 Xe_Client::~Xe_Client()
 {
+    stop_control();
+    waiter_.reset();
+    if (event_session_)
+        xen_session_logout(event_session_);
 }
 
 bool Xe_Client::connect()
 {
     session_ = xen_session_login_with_password(
-        call_func, (void*)host_.c_str(), user_.c_str(), pass_.c_str(),
+        Rpc_Pool::call_func, rpc_.get(), user_.c_str(), pass_.c_str(),
         xen_api_latest_version);
 
-    return session_->ok;
-}
-
-bool Xe_Client::hosts(std::map<std::string, struct host> &hosts)
-{
-    xen_host_set *host_set = nullptr;
-    if (!xen_host_get_all(session_, &host_set))
+    if (!session_->ok)
         return false;
 
-    for (int i = 0; i < host_set->size; ++i) {
-        xen_host host = host_set->contents[i];
-        xen_host_record *host_record = nullptr;
-        if (!xen_host_get_record(session_, &host_record, host)) {
-            xen_host_set_free(host_set);
-            return false;
-        }
+    // event.from blocks, give it a session of its own
+    event_session_ = xen_session_login_with_password(
+        Rpc_Pool::call_func, rpc_.get(), user_.c_str(), pass_.c_str(),
+        xen_api_latest_version);
 
-        struct host& h = hosts[host_record->uuid];
-        h.uuid = host_record->uuid;
-        h.address = host_record->address;
-        h.host = host_record->hostname;
-        std::cout << "== host " << h.host << std::endl;
-        // scan pif
-        if (host_record->pifs)
-            scan_pif(host_record->pifs);
+    if (event_session_ && event_session_->ok) {
+        waiter_.reset(new Task_Waiter(event_session_, nullptr, session_, &session_mutex_));
+    } else {
+        std::cout << "Failed to login event session, poll tasks instead" << std::endl;
+        if (event_session_)
+            xen_session_logout(event_session_);
+        event_session_ = nullptr;
+        waiter_.reset(new Task_Waiter(session_, &session_mutex_));
     }
 
-    xen_host_set_free(host_set);
-    return true;
-}
-
-bool Xe_Client::scan_pif(struct xen_pif_record_opt_set *pifs)
-{
-    for (int i = 0; i < pifs->size; ++i) {
-        xen_pif_record_opt *opt = pifs->contents[i];
-        if (opt->is_record) {
-            continue;
-        }
-
-        xen_pif_record *pif_record = nullptr;
-        if (!xen_pif_get_record(session_, &pif_record, opt->u.handle)) {
-            return false;
-        } else {
-            // pif.IP = pif_record->IP;
-            // pif.netmask = pif_record->netmask;
-            // pif.gateway = pif_record->gateway;
-            std::cout << "== ip " << pif_record->ip << std::endl;
-            std::cout << "== device " << pif_record->device << std::endl;
-        }
-        xen_pif_record_free(pif_record);
-    }
     return true;
 }
 
 bool Xe_Client::scan_vms()
 {
-    hosts(hosts_);
+    // hosts and vms from the same records
+    Inventory inventory(session_);
+    if (!inventory.load()) {
+        print_error(session_);
+        xen_session_clear_error(session_);
+        return false;
+    }
 
+    inventory.hosts(hosts_);
     std::vector<struct vm> vs;
-    vms(vs);
+    inventory.vms(vs);
     for (auto& v : vs) {
         if (v.host_uuid.empty())
             continue;
@@ -208,20 +153,14 @@ bool Xe_Client::scan_vms()
 
 bool Xe_Client::vms(std::vector<struct vm>& vms)
 {
-    struct xen_vm_set *vm_set = nullptr;
-    if (!xen_vm_get_all(session_, &vm_set))
+    Inventory inventory(session_);
+    if (!inventory.load()) {
+        print_error(session_);
+        xen_session_clear_error(session_);
         return false;
-
-    for (int i = 0; i < vm_set->size; ++i) {
-        xen_vm vm = vm_set->contents[i];
-        struct vm v;
-        if (!get_vm(vm, v))
-            continue;
-
-        vms.emplace_back(std::move(v));
     }
 
-    xen_vm_set_free(vm_set);
+    inventory.vms(vms);
     return true;
 }
 
@@ -258,23 +197,9 @@ bool Xe_Client::get_vifs(xen_vm vm, std::vector<struct vif>& vifs)
             xen_network_record_free(n);
         });
 
-        struct vif vif {
-            .uuid = vif_record->uuid,
-            .device = vif_record->device,
-            .mac = vif_record->mac,
-            .mtu = vif_record->mtu
-        };
-
-        struct network network {
-            .uuid = network_record->uuid,
-            .name_label = network_record->name_label,
-            .name_description = network_record->name_description,
-            .mtu = network_record->mtu,
-            .bridge = network_record->bridge,
-            .managed = network_record->managed
-        };
-
-        vif.network = std::move(network);
+        struct vif vif;
+        vif_from_record(vif_record, vif);
+        network_from_record(network_record, vif.network);
         vifs.push_back(std::move(vif));
     }
 
@@ -297,57 +222,7 @@ bool Xe_Client::get_vm(xen_vm x_vm, struct vm& v, bool snapshot)
         }
     }
 
-    for (int m = 0; m < vm_record->allowed_operations->size; m++) {
-        v.allowed_operations.push_back(vm_record->allowed_operations->contents[m]);
-    }
-
-    v.uuid = vm_record->uuid;
-    v.power_state = (int)vm_record->power_state;
-    v.name_label = vm_record->name_label;
-    v.name_description = vm_record->name_description;
-    v.user_version = vm_record->user_version;
-    v.is_a_template = vm_record->is_a_template;
-    v.memory_overhead = vm_record->memory_overhead;
-    v.memory_target = vm_record->memory_target;
-    v.memory_static_max = vm_record->memory_static_max;
-    v.memory_dynamic_max = vm_record->memory_dynamic_max;
-    v.memory_dynamic_min = vm_record->memory_dynamic_min;
-    v.memory_static_min = vm_record->memory_static_min;
-
-    for (int m = 0; m < vm_record->vcpus_params->size; m++) {
-        xen_string_string_map_contents pair = vm_record->vcpus_params->contents[m];
-        v.vcpus_params[pair.key] = pair.val;
-    }
-    v.vcpus_max = vm_record->vcpus_max;
-    v.vcpus_at_startup = vm_record->vcpus_at_startup;
-    v.actions_after_shutdown = (int)vm_record->actions_after_shutdown;
-    v.actions_after_reboot = (int)vm_record->actions_after_reboot;
-    v.actions_after_crash = (int)vm_record->actions_after_crash;
-
-    v.pv_bootloader = vm_record->pv_bootloader;
-    v.pv_kernel = vm_record->pv_kernel;
-    v.pv_ramdisk = vm_record->pv_ramdisk;
-    v.pv_args = vm_record->pv_args;
-    v.pv_bootloader_args = vm_record->pv_bootloader_args;
-    v.pv_legacy_args = vm_record->pv_legacy_args;
-    v.hvm_boot_policy = vm_record->hvm_boot_policy;
-
-    for (int m = 0; m < vm_record->hvm_boot_params->size; m++) {
-        xen_string_string_map_contents pair = vm_record->hvm_boot_params->contents[m];
-        v.hvm_boot_params[pair.key] = pair.val;
-    }
-
-    v.hvm_shadow_multiplier = vm_record->hvm_shadow_multiplier;
-
-    for (int m = 0; m < vm_record->platform->size; m++) {
-        xen_string_string_map_contents pair = vm_record->platform->contents[m];
-        v.platform[pair.key] = pair.val;
-    }
-
-    for (int m = 0; m < vm_record->other_config->size; m++) {
-        xen_string_string_map_contents pair = vm_record->other_config->contents[m];
-        v.other_config[pair.key] = pair.val;
-    }
+    vm_from_record(vm_record, v);
 
     if (!get_vbds(v, vm_record)) {
         xen_vm_record_free(vm_record);
@@ -369,6 +244,15 @@ bool Xe_Client::get_vm(xen_vm x_vm, struct vm& v, bool snapshot)
             v.host_uuid = host_uuid;
             free(host_uuid);
         }
+
+        // halted vms have no resident_on, affinity is where they will start
+        char* affinity_uuid = nullptr;
+        if (!xen_host_get_uuid(session_, &affinity_uuid, vm_record->affinity->u.handle)) {
+            xen_session_clear_error(session_);
+        } else {
+            v.affinity_uuid = affinity_uuid;
+            free(affinity_uuid);
+        }
     }
 
     xen_vm_record_free(vm_record);
@@ -386,39 +270,39 @@ bool Xe_Client::get_vbds(struct vm &v, xen_vm_record *vm_record)
         xen_vbd_record *vrec = nullptr;
         if (!xen_vbd_get_record(session_, &vrec, opt->u.handle)) {
             return false;
-        } else {
-            if (vrec->type != XEN_VBD_TYPE_DISK) {
-                continue;
-            }
+        }
 
-            struct vbd vb;
-            vb.uuid = vrec->uuid;
-            vb.bootable = vrec->bootable;
-            vb.device = vrec->device;
-            vb.userdevice = vrec->userdevice;
-            if (!vrec->vdi) {
-                v.vbds.push_back(std::move(vb));
-                xen_vbd_record_free(vrec);
-                continue;
-            }
-            // scan vdi
-            xen_vdi_record *vdi_record = nullptr;
-            if (xen_vdi_get_record(session_, &vdi_record, vrec->vdi->u.handle)) {
-                vb.vdi.vdi = (char*)vrec->vdi->u.handle;
-                vb.vdi.uuid = vdi_record->uuid;
-                vb.vdi.name_label = vdi_record->name_label;
-                vb.vdi.name_description = vdi_record->name_description;
-                vb.vdi.virtual_size = vdi_record->virtual_size;
-                vb.vdi.physical_utilisation = vdi_record->physical_utilisation;
-                vb.vdi.type = vdi_record->type;
-                vb.vdi.sharable = vdi_record->sharable;
-                vb.vdi.read_only = vdi_record->read_only;
-                xen_vdi_record_free(vdi_record);
-            }
+        auto r = make_deleter(vrec, [](xen_vbd_record* r) {
+            xen_vbd_record_free(r);
+        });
+
+        if (vrec->type != XEN_VBD_TYPE_DISK) {
+            continue;
+        }
 
+        struct vbd vb;
+        vbd_from_record(vrec, vb);
+        if (!vrec->vdi) {
             v.vbds.push_back(std::move(vb));
-            xen_vbd_record_free(vrec);
+            continue;
         }
+
+        // scan vdi
+        xen_vdi_record *vdi_record = nullptr;
+        if (xen_vdi_get_record(session_, &vdi_record, vrec->vdi->u.handle)) {
+            vdi_from_record(vdi_record, (char*)vrec->vdi->u.handle, vb.vdi);
+
+            char* sr_uuid = nullptr;
+            if (vdi_record->sr && xen_sr_get_uuid(session_, &sr_uuid, vdi_record->sr->u.handle)) {
+                vb.vdi.sr_uuid = sr_uuid;
+                free(sr_uuid);
+            } else {
+                xen_session_clear_error(session_);
+            }
+            xen_vdi_record_free(vdi_record);
+        }
+
+        v.vbds.push_back(std::move(vb));
     }
 
     return true;
@@ -511,7 +395,12 @@ void Xe_Client::dump_sr(const struct sr& sr)
 
 void Xe_Client::dump_backupset(const struct backup_set& b)
 {
-    std::cout << "  set_id: " << b.vm_name << ", type: " << b.type << std::endl;
+    std::cout << "  set_id: " << b.vm_name << ", type: " << b.type;
+    if (!b.parent.empty())
+        std::cout << ", parent: " << b.parent;
+    if (b.synthetic)
+        std::cout << ", synthetic";
+    std::cout << std::endl;
 }
 
 void Xe_Client::dump_vif(const struct vif& vf)
@@ -627,73 +516,12 @@ bool Xe_Client::write_to_json()
 
 bool Xe_Client::add_backup_set(const struct backup_set &bset)
 {
-    std::ifstream input_file(BACKUP_SET_CONF);
-    Json::CharReaderBuilder reader;
-    Json::Value root;
-    JSONCPP_STRING errs;
-
-    if (!Json::parseFromStream(reader, input_file, &root, &errs)) {
-        std::cout << "Error parsing JSON: " << errs << std::endl;
-        input_file.close();
-
-        Json::Value bs(Json::arrayValue);
-        Json::Value s;
-        s["date"] = bset.date;
-        s["set_id"] = bset.vm_name;
-        s["vm_uuid"] = bset.vm_uuid;
-        s["type"] = bset.type;
-
-        bs.append(s);
-        root["sets"] = bs;
-
-        std::ofstream output_file(BACKUP_SET_CONF);
-        output_file << root;
-        output_file.close();
-
-        return true;
-    }
-    input_file.close();
-
-    Json::Value s;
-    s["date"] = bset.date;
-    s["set_id"] = bset.vm_name;
-    s["vm_uuid"] = bset.vm_uuid;
-    s["type"] = bset.type;
-    root["sets"].append(s);
-
-    std::ofstream output_file(BACKUP_SET_CONF);
-    output_file << root;
-    output_file.close();
-
-    return true;
+    return catalog_->add(bset);
 }
 
 bool Xe_Client::load_backup_sets(std::vector<struct backup_set>& bsets)
 {
-    std::ifstream input_file(BACKUP_SET_CONF);
-    Json::CharReaderBuilder reader;
-    Json::Value root;
-    JSONCPP_STRING errs;
-
-    if (!Json::parseFromStream(reader, input_file, &root, &errs)) {
-        std::cout << "Error parsing JSON: " << errs << std::endl;
-        input_file.close();
-        return false;
-    }
-
-    input_file.close();
-
-    for (const auto& s : root["sets"]) {
-        struct backup_set bset {
-            .vm_name = s["set_id"].asString(),
-            .vm_uuid = s["vm_uuid"].asString(),
-            .date = s["date"].asString(),
-            .type = s["type"].asString()
-        };
-
-        bsets.emplace_back(std::move(bset));
-    }
-
+    catalog_->list(bsets);
     return true;
 }
 
@@ -704,6 +532,10 @@ bool Xe_Client::add_vm_meta(const std::string& dir, const struct backup_set &bse
     root["vm_name"] = bset.vm_name;
     root["vm_uuid"] = bset.vm_uuid;
     root["type"] = bset.type;
+    if (!bset.parent.empty())
+        root["parent"] = bset.parent;
+    if (bset.synthetic)
+        root["synthetic"] = true;
 
     Json::Value vm;
     vm["uuid"] = bset.vm.uuid;
@@ -794,6 +626,8 @@ bool Xe_Client::add_vm_meta(const std::string& dir, const struct backup_set &bse
         vdi["type"] = b.vdi.type;
         vdi["sharable"] = b.vdi.sharable;
         vdi["read_only"] = b.vdi.read_only;
+        vdi["sr_uuid"] = b.vdi.sr_uuid;
+        vdi["checksum"] = b.vdi.checksum;
         vbd["vdi"] = vdi;
 
         vbds.append(vbd);
@@ -833,31 +667,16 @@ bool Xe_Client::add_vm_meta(const std::string& dir, const struct backup_set &bse
 
 bool Xe_Client::backup_vm_diff(const std::string &backup_dir, const std::string &vm_uuid)
 {
-    std::vector<struct backup_set> sets;
-    if (!load_backup_sets(sets)) {
-        std::cout << "Failed to get backup sets" << std::endl;
-        return false;
-    }
-
     // find the latest full backup set by vm_uuid
-    auto it = std::find_if(sets.rbegin(), sets.rend(), [&vm_uuid](const struct backup_set& bset) {
-        return bset.vm_uuid == vm_uuid && bset.type == BACKUP_TYPE_FULL;
-    });
-
-    if (it == sets.rend()) {
+    struct backup_set full;
+    struct vm v;
+    if (!find_base_set(backup_dir, vm_uuid, {BACKUP_TYPE_FULL}, full, v)) {
         std::cout << "Failed to find full backup set for vm: " << vm_uuid << std::endl;
         return false;
     }
 
-    const auto& set_id = it->vm_name;
+    const auto& set_id = full.vm_name;
     std::cout << "Found full backup set: " << set_id << std::endl;
-    std::filesystem::path m = std::filesystem::path(backup_dir) / set_id / VM_META_CONF;
-    std::cout << "=== " << m.string() << std::endl;
-    struct vm v;
-    if (!load_vm_meta(m.string(), v)) {
-        std::cout << "Failed to load vm meta: " << m.string() << std::endl;
-        return false;
-    }
 
     struct backup_set bt;
     if (!backup_vm_i(vm_uuid, backup_dir, bt, BACKUP_TYPE_DIFF, v)) {
@@ -866,159 +685,698 @@ bool Xe_Client::backup_vm_diff(const std::string &backup_dir, const std::string
     }
 
     bt.type = BACKUP_TYPE_DIFF;
-    if (!add_backup_set(bt)) {
-        std::cout << "Failed to add backup set: " << vm_uuid << std::endl;
+    bt.parent = set_id;
+    // the set is catalogued last, once its meta is on disk
+    if (!add_vm_meta(backup_dir, bt)) {
+        std::cout << "Failed to add vm meta: " << vm_uuid << std::endl;
         return false;
     }
 
-    if (!add_vm_meta(backup_dir, bt)) {
-        std::cout << "Failed to add vm meta: " << vm_uuid << std::endl;
+    if (!add_backup_set(bt)) {
+        std::cout << "Failed to add backup set: " << vm_uuid << std::endl;
         return false;
     }
 
     return true;
 }
 
-bool Xe_Client::backup_vm(const std::string &vm_uuid, const std::string &backup_dir)
+bool Xe_Client::backup_vm_incr(const std::string &backup_dir, const std::string &vm_uuid)
 {
-    struct backup_set bt;
-    struct vm v;
-    if (!backup_vm_i(vm_uuid, backup_dir, bt, BACKUP_TYPE_FULL, v)) {
-        std::cout << "Failed to backup vm: " << vm_uuid << std::endl;
+    // the newest set of the chain, its snapshot is still on xenserver
+    struct backup_set prev;
+    struct vm prev_v;
+    if (!find_base_set(backup_dir, vm_uuid, {BACKUP_TYPE_FULL, BACKUP_TYPE_INCR}, prev, prev_v)) {
+        std::cout << "Failed to find full or incr backup set for vm: " << vm_uuid << std::endl;
         return false;
     }
 
-    if (!add_backup_set(bt)) {
-        std::cout << "Failed to add backup set: " << vm_uuid << std::endl;
+    std::cout << "Found parent backup set: " << prev.vm_name << std::endl;
+
+    struct backup_set bt;
+    if (!backup_vm_i(vm_uuid, backup_dir, bt, BACKUP_TYPE_INCR, prev_v)) {
+        std::cout << "Failed to backup incr vm: " << vm_uuid
+                  << ", if the snapshot of " << prev.vm_name << " is gone run a full backup" << std::endl;
         return false;
     }
 
+    bt.type = BACKUP_TYPE_INCR;
+    bt.parent = prev.vm_name;
     if (!add_vm_meta(backup_dir, bt)) {
         std::cout << "Failed to add vm meta: " << vm_uuid << std::endl;
         return false;
     }
 
+    if (!add_backup_set(bt)) {
+        std::cout << "Failed to add backup set: " << vm_uuid << std::endl;
+        return false;
+    }
+
+    // the new snapshot is the base of the next incr. The snapshot of a full
+    // stays, diff backups export against it. A synthetic full only took over
+    // the snapshot of the incr it was merged up to, that goes like any other.
+    if (prev.type == BACKUP_TYPE_INCR || prev.synthetic) {
+        xen_vm snap = nullptr;
+        if (xen_vm_get_by_uuid(session_, &snap, (char*)prev_v.uuid.c_str())) {
+            drop_snapshot(snap);
+            xen_vm_free(snap);
+        } else {
+            std::cout << "Failed to find snapshot " << prev_v.uuid << " of " << prev.vm_name << std::endl;
+            xen_session_clear_error(session_);
+        }
+    }
+
     return true;
 }
 
-bool Xe_Client::pifs(std::vector<std::string>& ips, xen_host host)
+bool Xe_Client::find_base_set(const std::string& backup_dir, const std::string& vm_uuid,
+                              const std::vector<std::string>& types,
+                              struct backup_set& bset, struct vm& v)
 {
-    xen_pif_set *pif_set;
-    if (!xen_host_get_pifs(session_, &pif_set, host) || pif_set->size == 0) {
-        std::cout << "Failed to get pifs" << std::endl;
-        return false;
+    std::vector<struct backup_set> sets;
+    catalog_->sets_of(vm_uuid, sets);
+    for (auto it = sets.rbegin(); it != sets.rend(); ++it) {
+        if (std::find(types.begin(), types.end(), it->type) == types.end())
+            continue;
+
+        std::filesystem::path m = std::filesystem::path(backup_dir) / it->vm_name / VM_META_CONF;
+        struct vm meta;
+        if (!load_vm_meta(m.string(), meta))
+            continue;
+
+        // a synthetic full made from a diff, or a snapshot deleted by hand
+        xen_vm snap = nullptr;
+        if (!xen_vm_get_by_uuid(session_, &snap, (char*)meta.uuid.c_str())) {
+            std::cout << "Skip " << it->vm_name << ", its snapshot " << meta.uuid << " is gone" << std::endl;
+            xen_session_clear_error(session_);
+            continue;
+        }
+        xen_vm_free(snap);
+
+        // with cbt the data of snapshots is destroyed after the export, only
+        // a cbt export can use them as a base
+        if (!opts_.cbt && std::any_of(meta.vbds.begin(), meta.vbds.end(), [this](const struct vbd& vb) {
+                xen_vdi_type type;
+                if (!xen_vdi_get_type(session_, &type, (xen_vdi)vb.vdi.vdi.c_str())) {
+                    xen_session_clear_error(session_);
+                    return false;
+                }
+                return type == XEN_VDI_TYPE_CBT_METADATA;
+            })) {
+            std::cout << "Skip " << it->vm_name << ", its snapshot only has cbt metadata" << std::endl;
+            continue;
+        }
+
+        bset = *it;
+        v = std::move(meta);
+        return true;
     }
 
-    auto s = make_deleter(pif_set, [](xen_pif_set* s) {
-        xen_pif_set_free(s);
-    });
+    return false;
+}
 
-    for (int i = 0; i < pif_set->size; i++) {
-        xen_pif_record *pif_record = nullptr;
-        if (!xen_pif_get_record(session_, &pif_record, pif_set->contents[i])) {
-            std::cout << "Failed to get pif record" << std::endl;
+bool Xe_Client::load_chain(const std::string& backup_dir, const struct backup_set& bset,
+                           std::vector<struct backup_set>& chain, std::vector<struct vm>& metas)
+{
+    chain.clear();
+    if (bset.type == BACKUP_TYPE_FULL) {
+        chain.push_back(bset);
+    } else if (!bset.parent.empty()) {
+        if (!catalog_->chain(bset.vm_name, chain) || chain.front().type != BACKUP_TYPE_FULL) {
+            std::cout << "Failed to find backup chain of " << bset.vm_name << std::endl;
             return false;
         }
-
-        if (pif_record->currently_attached) {
-            std::cout << "ip: " << pif_record->ip << std::endl;
-            ips.emplace_back(pif_record->ip);
+    } else {
+        // diff sets from before parent links were recorded
+        struct backup_set full;
+        if (!catalog_->latest(bset.vm_uuid, BACKUP_TYPE_FULL, full)) {
+            std::cout << "Failed to find full backup set for vm: " << bset.vm_uuid << std::endl;
+            return false;
         }
+        chain = {full, bset};
+    }
 
-        xen_pif_record_free(pif_record);
+    metas.assign(chain.size(), vm());
+    for (size_t i = 0; i < chain.size(); i++) {
+        std::filesystem::path m = std::filesystem::path(backup_dir) / chain[i].vm_name / VM_META_CONF;
+        if (!load_vm_meta(m.string(), metas[i])) {
+            std::cout << "Failed to load vm meta: " << m.string() << std::endl;
+            return false;
+        }
     }
 
     return true;
 }
 
-bool Xe_Client::backup_vm_i(const std::string &vm_uuid,
-                            const std::string &backup_dir,
-                            struct backup_set &bt,
-                            const std::string& backup_type,
-                            const struct vm& full_v)
+bool Xe_Client::open_chain(const std::string& backup_dir,
+                           const std::vector<struct backup_set>& chain,
+                           const std::vector<struct vm>& metas,
+                           const std::string& userdevice,
+                           Vhd_Chain& vhds,
+                           bool all_blocks)
 {
-    xen_vm backup_vm = nullptr;
-    if (!xen_vm_get_by_uuid(session_, &backup_vm, (char *)vm_uuid.c_str())) {
-        std::cout << "Failed to get vm by uuid: " << vm_uuid << std::endl;
-        return false;
+    for (size_t i = 0; i < chain.size(); i++) {
+        // a disk added later is a full export in the first set that has it
+        auto it = std::find_if(metas[i].vbds.begin(), metas[i].vbds.end(), [&userdevice](const struct vbd& b) {
+            return b.userdevice == userdevice;
+        });
+        if (it == metas[i].vbds.end())
+            continue;
+
+        const std::string file = stored_file((std::filesystem::path(backup_dir) / chain[i].vm_name
+                                              / (it->vdi.uuid + ".vhd")).string());
+        std::unique_ptr<Source> source = open_source(file);
+        if (!source || !vhds.add(std::move(source))) {
+            std::cout << "Failed to open " << file << std::endl;
+            return false;
+        }
     }
 
-    xen_vm_record *vm_record = nullptr;
-    if (!xen_vm_get_record(session_, &vm_record, backup_vm)) {
-        std::cout << "Failed to get vm record" << std::endl;
+    if (!vhds.open(all_blocks)) {
+        std::cout << "Failed to merge vhds of userdevice " << userdevice << std::endl;
         return false;
     }
 
-    std::string name = vm_record->name_label;
-    std::string desc = vm_record->name_description;
-
-    // choose pif to backup
-    // first get from resident_on, if not, get from affinity
-    //     A VM's affinity host is its "preferred" host.XenServer interprets the "affinity" field as a preference
-    // for where to start/resume a VM for start/resume operations that don't specify a particular host.
-    // If you don't specify a particular host when starting a VM, then XenServer considers the affinity host first,
-    // and will start the VM on that host provided it is suitable.
-    //     XenServer only populates the "resident-on" field once you start a VM. It points to the actual host on
-    // which the VM is currently running
-    std::vector<std::string> ips;
-    std::cout << "get pif from resident_on" << std::endl;
-    pifs(ips, vm_record->resident_on->u.handle);
+    return true;
+}
 
-    if (ips.empty()) {
-        std::cout << "get pif from affinity" << std::endl;
-        pifs(ips, vm_record->affinity->u.handle);
+bool Xe_Client::synth_vm(const std::string &backup_dir, const std::string &vm_uuid)
+{
+    struct backup_set tip;
+    if (!catalog_->latest_of(vm_uuid, {BACKUP_TYPE_FULL, BACKUP_TYPE_DIFF, BACKUP_TYPE_INCR}, tip)) {
+        std::cout << "Failed to find backup set for vm: " << vm_uuid << std::endl;
+        return false;
     }
 
-    std::cout << "choose ip to backup: " << std::endl;
-    for (int i = 0; i < ips.size(); i++) {
-        std::cout << i << ": " << ips[i] << std::endl;
+    if (tip.type == BACKUP_TYPE_FULL) {
+        std::cout << "Newest set " << tip.vm_name << " is already full" << std::endl;
+        return true;
     }
 
-    std::string host_ip;
-    std::string input;
-    std::getline(std::cin, input);
-    try {
-        const int n = std::stoi(input);
-        host_ip = ips.at(n);
-        std::cout << "Selected IP: " << host_ip << std::endl;
-    } catch (std::exception& e) {
-        std::cout << "Invalid input: " << e.what() << std::endl;
+    std::vector<struct backup_set> chain;
+    std::vector<struct vm> metas;
+    if (!load_chain(backup_dir, tip, chain, metas))
         return false;
-    }
-
-    xen_vm_record_free(vm_record);
 
-    const auto& cur_date = current_time_str();
-    bt.date = cur_date;
-    bt.type = BACKUP_TYPE_FULL;
-    const auto& snap_name = vm_uuid + "_" + cur_date;
-    std::cout << "snap_name: " << snap_name << std::endl;
-    bt.vm_name = snap_name;
+    // the newest set describes the vm. Its snapshot, if it still exists,
+    // passes to the new set: the next incr chains onto the synthetic full
+    // and then releases it
+    struct backup_set bt;
+    bt.date = current_time_str();
+    bt.vm_name = vm_uuid + "_" + bt.date;
     bt.vm_uuid = vm_uuid;
+    bt.type = BACKUP_TYPE_FULL;
+    bt.synthetic = true;
+    bt.vm = metas.back();
 
-    // do snapshot
-    xen_vm snap_handle = nullptr;
-    if (!xen_vm_snapshot(session_, &snap_handle,
-                         backup_vm, const_cast<char *>(snap_name.c_str()))) {
-        std::cout << "Failed to snapshot vm: " << vm_uuid << std::endl;
-        return false;
+    std::filesystem::path dir(backup_dir);
+    dir /= bt.vm_name;
+    std::filesystem::create_directory(dir);
+    std::cout << "synth " << bt.vm_name << " from " << chain.size() << " sets up to " << tip.vm_name << std::endl;
+
+    bool ret = true;
+    for (auto& vb : bt.vm.vbds) {
+        Vhd_Chain vhds;
+        if (!open_chain(backup_dir, chain, metas, vb.userdevice, vhds)) {
+            ret = false;
+            break;
+        }
+
+        std::cout << "merge " << vhds.layers() << " vhds of userdevice " << vb.userdevice << std::endl;
+        ret = store_source(vhds, vdi_file(dir.string(), vb.vdi.uuid), vb.vdi.checksum);
+        if (!ret) {
+            std::cout << "Failed to synth vdi " << vb.vdi.uuid << std::endl;
+            break;
+        }
     }
-    xen_vm_free(backup_vm);
 
-    struct vm v;
-    if (!get_vm(snap_handle, v, true)) {
-        std::cout << "Failed to get vm: " << vm_uuid << std::endl;
-        delete_snapshot(snap_handle);
+    if (!ret) {
+        std::error_code ec;
+        Chunk_Store::remove_set(dir.string());
+        std::filesystem::remove_all(dir, ec);
         return false;
     }
-    v.name_label = name;
-    v.name_description = desc;
 
-    // mkdir(snap_name.c_str(), 0777);
-    bool ret = true;
-    for (const auto &vb : v.vbds) {
+    if (!add_vm_meta(backup_dir, bt)) {
+        std::cout << "Failed to add vm meta: " << vm_uuid << std::endl;
+        return false;
+    }
+
+    if (!add_backup_set(bt)) {
+        std::cout << "Failed to add backup set: " << vm_uuid << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool Xe_Client::backup_vm(const std::string &vm_uuid, const std::string &backup_dir)
+{
+    struct backup_set bt;
+    struct vm v;
+    if (!backup_vm_i(vm_uuid, backup_dir, bt, BACKUP_TYPE_FULL, v)) {
+        std::cout << "Failed to backup vm: " << vm_uuid << std::endl;
+        return false;
+    }
+
+    // the set is catalogued last, once its meta is on disk
+    if (!add_vm_meta(backup_dir, bt)) {
+        std::cout << "Failed to add vm meta: " << vm_uuid << std::endl;
+        return false;
+    }
+
+    if (!add_backup_set(bt)) {
+        std::cout << "Failed to add backup set: " << vm_uuid << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool Xe_Client::backup_jobs(const std::string& tag, std::vector<struct job>& jobs)
+{
+    std::vector<struct vm> vs;
+    if (!vms(vs)) {
+        std::cout << "Failed to list vms" << std::endl;
+        return false;
+    }
+
+    for (const auto& v : vs) {
+        if (!tag.empty() && std::find(v.tags.begin(), v.tags.end(), tag) == v.tags.end())
+            continue;
+
+        struct job j;
+        j.id = v.uuid;
+        j.name = v.name_label;
+        j.host = v.host_uuid.empty() ? v.affinity_uuid : v.host_uuid;
+        for (const auto& vb : v.vbds) {
+            if (vb.vdi.sr_uuid.empty())
+                continue;
+
+            if (std::find(j.srs.begin(), j.srs.end(), vb.vdi.sr_uuid) == j.srs.end())
+                j.srs.push_back(vb.vdi.sr_uuid);
+        }
+
+        jobs.emplace_back(std::move(j));
+    }
+
+    return true;
+}
+
+// unmeasured links of a host are probed again after that many seconds
+#define PROBE_RETRY_SECONDS 300
+
+// process wide, the first backup from a host probes it for all clients,
+// which then share its links
+struct cached_stripe {
+    std::shared_ptr<Stripe> stripe;     // null if the host has no usable pif
+    bool probing = false;               // a client is probing the host right now
+    std::chrono::steady_clock::time_point retry;    // probed again from then on
+};
+static std::mutex stripes_mutex;
+static std::condition_variable stripes_cond;
+static std::map<std::string, struct cached_stripe> stripes;
+
+std::shared_ptr<Stripe> Xe_Client::host_stripe(const struct vm& v, const std::vector<std::string>& hosts)
+{
+    // a local sr is only plugged into its own host, exporting from there
+    // saves xapi forwarding the stream
+    std::vector<std::string> candidates;
+    for (const auto& vb : v.vbds) {
+        std::string owner;
+        if (!vb.vdi.sr_uuid.empty() && sr_host(vb.vdi.sr_uuid, owner)
+            && std::find(candidates.begin(), candidates.end(), owner) == candidates.end())
+            candidates.push_back(owner);
+    }
+    for (const auto& h : hosts) {
+        if (std::find(candidates.begin(), candidates.end(), h) == candidates.end())
+            candidates.push_back(h);
+    }
+
+    const std::string probe = v.vbds.empty() ? "" : v.vbds.front().vdi.vdi;
+    const bool probing = opts_.probe_mb > 0 && !probe.empty();
+
+    for (const auto& uuid : candidates) {
+        {
+            // one probe per host at a time, the others wait for its result
+            std::unique_lock<std::mutex> lock(stripes_mutex);
+            stripes_cond.wait(lock, [&uuid]() {
+                auto it = stripes.find(uuid);
+                return it == stripes.end() || !it->second.probing;
+            });
+
+            auto it = stripes.find(uuid);
+            if (it != stripes.end() && std::chrono::steady_clock::now() < it->second.retry) {
+                if (it->second.stripe)
+                    return it->second.stripe;
+                continue;
+            }
+
+            stripes[uuid].probing = true;
+        }
+
+        std::vector<struct host_path> found;
+        std::vector<struct host_path> unprobed;
+        xen_host host = nullptr;
+        if (!xen_host_get_by_uuid(session_, &host, (char *)uuid.c_str())) {
+            xen_session_clear_error(session_);
+            std::lock_guard<std::mutex> lock(stripes_mutex);
+            stripes.erase(uuid);
+            stripes_cond.notify_all();
+            continue;
+        }
+
+        std::cout << "get pif from host " << uuid << std::endl;
+        std::vector<std::string> ips;
+        pifs(ips, host);
+        xen_host_free(host);
+
+        for (const auto& ip : ips) {
+            if (ip.empty())
+                continue;
+
+            struct host_path path;
+            path.ip = ip;
+            unprobed.push_back(path);
+            if (probing && probe_path(ip, probe, path))
+                found.push_back(path);
+        }
+
+        std::stable_sort(found.begin(), found.end(), [](const struct host_path& a, const struct host_path& b) {
+            return a.mbps > b.mbps || (a.mbps == b.mbps && a.latency_ms < b.latency_ms);
+        });
+
+        // measured links are kept for good, unmeasured ones and hosts
+        // without pifs until the next retry
+        struct cached_stripe c;
+        if (!found.empty())
+            c.stripe = std::make_shared<Stripe>(found);
+        else if (!unprobed.empty())
+            c.stripe = std::make_shared<Stripe>(unprobed);
+        c.retry = !found.empty() || (opts_.probe_mb == 0 && !unprobed.empty())
+                  ? std::chrono::steady_clock::time_point::max()
+                  : std::chrono::steady_clock::now() + std::chrono::seconds(PROBE_RETRY_SECONDS);
+
+        {
+            std::lock_guard<std::mutex> lock(stripes_mutex);
+            stripes[uuid] = c;
+            stripes_cond.notify_all();
+        }
+
+        if (c.stripe)
+            return c.stripe;
+    }
+
+    return nullptr;
+}
+
+bool Xe_Client::sr_host(const std::string& sr_uuid, std::string& host_uuid)
+{
+    xen_sr sr = nullptr;
+    if (!xen_sr_get_by_uuid(session_, &sr, (char *)sr_uuid.c_str())) {
+        xen_session_clear_error(session_);
+        return false;
+    }
+
+    xen_sr_record* sr_record = nullptr;
+    const bool got = xen_sr_get_record(session_, &sr_record, sr);
+    xen_sr_free(sr);
+    if (!got) {
+        xen_session_clear_error(session_);
+        return false;
+    }
+
+    auto r = make_deleter(sr_record, [](xen_sr_record* r) {
+        xen_sr_record_free(r);
+    });
+
+    if (sr_record->shared || !sr_record->pbds)
+        return false;
+
+    for (size_t i = 0; i < sr_record->pbds->size; i++) {
+        xen_pbd_record* pbd_record = nullptr;
+        if (!xen_pbd_get_record(session_, &pbd_record, sr_record->pbds->contents[i]->u.handle)) {
+            xen_session_clear_error(session_);
+            continue;
+        }
+
+        char* uuid = nullptr;
+        const bool found = pbd_record->currently_attached && pbd_record->host
+                           && xen_host_get_uuid(session_, &uuid, pbd_record->host->u.handle);
+        xen_pbd_record_free(pbd_record);
+        if (found) {
+            host_uuid = uuid;
+            free(uuid);
+            return true;
+        }
+        xen_session_clear_error(session_);
+    }
+
+    return false;
+}
+
+// curl write callback of a probe, stops the stream after limit bytes
+struct probe_writer {
+    int64_t limit;
+    int64_t bytes;
+    int64_t timed;          // what came after the first write
+    std::chrono::steady_clock::time_point first;
+    std::chrono::steady_clock::time_point last;
+
+    static size_t curl_write(void* contents, size_t size, size_t nmemb, void* userp)
+    {
+        (void) contents;
+        probe_writer* w = static_cast<probe_writer*>(userp);
+        const size_t total = size * nmemb;
+        // the first write only ends the wait for the export to start
+        if (w->bytes == 0) {
+            w->first = std::chrono::steady_clock::now();
+        } else {
+            w->last = std::chrono::steady_clock::now();
+            w->timed += total;
+        }
+        w->bytes += total;
+        return w->bytes >= w->limit ? 0 : total;
+    }
+};
+
+bool Xe_Client::probe_path(const std::string& ip, const std::string& vdi_ref, struct host_path& path)
+{
+    xen_task task = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(session_mutex_);
+        std::string task_name("probe_path");
+        if (!xen_task_create(session_, &task, (char*)task_name.c_str(),
+                             const_cast<char *>("task"))) {
+            print_error(session_, (char*)("Failed to create task"));
+            xen_session_clear_error(session_);
+            return false;
+        }
+    }
+
+    // raw, so thin disks are read as fast as the link goes
+    std::string url = ip;
+    url.append("/export_raw_vdi?session_id=");
+    url.append(session_->session_id);
+    url.append("&task_id=");
+    url.append((char *)task);
+    url.append("&vdi=");
+    url.append(vdi_ref);
+    url.append("&format=raw");
+
+    struct probe_writer writer = {(int64_t)opts_.probe_mb << 20, 0, 0, {}, {}};
+    CURLcode res = CURLE_FAILED_INIT;
+    double connect = 0;
+    CURL* curl = curl_easy_init();
+    if (curl) {
+        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, probe_writer::curl_write);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &writer);
+        curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 5L);
+        res = engine_->perform(curl);
+        curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &connect);
+        curl_easy_cleanup(curl);
+    }
+
+    // the export is cut off on purpose
+    wait_task(task, true);
+    xen_task_free(task);
+
+    const double seconds = std::chrono::duration<double>(writer.last - writer.first).count();
+    if ((res != CURLE_OK && res != CURLE_WRITE_ERROR) || writer.timed == 0 || seconds <= 0) {
+        std::cout << "probe ip: " << ip << " failed, curl rc: " << res << std::endl;
+        return false;
+    }
+
+    path.mbps = (double)writer.timed / (1 << 20) / seconds;
+    path.latency_ms = connect * 1000;
+    std::cout << "probe ip: " << ip << ", " << path.mbps << " MiB/s, "
+              << path.latency_ms << " ms" << std::endl;
+    return true;
+}
+
+bool Xe_Client::pifs(std::vector<std::string>& ips, xen_host host)
+{
+    xen_pif_set *pif_set;
+    if (!xen_host_get_pifs(session_, &pif_set, host) || pif_set->size == 0) {
+        std::cout << "Failed to get pifs" << std::endl;
+        return false;
+    }
+
+    auto s = make_deleter(pif_set, [](xen_pif_set* s) {
+        xen_pif_set_free(s);
+    });
+
+    for (int i = 0; i < pif_set->size; i++) {
+        xen_pif_record *pif_record = nullptr;
+        if (!xen_pif_get_record(session_, &pif_record, pif_set->contents[i])) {
+            std::cout << "Failed to get pif record" << std::endl;
+            return false;
+        }
+
+        if (pif_record->currently_attached) {
+            std::cout << "ip: " << pif_record->ip << std::endl;
+            ips.emplace_back(pif_record->ip);
+        }
+
+        xen_pif_record_free(pif_record);
+    }
+
+    return true;
+}
+
+bool Xe_Client::backup_vm_i(const std::string &vm_uuid,
+                            const std::string &backup_dir,
+                            struct backup_set &bt,
+                            const std::string& backup_type,
+                            const struct vm& full_v)
+{
+    job_ = vm_uuid;
+    xen_vm backup_vm = nullptr;
+    if (!xen_vm_get_by_uuid(session_, &backup_vm, (char *)vm_uuid.c_str())) {
+        std::cout << "Failed to get vm by uuid: " << vm_uuid << std::endl;
+        return false;
+    }
+
+    xen_vm_record *vm_record = nullptr;
+    if (!xen_vm_get_record(session_, &vm_record, backup_vm)) {
+        std::cout << "Failed to get vm record" << std::endl;
+        return false;
+    }
+
+    std::string name = vm_record->name_label;
+    std::string desc = vm_record->name_description;
+
+    // hosts to export from unless a local sr pins the disks: resident_on, if
+    // not, affinity
+    //     A VM's affinity host is its "preferred" host.XenServer interprets the "affinity" field as a preference
+    // for where to start/resume a VM for start/resume operations that don't specify a particular host.
+    // If you don't specify a particular host when starting a VM, then XenServer considers the affinity host first,
+    // and will start the VM on that host provided it is suitable.
+    //     XenServer only populates the "resident-on" field once you start a VM. It points to the actual host on
+    // which the VM is currently running
+    std::vector<std::string> hosts;
+    for (xen_host_record_opt* h : {vm_record->resident_on, vm_record->affinity}) {
+        char* host_uuid = nullptr;
+        if (h && xen_host_get_uuid(session_, &host_uuid, h->u.handle)) {
+            hosts.push_back(host_uuid);
+            free(host_uuid);
+        } else {
+            xen_session_clear_error(session_);
+        }
+    }
+
+    xen_vm_record_free(vm_record);
+
+    // an unfinished set of an earlier run goes on with its own snapshot
+    xen_vm snap_handle = nullptr;
+    std::string snap_name;
+    const bool resumed = opts_.resume
+                         && resume_set(backup_dir, vm_uuid, backup_type, full_v, snap_name, snap_handle);
+
+    // or with the one the batch took ahead
+    std::string ahead_name;
+    std::string ahead_ref;
+    bool ahead = Snapshot_Queue::get()->take(vm_uuid, ahead_name, ahead_ref);
+    if (ahead && resumed) {
+        drop_snapshot((xen_vm)ahead_ref.c_str());
+        ahead = false;
+    } else if (ahead) {
+        snap_name = ahead_name;
+        snap_handle = (xen_vm)strdup(ahead_ref.c_str());
+    }
+
+    if (!resumed && !ahead)
+        snap_name = vm_uuid + "_" + current_time_str();
+
+    bt.date = snap_name.substr(vm_uuid.size() + 1);
+    bt.type = BACKUP_TYPE_FULL;
+    std::cout << "snap_name: " << snap_name << std::endl;
+    bt.vm_name = snap_name;
+    bt.vm_uuid = vm_uuid;
+
+    // cbt has to be on before the snapshot, so the next export can use it
+    if (opts_.cbt && !resumed && !ahead) {
+        struct vm live;
+        if (!get_vm(backup_vm, live) || !enable_cbt(live))
+            std::cout << "Failed to enable cbt on the disks of vm: " << vm_uuid << std::endl;
+    }
+
+    // do snapshot
+    if (!resumed && !ahead && !snapshot(backup_vm, snap_name, snap_handle)) {
+        std::cout << "Failed to snapshot vm: " << vm_uuid << std::endl;
+        return false;
+    }
+    xen_vm_free(backup_vm);
+
+    struct vm v;
+    if (!get_vm(snap_handle, v, true)) {
+        std::cout << "Failed to get vm: " << vm_uuid << std::endl;
+        drop_snapshot(snap_handle);
+        return false;
+    }
+    v.name_label = name;
+    v.name_description = desc;
+
+    auto stripe = host_stripe(v, hosts);
+    if (!stripe) {
+        std::cout << "No attached pif for vm: " << vm_uuid << std::endl;
+        drop_snapshot(snap_handle);
+        return false;
+    }
+    std::cout << "Selected IP:";
+    for (const auto& ip : stripe->ips())
+        std::cout << " " << ip;
+    std::cout << std::endl;
+
+    struct export_job {
+        struct vbd* vb;
+        std::string basevdi;
+        std::string file;
+        bool cbt;           // fetch the changed blocks over nbd
+    };
+
+    std::filesystem::path dir(backup_dir);
+    dir /= snap_name;
+    if (!std::filesystem::exists(dir)) {
+        std::filesystem::create_directory(dir);
+    }
+
+    // until the set is complete, what a later run needs to continue it
+    if (opts_.resume && !resumed) {
+        Json::Value root;
+        root["snapshot"] = v.uuid;
+        root["type"] = backup_type;
+        root["base"] = full_v.uuid;
+        std::ofstream output_file((dir / RESUME_CONF).string());
+        output_file << root;
+    }
+
+    bool ret = true;
+    std::vector<struct export_job> jobs;
+    for (auto &vb : v.vbds) {
         std::string basevdi;
-        if (backup_type == BACKUP_TYPE_DIFF) {
+        if (backup_type != BACKUP_TYPE_FULL) {
             basevdi = find_basevdi_by_userdevice(full_v, vb.userdevice);
             if (basevdi.empty()) {
                 std::cout << "Failed to find basevdi by userdevice: " << vb.userdevice << std::endl;
@@ -1027,37 +1385,91 @@ bool Xe_Client::backup_vm_i(const std::string &vm_uuid,
             }
         }
 
-        xen_task task = nullptr;
-        std::string task_name("export_raw_vdi");
-        if (!xen_task_create(session_, &task, (char*)task_name.c_str(),
-                             const_cast<char *>("task"))) {
-            std::cout << "Failed to create task" << std::endl;
-            ret = false;
-            break;
+        const bool cbt = opts_.cbt && !basevdi.empty() && has_cbt(basevdi) && has_cbt(vb.vdi.vdi);
+        if (opts_.cbt && !basevdi.empty() && !cbt)
+            std::cout << "No cbt on userdevice " << vb.userdevice << ", export against the base vdi" << std::endl;
+
+        jobs.push_back({&vb, basevdi, vdi_file(dir.string(), vb.vdi.uuid), cbt});
+    }
+
+    // every vdi gets its own export task, at most vdi_parallel in flight
+    if (ret && !jobs.empty()) {
+        std::atomic<size_t> next(0);
+        std::atomic<bool> failed(false);
+        const size_t n = std::min(jobs.size(), (size_t)std::max(1, opts_.vdi_parallel));
+        std::cout << "export " << jobs.size() << " vdis, parallel: " << n << std::endl;
+
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < n; i++) {
+            workers.emplace_back([&]() {
+                for (;;) {
+                    const size_t k = next++;
+                    if (k >= jobs.size() || failed)
+                        break;
+
+                    const auto& job = jobs[k];
+                    const bool ok = job.cbt ? export_vdi_cbt(*job.vb, job.basevdi, job.file)
+                                            : export_vdi(*stripe, *job.vb, job.basevdi, job.file);
+                    if (!ok) {
+                        std::cout << "Failed to export vdi: " << job.vb->vdi.uuid << std::endl;
+                        failed = true;
+                    }
+                }
+            });
         }
 
-        std::filesystem::path file(backup_dir);
-        file /= snap_name;
-        if (!std::filesystem::exists(file)) {
-            std::filesystem::create_directory(file);
+        for (auto& t : workers)
+            t.join();
+
+        ret = !failed;
+    }
+
+    if (!ret && opts_.resume) {
+        // the next backup of the vm continues where this one stopped
+        std::cout << "keep unfinished set " << snap_name << " to resume it" << std::endl;
+
+        // chunk refs can not be continued, deduplicated vdis are exported again
+        std::error_code ec;
+        Chunk_Store::remove_set(dir.string());
+        std::vector<std::filesystem::path> manifests;
+        for (const auto& f : std::filesystem::directory_iterator(dir, ec)) {
+            if (f.path().extension() == CHUNKS_SUFFIX)
+                manifests.push_back(f.path());
         }
-        file /= vb.vdi.uuid + ".vhd";
+        for (const auto& m : manifests)
+            std::filesystem::remove(m, ec);
 
-        const auto& url = export_url(host_ip, task, vb.vdi.vdi, basevdi);
-        std::thread t(&Xe_Client::http_download, this, url, file.string());
-        progress(task);
-        t.join();
-        xen_task_free(task);
+        xen_vm_free(snap_handle);
+        return false;
     }
 
     if (!ret) {
-        delete_snapshot(snap_handle);
+        // never leave a half written set behind, it is not in the catalog
+        std::error_code ec;
+        Chunk_Store::remove_set(dir.string());
+        std::filesystem::remove_all(dir, ec);
+        drop_snapshot(snap_handle);
         xen_vm_free(snap_handle);
         return false;
     }
 
-    if (backup_type == BACKUP_TYPE_DIFF)
-        delete_snapshot(snap_handle);
+    std::error_code ec;
+    std::filesystem::remove(dir / RESUME_CONF, ec);
+    for (const auto& job : jobs)
+        std::filesystem::remove(job.file + JOURNAL_SUFFIX, ec);
+
+    if (backup_type == BACKUP_TYPE_DIFF) {
+        drop_snapshot(snap_handle);
+    } else if (opts_.cbt) {
+        // the snapshot is only kept as the base of the next export, cbt
+        // needs its metadata but not its data
+        for (const auto& vb : v.vbds) {
+            if (has_cbt(vb.vdi.vdi) && !xen_vdi_data_destroy(session_, (xen_vdi)vb.vdi.vdi.c_str())) {
+                std::cout << "Failed to destroy data of snapshot vdi " << vb.vdi.uuid << std::endl;
+                xen_session_clear_error(session_);
+            }
+        }
+    }
 
     bt.vm = std::move(v);
     xen_vm_free(snap_handle);
@@ -1065,84 +1477,730 @@ bool Xe_Client::backup_vm_i(const std::string &vm_uuid,
     return true;
 }
 
-void Xe_Client::http_download(const std::string &url, const std::string &file)
+bool Xe_Client::resume_set(const std::string& backup_dir, const std::string& vm_uuid,
+                           const std::string& backup_type, const struct vm& full_v,
+                           std::string& snap_name, xen_vm& snap_handle)
 {
-    std::cout << "start to http download" << std::endl;
+    std::error_code ec;
+    std::vector<std::filesystem::path> unfinished;
+    for (const auto& e : std::filesystem::directory_iterator(backup_dir, ec)) {
+        const std::string dir_name = e.path().filename().string();
+        if (dir_name.compare(0, vm_uuid.size() + 1, vm_uuid + "_") == 0
+            && std::filesystem::exists(e.path() / RESUME_CONF, ec))
+            unfinished.push_back(e.path());
+    }
+
+    bool found = false;
+    for (const auto& dir : unfinished) {
+        std::ifstream input_file((dir / RESUME_CONF).string());
+        Json::CharReaderBuilder reader;
+        Json::Value root;
+        JSONCPP_STRING errs;
+        if (!Json::parseFromStream(reader, input_file, &root, &errs))
+            std::cout << "Failed to load " << (dir / RESUME_CONF).string() << ", err: " << errs << std::endl;
+        input_file.close();
+
+        const std::string snapshot = root.get("snapshot", "").asString();
+        xen_vm snap = nullptr;
+        if (snapshot.empty() || !xen_vm_get_by_uuid(session_, &snap, (char*)snapshot.c_str())) {
+            xen_session_clear_error(session_);
+            snap = nullptr;
+        }
+
+        if (!found && snap && root.get("type", "").asString() == backup_type
+            && root.get("base", "").asString() == full_v.uuid) {
+            std::cout << "resume unfinished set " << dir.filename().string() << std::endl;
+            snap_name = dir.filename().string();
+            snap_handle = snap;
+            found = true;
+            continue;
+        }
+
+        // of another backup type or base, or its snapshot is gone
+        std::cout << "remove unfinished set " << dir.filename().string() << std::endl;
+        if (snap) {
+            drop_snapshot(snap);
+            xen_vm_free(snap);
+        }
+        Chunk_Store::remove_set(dir.string());
+        std::filesystem::remove_all(dir, ec);
+    }
+
+    return found;
+}
+
+// times an export may move to a faster link
+#define MAX_MOVES 3
+
+bool Xe_Client::export_vdi(Stripe& stripe,
+                           struct vbd& vb,
+                           const std::string& basevdi,
+                           const std::string& file)
+{
+    // a journal of an earlier run, the snapshot is the same so is the stream
+    struct transfer_journal j;
+    const bool resumed = opts_.resume && load_journal(file + JOURNAL_SUFFIX, j);
+    if (resumed && j.done) {
+        Xxh64 h;
+        h.set_state(j.hash_state);
+        vb.vdi.checksum = h.hex();
+        std::cout << file << " is already exported, xxh64: " << vb.vdi.checksum << std::endl;
+        return true;
+    }
+
+    std::string head;
+    if (resumed) {
+        File_Source stored(file);
+        head.resize(std::min<int64_t>(VHD_FOOTER_SIZE, j.offset));
+        if (stored.size() < j.offset || !stored.read_at(0, &head[0], head.size())) {
+            std::cout << "Failed to resume " << file << ", export it again" << std::endl;
+            head.clear();
+            j.offset = 0;
+        }
+    }
+
+    std::unique_ptr<Download_Pipeline> pipeline = new_pipeline(file, true, j.offset > 0 ? &j : nullptr);
+    if (pipeline->bytes() > 0)
+        std::cout << "resume export of " << vb.vdi.uuid << " at byte " << pipeline->bytes() << std::endl;
+
+    bool ok = false;
+    struct stripe_stream move;
+    int moves = 0;
+    for (int attempt = 0; !ok && attempt <= std::max(0, opts_.retries); attempt++) {
+        if (attempt > 0 || move.moved) {
+            if (pipeline->failed())
+                break;
+            std::cout << (move.moved ? "move" : "retry") << " export of " << vb.vdi.uuid
+                      << " at byte " << pipeline->bytes() << std::endl;
+        }
+
+        xen_task task = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(session_mutex_);
+            std::string task_name("export_raw_vdi");
+            if (!xen_task_create(session_, &task, (char*)task_name.c_str(),
+                                 const_cast<char *>("task"))) {
+                print_error(session_, (char*)("Failed to create task"));
+                xen_session_clear_error(session_);
+                break;
+            }
+        }
+
+        // every attempt picks its link again, a retry moves off a bad one
+        // and a moved stream off the slow one it left
+        const std::string host_ip = stripe.acquire(move.moved ? move.ip : "");
+        move.stripe = moves < MAX_MOVES ? &stripe : nullptr;
+        move.ip = host_ip;
+        move.moved = false;
+        const int64_t before = pipeline->bytes();
+        const auto start = std::chrono::steady_clock::now();
+        const auto& url = export_url(host_ip, task, vb.vdi.vdi, basevdi);
+        bool changed = false;
+        const bool got = http_download(url, *pipeline, file, head, changed, &move);
+        stripe.release(host_ip, pipeline->bytes() - before,
+                       std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        const bool task_ok = wait_task(task, !got);
+        xen_task_free(task);
+        ok = got && task_ok && !changed;
+
+        // a move is no failure, it does not use up a retry
+        if (move.moved) {
+            moves++;
+            attempt--;
+            continue;
+        }
+
+        if (changed) {
+            // the bytes stored can not be continued, start over with the
+            // next attempt
+            std::cout << "export of " << vb.vdi.uuid << " differs from the stored one" << std::endl;
+            pipeline->finish(false);
+            head.clear();
+            pipeline = new_pipeline(file, true);
+        }
+    }
+
+    const bool stored = pipeline->finish(ok);
+    vb.vdi.checksum = pipeline->checksum();
+    std::cout << file << ": bytes: " << pipeline->bytes() << ", xxh64: " << vb.vdi.checksum << std::endl;
+    return ok && stored;
+}
+
+std::string Xe_Client::vdi_file(const std::string& dir, const std::string& vdi_uuid)
+{
+    std::string file = (std::filesystem::path(dir) / (vdi_uuid + ".vhd")).string();
+    if (opts_.dedup)
+        file += CHUNKS_SUFFIX;
+    else if (opts_.compress)
+        file += ZSTD_SUFFIX;
+    return file;
+}
+
+std::unique_ptr<Download_Pipeline> Xe_Client::new_pipeline(const std::string& file, bool journaled,
+                                                        const struct transfer_journal* from)
+{
+    struct pipeline_options popts;
+    popts.buffer_size = (size_t)std::max(1, opts_.buffer_mb) << 20;
+    popts.buffers = std::max(2, opts_.buffers);
+    std::unique_ptr<Sink> sink;
+    std::unique_ptr<Codec> codec;
+    if (opts_.dedup) {
+        // chunks are compressed one by one by the store
+        sink.reset(new Chunk_Sink(file, (size_t)std::max(4, opts_.chunk_kb) << 10,
+                                  opts_.compress ? opts_.compress_level : 0));
+    } else if (opts_.compress) {
+        sink.reset(new Zstd_Sink(file));
+        codec.reset(new Zstd_Codec(opts_.compress_level));
+        popts.codec_threads = std::max(1, opts_.compress_threads);
+    } else {
+        // only a raw file can be continued at a byte offset
+        if (journaled && opts_.resume) {
+            popts.journal = file + JOURNAL_SUFFIX;
+            popts.journal_bytes = (int64_t)std::max(1, opts_.journal_mb) << 20;
+            // a journal of another stream must not outlive the truncate
+            std::error_code ec;
+            if (!from)
+                std::filesystem::remove(popts.journal, ec);
+        } else {
+            from = nullptr;
+        }
+        sink.reset(new File_Sink(file, opts_.sparse, from ? from->offset : 0));
+    }
+
+    std::unique_ptr<Download_Pipeline> pipeline(
+        new Download_Pipeline(std::move(sink), std::move(codec), popts));
+    if (from && !popts.journal.empty())
+        pipeline->resume(*from);
+    return pipeline;
+}
+
+bool Xe_Client::store_source(Source& source, const std::string& file, std::string& checksum,
+                             bool journaled)
+{
+    struct transfer_journal j;
+    const bool resumed = journaled && opts_.resume && load_journal(file + JOURNAL_SUFFIX, j)
+                         && j.offset <= source.size();
+    if (resumed && j.done) {
+        Xxh64 h;
+        h.set_state(j.hash_state);
+        checksum = h.hex();
+        std::cout << file << " is already stored, xxh64: " << checksum << std::endl;
+        return true;
+    }
+
+    std::unique_ptr<Download_Pipeline> pipeline = new_pipeline(file, journaled, resumed ? &j : nullptr);
+    std::vector<char> buf((size_t)std::max(1, opts_.buffer_mb) << 20);
+    bool ok = true;
+    for (int64_t off = pipeline->bytes(); off < source.size() && ok; off += buf.size()) {
+        const size_t n = std::min<int64_t>(buf.size(), source.size() - off);
+        ok = source.read_at(off, buf.data(), n) && pipeline->feed(buf.data(), n);
+    }
+
+    ok = pipeline->finish(ok) && ok;
+    checksum = pipeline->checksum();
+    std::cout << file << ": bytes: " << pipeline->bytes() << ", xxh64: " << checksum << std::endl;
+    return ok;
+}
+
+static bool base64_decode(const char* in, std::string& out)
+{
+    static const std::string digits =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    uint32_t acc = 0;
+    int bits = 0;
+    out.clear();
+    for (const char* p = in; *p && *p != '='; p++) {
+        if (*p == '\n' || *p == '\r')
+            continue;
+
+        const size_t v = digits.find(*p);
+        if (v == std::string::npos)
+            return false;
+
+        acc = (acc << 6) | (uint32_t)v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out.push_back((char)((acc >> bits) & 0xff));
+        }
+    }
+
+    return true;
+}
+
+bool Xe_Client::export_vdi_cbt(struct vbd& vb, const std::string& basevdi, const std::string& file)
+{
+    // bit n, most significant first, is set if bytes n * CBT_BLOCK changed
+    std::string changed;
+    xen_vdi_nbd_server_info_record_set* infos = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(session_mutex_);
+        char* bitmap = nullptr;
+        if (!xen_vdi_list_changed_blocks(session_, &bitmap, (xen_vdi)basevdi.c_str(),
+                                         (xen_vdi)vb.vdi.vdi.c_str()) || !bitmap) {
+            print_error(session_, (char*)("Failed to list changed blocks"));
+            xen_session_clear_error(session_);
+            return false;
+        }
+
+        const bool decoded = base64_decode(bitmap, changed);
+        free(bitmap);
+        if (!decoded) {
+            std::cout << "Failed to decode changed blocks of " << vb.vdi.uuid << std::endl;
+            return false;
+        }
+
+        if (!xen_vdi_get_nbd_info(session_, &infos, (xen_vdi)vb.vdi.vdi.c_str())) {
+            xen_session_clear_error(session_);
+            infos = nullptr;
+        }
+    }
+
+    if (!infos || infos->size == 0) {
+        std::cout << "No nbd server for vdi " << vb.vdi.uuid
+                  << ", give a network of the host the purpose nbd" << std::endl;
+        if (infos)
+            xen_vdi_nbd_server_info_record_set_free(infos);
+        return false;
+    }
+
+    Nbd_Client nbd;
+    const xen_vdi_nbd_server_info_record* info = infos->contents[0];
+    const bool connected = nbd.connect(info->address, (int)info->port, info->exportname,
+                                       info->cert ? info->cert : "");
+    auto throttle = Throttle::get()->open(job_, info->address);
+    xen_vdi_nbd_server_info_record_set_free(infos);
+    if (!connected)
+        return false;
+
+    const int64_t disk_size = std::min<int64_t>(vb.vdi.virtual_size, nbd.size());
+    const uint32_t per_block = VHD_DEFAULT_BLOCK / CBT_BLOCK;
+    const uint32_t blocks = (uint32_t)((disk_size + VHD_DEFAULT_BLOCK - 1) / VHD_DEFAULT_BLOCK);
+    auto is_changed = [&changed](uint64_t n) {
+        return n / 8 < changed.size() && vhd_bit((const uint8_t*)changed.data(), (uint32_t)n);
+    };
+
+    std::vector<uint32_t> list;
+    int64_t changed_bytes = 0;
+    for (uint32_t b = 0; b < blocks; b++) {
+        uint32_t n = 0;
+        for (uint32_t k = 0; k < per_block; k++)
+            n += is_changed((uint64_t)b * per_block + k);
+        if (n > 0)
+            list.push_back(b);
+        changed_bytes += (int64_t)n * CBT_BLOCK;
+    }
+    std::cout << vb.vdi.uuid << ": " << changed_bytes << " of " << disk_size << " bytes changed" << std::endl;
+
+    // a dynamic vhd with only the changed sectors in its bitmaps, merged
+    // over the parent sets like any other incr
+    struct vhd_footer footer;
+    vhd_init_footer(footer, vb.vdi.virtual_size, VHD_TYPE_DYNAMIC);
+    struct vhd_header header;
+    header.block_size = VHD_DEFAULT_BLOCK;
+    Vhd_Stream stream(footer, header, std::move(list), [&](uint32_t block, uint8_t* bitmap, char* data) {
+        const int64_t base = (int64_t)block * VHD_DEFAULT_BLOCK;
+        memset(data, 0, VHD_DEFAULT_BLOCK);
+        for (uint32_t k = 0; k < per_block;) {
+            if (!is_changed((uint64_t)block * per_block + k)) {
+                k++;
+                continue;
+            }
+
+            // one read for a run of changed cbt blocks
+            uint32_t end = k;
+            while (end < per_block && is_changed((uint64_t)block * per_block + end))
+                end++;
+
+            const int64_t offset = base + (int64_t)k * CBT_BLOCK;
+            const int64_t len = std::min<int64_t>((int64_t)(end - k) * CBT_BLOCK, disk_size - offset);
+            if (len > 0 && throttle)
+                throttle->wait((size_t)len);
+            if (len > 0 && !nbd.read_at(offset, data + (size_t)k * CBT_BLOCK, len))
+                return false;
+
+            for (uint32_t s = k * (CBT_BLOCK / VHD_SECTOR); s < end * (CBT_BLOCK / VHD_SECTOR); s++)
+                vhd_set_bit(bitmap, s);
+            k = end;
+        }
+        return true;
+    });
+
+    const bool ok = store_source(stream, file, vb.vdi.checksum, true);
+    transferred_ += nbd.bytes_read();
+    return ok;
+}
+
+bool Xe_Client::enable_cbt(const struct vm& v)
+{
+    std::lock_guard<std::mutex> lock(session_mutex_);
+    for (const auto& vb : v.vbds) {
+        if (vb.vdi.vdi.empty())
+            continue;
+
+        // a no-op when it is already on
+        if (!xen_vdi_enable_cbt(session_, (xen_vdi)vb.vdi.vdi.c_str())) {
+            print_error(session_, (char*)("Failed to enable cbt"));
+            xen_session_clear_error(session_);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool Xe_Client::has_cbt(const std::string& vdi)
+{
+    std::lock_guard<std::mutex> lock(session_mutex_);
+    bool enabled = false;
+    if (!xen_vdi_get_cbt_enabled(session_, &enabled, (xen_vdi)vdi.c_str())) {
+        xen_session_clear_error(session_);
+        return false;
+    }
+
+    return enabled;
+}
+
+// host of an url, what per host limits count by
+static std::string url_host(const std::string& url)
+{
+    size_t start = url.find("://");
+    start = start == std::string::npos ? 0 : start + 3;
+    const size_t end = url.find_first_of(":/?", start);
+    return url.substr(start, end == std::string::npos ? std::string::npos : end - start);
+}
+
+// seconds a stream runs between the checks for a faster link
+#define MOVE_SECONDS 10
+
+// curl write callback of a download that continues a pipeline. A server
+// that ignores the range sends the stream from its start again, what the
+// pipeline has is then compared with head and dropped. Runs on the loop of
+// the transfer engine, a full pipeline or an exceeded rate pauses the
+// transfer.
+struct resume_writer {
+    CURL* curl;
+    Transfer_Engine* engine;
+    Download_Pipeline* pipeline;
+    std::string* head;
+    int64_t pos;            // in the stream, -1 until the status is known
+    bool changed;
+    Throttle_Stream* throttle;
+    struct stripe_stream* move = nullptr;
+    // the rate of the stream is taken from there
+    std::chrono::steady_clock::time_point mark;
+    int64_t mark_pos = 0;
+
+    static size_t curl_write(void* contents, size_t size, size_t nmemb, void* userp)
+    {
+        resume_writer* w = static_cast<resume_writer*>(userp);
+        const size_t total = size * nmemb;
+        const char* p = static_cast<const char*>(contents);
+
+        if (w->pos < 0) {
+            long code = 0;
+            curl_easy_getinfo(w->curl, CURLINFO_RESPONSE_CODE, &code);
+            w->pos = code == 206 ? w->pipeline->bytes() : 0;
+            // a stream sent from its start again is not worth moving
+            if (w->move && w->pos < w->pipeline->bytes())
+                w->move->movable = false;
+            w->mark = std::chrono::steady_clock::now();
+            w->mark_pos = w->pos;
+        }
+
+        // nothing is taken yet, the next stream continues right here
+        if (w->move && w->move->stripe && w->move->movable) {
+            const auto now = std::chrono::steady_clock::now();
+            const double seconds = std::chrono::duration<double>(now - w->mark).count();
+            if (seconds >= MOVE_SECONDS) {
+                const double mbps = (double)(w->pos - w->mark_pos) / (1 << 20) / seconds;
+                if (w->move->stripe->faster(w->move->ip, mbps)) {
+                    w->move->moved = true;
+                    return 0;
+                }
+                w->mark = now;
+                w->mark_pos = w->pos;
+            }
+        }
+
+        // nothing may change before the data is taken, a paused write is
+        // delivered again
+        size_t skip = 0;
+        if (w->pos < w->pipeline->bytes()) {
+            skip = (size_t)std::min<int64_t>(total, w->pipeline->bytes() - w->pos);
+            if (w->pos < (int64_t)w->head->size()) {
+                const size_t c = std::min<size_t>(skip, w->head->size() - w->pos);
+                if (memcmp(p, w->head->data() + w->pos, c) != 0) {
+                    w->changed = true;
+                    return 0;
+                }
+            }
+        }
+
+        const int64_t at = w->pos + (int64_t)skip;
+        const size_t n = total - skip;
+        if (n > 0) {
+            CURL* curl = w->curl;
+            Transfer_Engine* engine = w->engine;
+            auto ready = [engine, curl]() { engine->resume(curl); };
+            if (w->throttle && !w->throttle->take(n, ready))
+                return CURL_WRITEFUNC_PAUSE;
+            if (!w->pipeline->try_feed(p + skip, n, ready)) {
+                if (w->throttle)
+                    w->throttle->refund(n);
+                return w->pipeline->failed() ? 0 : CURL_WRITEFUNC_PAUSE;
+            }
+        }
+
+        // the start of the stream, to check the next attempt against
+        if (n > 0 && at < VHD_FOOTER_SIZE && at == (int64_t)w->head->size())
+            w->head->append(p + skip, std::min<size_t>(n, VHD_FOOTER_SIZE - at));
+
+        w->pos += total;
+        return total;
+    }
+};
+
+bool Xe_Client::http_download(const std::string &url, Download_Pipeline& pipeline,
+                              const std::string& name, std::string& head, bool& changed,
+                              struct stripe_stream* move)
+{
+    std::cout << "start to http download " << name << std::endl;
     CURL *curl = nullptr;
-    CURLcode res;
-    long http_code;
-    std::ofstream output_file(file, std::ios::binary);
+    CURLcode res = CURLE_FAILED_INIT;
+    long http_code = 0;
+    const int64_t from = pipeline.bytes();
+    auto throttle = Throttle::get()->open(job_, url_host(url));
+    struct resume_writer writer = {nullptr, engine_.get(), &pipeline, &head, -1, false, throttle.get(), move};
 
     curl = curl_easy_init();
 
     if (curl) {
+        writer.curl = curl;
         curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writefile);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &output_file);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, resume_writer::curl_write);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &writer);
         curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
-        //curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
-        res = curl_easy_perform(curl);
+        curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+        const std::string range = std::to_string(from) + "-";
+        if (from > 0)
+            curl_easy_setopt(curl, CURLOPT_RANGE, range.c_str());
+        res = engine_->perform(curl);
         curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+
+        curl_off_t bytes = 0;
+        curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+        transferred_ += bytes;
         curl_easy_cleanup(curl);
     }
 
-    output_file.close();
-    std::cout << "curl rc :" << res << std::endl;
-    std::cout << "http code: " << http_code << std::endl;
+    // a stream shorter than what the pipeline has is another stream too
+    changed = writer.changed || (res == CURLE_OK && from > 0 && writer.pos < from);
+    std::cout << name << " curl rc: " << res << ", http code: " << http_code
+              << ", bytes: " << pipeline.bytes() - from << std::endl;
+    if (move && move->moved)
+        std::cout << name << " leaves " << move->ip << " for a faster link" << std::endl;
+
+    // another stream is never a successful continuation
+    return res == CURLE_OK && (http_code == 200 || (http_code == 206 && from > 0))
+           && !pipeline.failed() && !changed;
 }
 
-void Xe_Client::http_upload(const std::string &url, const std::string &file)
+bool Xe_Client::http_upload(const std::string &url, Source& source, const std::string& name)
 {
-    std::cout << "start to http upload" << std::endl;
+    std::cout << "start to http upload " << name << std::endl;
     CURL *curl = nullptr;
-    CURLcode res;
-    long http_code;
-    std::ifstream upload_file(file, std::ios::binary);
-    if (!upload_file.is_open()) {
-        std::cout << "Failed to open file: " << file << std::endl;
-        return;
-    }
+    CURLcode res = CURLE_FAILED_INIT;
+    long http_code = 0;
+    auto throttle = Throttle::get()->open(job_, url_host(url));
+    struct source_reader reader = {&source, 0, throttle.get()};
 
     curl = curl_easy_init();
 
     if (curl){
+        Transfer_Engine* engine = engine_.get();
+        reader.ready = [engine, curl]() { engine->resume(curl); };
         curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
         curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
         curl_easy_setopt(curl, CURLOPT_PUT, 1L);
-        curl_easy_setopt(curl, CURLOPT_READFUNCTION, readfile);
-        curl_easy_setopt(curl, CURLOPT_READDATA, &upload_file);
+        curl_easy_setopt(curl, CURLOPT_READFUNCTION, source_reader::curl_read);
+        curl_easy_setopt(curl, CURLOPT_READDATA, &reader);
         curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
-
-        struct stat file_info;
-        stat(file.c_str(), &file_info);
+        // raw size, compressed files are decompressed on the fly
         curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE,
-                         (curl_off_t)file_info.st_size);
-        res = curl_easy_perform(curl);
+                         (curl_off_t)source.size());
+        res = engine_->perform(curl);
         curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
         curl_easy_cleanup(curl);
     }
 
-    upload_file.close();
+    transferred_ += reader.pos;
+    std::cout << name << " curl rc: " << res << ", http code: " << http_code
+              << ", bytes: " << reader.pos << std::endl;
 
-    return;
+    return res == CURLE_OK && http_code == 200 && reader.pos == source.size();
 }
 
-void Xe_Client::progress(xen_task task)
+bool Xe_Client::upload_vdi(const std::string& vdi_ref, Vhd_Chain& vhds,
+                           const std::string& name, const std::string& journal)
 {
-    xen_task_status_type task_status;
-    xen_task_get_status(session_, &task_status, task);
-    double progress = 0;
-    while (XEN_TASK_STATUS_TYPE_PENDING == task_status) {
-        if (progress > 0.95) {
-            break;
+    // every segment is its own import task, so only a finished task counts
+    // as progress
+    const size_t per_segment = std::max<size_t>(1, ((size_t)std::max(1, opts_.segment_mb) << 20)
+                                                    / vhds.block_size());
+    const size_t blocks = vhds.blocks().size();
+    const size_t segments = std::max<size_t>(1, (blocks + per_segment - 1) / per_segment);
+
+    // offset is the segments done, the hash state names the chain and the
+    // segmentation they were done with
+    Xxh64 key;
+    key.update(&per_segment, sizeof(per_segment));
+    key.update(vhds.blocks().data(), blocks * sizeof(uint32_t));
+    size_t done = 0;
+    struct transfer_journal j;
+    if (!journal.empty() && load_journal(journal, j) && j.hash_state == key.state()
+        && j.offset < (int64_t)segments) {
+        done = (size_t)j.offset;
+        std::cout << "resume import of " << name << " at segment " << done << " of " << segments << std::endl;
+    }
+
+    for (size_t seg = done; seg < segments; seg++) {
+        bool ok = false;
+        for (int attempt = 0; !ok && attempt <= std::max(0, opts_.retries); attempt++) {
+            if (attempt > 0)
+                std::cout << "retry import of " << name << " segment " << seg << std::endl;
+
+            xen_task task = nullptr;
+            {
+                std::lock_guard<std::mutex> lock(session_mutex_);
+                std::string task_name("import_raw_vdi");
+                if (!xen_task_create(session_, &task, (char*)task_name.c_str(),
+                                     const_cast<char *>("task"))) {
+                    std::cout << "Failed to create task" << std::endl;
+                    xen_session_clear_error(session_);
+                    return false;
+                }
+            }
+
+            std::string url = import_url(task, vdi_ref);
+            std::unique_ptr<Source> part;
+            if (segments > 1)
+                part = vhds.segment(seg * per_segment, per_segment);
+            const bool sent = http_upload(url, part ? *part : vhds, name);
+            const bool task_ok = wait_task(task, !sent);
+            xen_task_free(task);
+            ok = sent && task_ok;
+        }
+
+        if (!ok)
+            return false;
+
+        if (!journal.empty()) {
+            j.offset = (int64_t)seg + 1;
+            j.hash_state = key.state();
+            j.done = false;
+            if (!save_journal(journal, j))
+                std::cout << "Failed to save journal " << journal << std::endl;
+        }
+    }
+
+    if (!journal.empty()) {
+        std::error_code ec;
+        std::filesystem::remove(journal, ec);
+    }
+
+    return true;
+}
+
+bool Xe_Client::wait_task(xen_task task, bool cancel, std::string* ref)
+{
+    if (cancel) {
+        std::lock_guard<std::mutex> lock(session_mutex_);
+        if (!xen_task_cancel(session_, task))
+            xen_session_clear_error(session_);
+    }
+
+    struct task_result r;
+    waiter_->wait(task, r);
+
+    {
+        std::lock_guard<std::mutex> lock(session_mutex_);
+        if (!xen_task_destroy(session_, task))
+            xen_session_clear_error(session_);
+    }
+
+    if (r.status != XEN_TASK_STATUS_TYPE_SUCCESS) {
+        std::cout << "task " << (char*)task << " status: " << r.status
+                  << ", error: " << r.error << std::endl;
+        return false;
+    }
+
+    if (ref) {
+        // the result is an xml value holding the ref
+        const size_t start = r.result.find("OpaqueRef:");
+        if (start == std::string::npos) {
+            std::cout << "task " << (char*)task << " returned no ref: " << r.result << std::endl;
+            return false;
+        }
+        const size_t end = r.result.find('<', start);
+        *ref = r.result.substr(start, end == std::string::npos ? std::string::npos : end - start);
+    }
+
+    return true;
+}
+
+bool Xe_Client::run_tasks(const std::vector<std::string>& refs,
+                          const std::function<bool(xen_task*, const std::string&)>& start,
+                          const std::string& what)
+{
+    bool ok = true;
+    std::vector<xen_task> tasks;
+    {
+        std::lock_guard<std::mutex> lock(session_mutex_);
+        for (const auto& ref : refs) {
+            xen_task task = nullptr;
+            if (!start(&task, ref)) {
+                std::cout << "Failed to " << what << " " << ref << std::endl;
+                xen_session_clear_error(session_);
+                ok = false;
+                break;
+            }
+            tasks.push_back(task);
+        }
+    }
+
+    // the tasks run side by side on xenserver, the order of waiting does not matter
+    for (xen_task task : tasks) {
+        if (!wait_task(task)) {
+            std::cout << "Failed to " << what << std::endl;
+            ok = false;
         }
+        xen_task_free(task);
+    }
+
+    return ok;
+}
 
-        xen_task_get_progress(session_, &progress, task);
-        std::cout << "progress: " << progress << std::endl;
-        std::this_thread::sleep_for(std::chrono::seconds(5));
+bool Xe_Client::snapshot(xen_vm vm, const std::string& name, xen_vm& snap)
+{
+    xen_task task = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(session_mutex_);
+        if (!xen_vm_snapshot_async(session_, &task, vm, (char *)name.c_str())) {
+            print_error(session_, (char*)("Failed to start snapshot"));
+            xen_session_clear_error(session_);
+            return false;
+        }
     }
 
-    return;
+    std::string ref;
+    const bool ok = wait_task(task, false, &ref);
+    xen_task_free(task);
+    if (!ok)
+        return false;
+
+    snap = (xen_vm)strdup(ref.c_str());
+    return true;
 }
 
 std::string Xe_Client::export_url(const std::string& host,
@@ -1196,57 +2254,34 @@ bool Xe_Client::scan_srs()
 
 bool Xe_Client::srs(std::vector<struct sr>& srs)
 {
-    xen_sr_set* sr_set = nullptr;
-    if (!xen_sr_get_all(session_, &sr_set)) {
-        std::cout << "Failed to get sr set" << std::endl;
+    xen_sr_xen_sr_record_map* sr_map = nullptr;
+    if (!xen_sr_get_all_records(session_, &sr_map)) {
+        std::cout << "Failed to get sr records" << std::endl;
         return false;
     }
 
-    if (!sr_set) {
+    if (!sr_map) {
         std::cout << "sr set is null" << std::endl;
         return false;
     }
 
-    bool ret = true;
-    for (int i = 0; i < sr_set->size; i++) {
-        if (!sr_set->contents[i]) {
-            continue;
-        }
-
-        xen_sr sr = sr_set->contents[i];
-        xen_sr_record* sr_record = nullptr;
-        if (!xen_sr_get_record(session_, &sr_record, sr)) {
-            std::cout << "Failed to get sr record" << std::endl;
-            ret = false;
-            goto out;
-        }
+    auto m = make_deleter(sr_map, [](xen_sr_xen_sr_record_map* m) {
+        xen_sr_xen_sr_record_map_free(m);
+    });
 
+    for (int i = 0; i < sr_map->size; i++) {
+        xen_sr_record* sr_record = sr_map->contents[i].val;
         if (!sr_record) {
-            std::cout << "sr record is null" << std::endl;
-            ret = false;
-            goto out;
+            continue;
         }
 
         if (strcmp(sr_record->type, "iso") == 0 || strcmp(sr_record->type, "udev") == 0) {
-            xen_sr_record_free(sr_record);
             continue;
         }
 
-        struct sr s {
-            sr_record->uuid,
-            sr_record->name_label,
-            sr_record->name_description,
-            sr_record->type,
-            sr_record->physical_size,
-            sr_record->physical_utilisation
-        };
-
+        struct sr s;
+        sr_from_record(sr_record, s);
         srs.emplace_back(std::move(s));
-        xen_sr_record_free(sr_record);
-    }
-out:
-    if (sr_set) {
-        xen_sr_set_free(sr_set);
     }
 
     return true;
@@ -1265,19 +2300,19 @@ bool Xe_Client::scan_networks()
 
 bool Xe_Client::networks(std::vector<struct network>& networks)
 {
-    xen_network_set* network_set = nullptr;
-    if (!xen_network_get_all(session_, &network_set)) {
-        std::cout << "Failed to get network set" << std::endl;
+    xen_network_xen_network_record_map* network_map = nullptr;
+    if (!xen_network_get_all_records(session_, &network_map)) {
+        std::cout << "Failed to get network records" << std::endl;
         return false;
     }
 
+    auto m = make_deleter(network_map, [](xen_network_xen_network_record_map* m) {
+        xen_network_xen_network_record_map_free(m);
+    });
+
     std::cout << "================ network ================" << std::endl;
-    for (int i = 0; i < network_set->size; i++) {
-        xen_network_record *network_record = nullptr;
-        if (!xen_network_get_record(session_, &network_record, network_set->contents[i])) {
-            std::cout << "Failed to get network record" << std::endl;
-            return false;
-        }
+    for (int i = 0; i < network_map->size; i++) {
+        xen_network_record *network_record = network_map->contents[i].val;
 
         std::cout << "uuid: " << network_record->uuid << std::endl;
         std::cout << "  name_label: " << network_record->name_label << std::endl;
@@ -1286,71 +2321,176 @@ bool Xe_Client::networks(std::vector<struct network>& networks)
         std::cout << "  MTU: " << network_record->mtu << std::endl;
         std::cout << "  managed " << network_record->managed << std::endl;
 
-        networks.emplace_back(network {
-            network_record->uuid,
-            network_record->name_label,
-            network_record->name_description,
-            network_record->mtu,
-            network_record->bridge,
-            network_record->managed
-        });
+        struct network n;
+        network_from_record(network_record, n);
+        networks.emplace_back(std::move(n));
+    }
+    std::cout << "======================================" << std::endl;
+
+    return true;
+}
+
+bool Xe_Client::restore_vm(const std::string& storage_dir,
+                           const std::string& set_id,
+                           const struct restore_target* target)
+{
+    job_ = set_id;
+    struct backup_set bset;
+    if (!catalog_->find(set_id, bset)) {
+        std::cout << "Failed to find backup set: " << set_id << std::endl;
+        return false;
+    }
+
+    // the full the set was exported against, then every set up to it
+    std::vector<struct backup_set> chain;
+    std::vector<struct vm> metas;
+    if (!load_chain(storage_dir, bset, chain, metas))
+        return false;
+
+    std::cout << "full_set_id: " << chain.front().vm_name << ", sets: " << chain.size() << std::endl;
+    std::string new_uuid;
+    if (!restore_vm_full(storage_dir, chain, metas, new_uuid, target)) {
+        std::cout << "Failed to restore vm " << set_id << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool Xe_Client::select_disks(const std::string& storage_dir,
+                             const std::string& set_id,
+                             const std::vector<std::string>& userdevices,
+                             std::vector<struct backup_set>& chain,
+                             std::vector<struct vm>& metas,
+                             std::vector<struct vbd>& vbds)
+{
+    struct backup_set bset;
+    if (!catalog_->find(set_id, bset)) {
+        std::cout << "Failed to find backup set: " << set_id << std::endl;
+        return false;
+    }
+
+    if (!load_chain(storage_dir, bset, chain, metas))
+        return false;
+
+    for (const auto& userdevice : userdevices) {
+        const auto& all = metas.back().vbds;
+        auto it = std::find_if(all.begin(), all.end(), [&userdevice](const struct vbd& vb) {
+            return vb.userdevice == userdevice;
+        });
+        if (it == all.end()) {
+            std::cout << "No disk at userdevice " << userdevice << " in set " << set_id << std::endl;
+            return false;
+        }
+        vbds.push_back(*it);
+    }
+
+    return true;
+}
+
+bool Xe_Client::restore_disks(const std::string& storage_dir,
+                              const std::string& set_id,
+                              const std::vector<std::string>& userdevices,
+                              const std::string& sr_uuid)
+{
+    job_ = set_id;
+    std::vector<struct backup_set> chain;
+    std::vector<struct vm> metas;
+    std::vector<struct vbd> vbds;
+    if (!select_disks(storage_dir, set_id, userdevices, chain, metas, vbds))
+        return false;
+
+    // no vm, the vdis are left unattached
+    if (!restore_vdi(storage_dir, chain, metas, sr_uuid, "", vbds)) {
+        std::cout << "Failed to restore disks of " << set_id << std::endl;
+        return false;
     }
-    std::cout << "======================================" << std::endl;
 
     return true;
 }
 
-bool Xe_Client::restore_vm(const std::string& storage_dir,
-                           const std::string& set_id)
+bool Xe_Client::restore_disk_in_place(const std::string& storage_dir,
+                                      const std::string& set_id,
+                                      const std::string& userdevice,
+                                      const std::string& vdi_uuid)
 {
-    std::vector<struct backup_set> sets;
-    if (!load_backup_sets(sets)) {
-        std::cout << "Failed to get backup sets" << std::endl;
+    job_ = set_id;
+    std::vector<struct backup_set> chain;
+    std::vector<struct vm> metas;
+    std::vector<struct vbd> vbds;
+    if (!select_disks(storage_dir, set_id, {userdevice}, chain, metas, vbds))
+        return false;
+    const struct vbd& vb = vbds.front();
+
+    xen_vdi vdi = nullptr;
+    if (!xen_vdi_get_by_uuid(session_, &vdi, (char*)vdi_uuid.c_str())) {
+        std::cout << "Failed to get vdi by " << vdi_uuid << std::endl;
+        return false;
+    }
+
+    const std::string vdi_ref = (char*)vdi;
+    xen_vdi_record* vdi_record = nullptr;
+    const bool got = xen_vdi_get_record(session_, &vdi_record, vdi);
+    xen_vdi_free(vdi);
+    if (!got) {
+        std::cout << "Failed to get vdi record of " << vdi_uuid << std::endl;
         return false;
     }
 
-    auto it = std::find_if(sets.begin(), sets.end(), [&set_id](const struct backup_set& bset) {
-        return bset.vm_name == set_id;
+    auto r = make_deleter(vdi_record, [](xen_vdi_record* r) {
+        xen_vdi_record_free(r);
     });
 
-    if (it == sets.end()) {
-        std::cout << "Failed to find backup set: " << set_id << std::endl;
+    if (vdi_record->virtual_size < vb.vdi.virtual_size) {
+        std::cout << "vdi " << vdi_uuid << " is smaller than the disk: " << vdi_record->virtual_size
+                  << " < " << vb.vdi.virtual_size << std::endl;
         return false;
     }
 
-    const auto& type = it->type;
-    std::string new_uuid;
-    if (type == BACKUP_TYPE_FULL) {
-        std::cout << "full_set_id: " << set_id << std::endl;
-        if (!restore_vm_full(storage_dir, set_id, new_uuid)) {
-            std::cout << "Failed to restore vm " << set_id << std::endl;
-            return false;
-        }
-    } else {
-        const auto& vm_uuid = it->vm_uuid;
-
-        // diff restore, find the latest full backup set
-        auto it2 = std::find_if(sets.rbegin(), sets.rend(), [&vm_uuid](const struct backup_set& bset) {
-            return bset.vm_uuid == vm_uuid && bset.type == BACKUP_TYPE_FULL;
-        });
+    // overwriting a disk under a running vm would corrupt it
+    for (int i = 0; vdi_record->vbds && i < vdi_record->vbds->size; i++) {
+        xen_vbd_record_opt *opt = vdi_record->vbds->contents[i];
+        xen_vbd_record *vrec = nullptr;
+        if (opt->is_record || !xen_vbd_get_record(session_, &vrec, opt->u.handle))
+            continue;
 
-        if (it2 == sets.rend()) {
-            std::cout << "Failed to find full backup set for vm: " << vm_uuid << std::endl;
+        const bool attached = vrec->currently_attached;
+        xen_vbd_record_free(vrec);
+        if (attached) {
+            std::cout << "vdi " << vdi_uuid << " is attached to a running vm" << std::endl;
             return false;
         }
+    }
+    xen_session_clear_error(session_);
+
+    // import_raw_vdi only writes the blocks the vhd has, the old data of
+    // every other block has to be overwritten with zeros. Running the same
+    // restore again after a failure skips the segments already imported.
+    Vhd_Chain vhds;
+    const std::string journal = (std::filesystem::path(storage_dir) / set_id
+                                 / (userdevice + "_" + vdi_uuid + JOURNAL_SUFFIX)).string();
+    if (!open_chain(storage_dir, chain, metas, userdevice, vhds, true)
+        || !upload_vdi(vdi_ref, vhds, vb.vdi.uuid, opts_.resume ? journal : "")) {
+        std::cout << "Failed to import vdi " << vb.vdi.uuid << " into " << vdi_uuid << std::endl;
+        return false;
+    }
 
-        const auto& full_set_id = it2->vm_name;
-        std::cout << "full_set_id: " << full_set_id << std::endl;
-        if (!restore_vm_full(storage_dir, full_set_id, new_uuid)) {
-            std::cout << "Failed to restore vm " << set_id << std::endl;
-            return false;
-        }
+    std::cout << "restored userdevice " << userdevice << " of " << set_id << " into vdi " << vdi_uuid << std::endl;
+    return true;
+}
 
-        std::cout << "==== start to restore diff set: " << set_id << std::endl;
-        if (!restore_vm_diff(storage_dir, set_id, new_uuid)) {
-            std::cout << "Failed to restore vm " << set_id << std::endl;
+bool Xe_Client::restore_jobs(const std::string& storage_dir, std::vector<struct job>& jobs)
+{
+    for (auto& j : jobs) {
+        struct backup_set bset;
+        if (!catalog_->find(j.id, bset)) {
+            std::cout << "Failed to find backup set: " << j.id << std::endl;
             return false;
         }
+
+        struct vm v;
+        std::filesystem::path m = std::filesystem::path(storage_dir) / j.id / VM_META_CONF;
+        j.name = load_vm_meta(m.string(), v) ? v.name_label : bset.vm_uuid;
     }
 
     return true;
@@ -1378,76 +2518,110 @@ bool Xe_Client::scan_all()
 
 bool Xe_Client::backupset_list(std::vector<struct backup_set>& bsets)
 {
-    std::ifstream file(BACKUP_SET_CONF);
-    Json::CharReaderBuilder reader;
-    Json::Value root;
-    JSONCPP_STRING errs;
+    catalog_->list(bsets);
+    return true;
+}
 
-    if (!Json::parseFromStream(reader, file, &root, &errs)) {
-        std::cout << "Failed to load backupset list " << BACKUP_SET_CONF << ", err: " << errs << std::endl;
-        file.close();
-        return false;
-    }
-    file.close();
+bool Xe_Client::rm_backupset(const std::string& backup_dir, const std::string& set_id)
+{
+    std::vector<struct backup_set> sets;
+    if (set_id == "all") {
+        catalog_->list(sets);
+    } else {
+        struct backup_set bset;
+        if (!catalog_->find(set_id, bset)) {
+            std::cout << "Failed to find backup set: " << set_id << std::endl;
+            return false;
+        }
 
-    for (const auto& b : root["sets"]) {
-        bsets.emplace_back(backup_set {
-            b["set_id"].asString(),
-            b["vm_uuid"].asString(),
-            b["date"].asString(),
-            b["type"].asString()
-        });
+        if (catalog_->has_children(set_id)) {
+            std::cout << "Backup set " << set_id << " is the parent of newer sets, remove them first" << std::endl;
+            return false;
+        }
+        sets.push_back(bset);
     }
 
-    return true;
-}
+    bool ret = true;
+    std::filesystem::path m;
+    for (const auto& s : sets) {
+        // out of the catalog first, a set without files is never restored
+        if (!catalog_->remove(s.vm_name)) {
+            std::cout << "Failed to remove backup set: " << s.vm_name << std::endl;
+            ret = false;
+            continue;
+        }
 
-void Xe_Client::update_backup_set(const std::vector<struct backup_set>& bsets)
-{
-    Json::Value root;
-    Json::Value sets(Json::arrayValue);
-    for (const auto& b : bsets) {
-        Json::Value s;
-        s["set_id"] = b.vm_name;
-        s["type"] = b.type;
-        s["vm_uuid"] = b.vm_uuid;
-        s["date"] = b.date;
-        sets.append(s);
+        try {
+            m.clear();
+            m /= (backup_dir + "/" + s.vm_name);
+            if (std::filesystem::is_directory(m)) {
+                // drop its chunk references first, shared chunks stay
+                Chunk_Store::remove_set(m.string());
+                std::filesystem::remove_all(m);
+            }
+        } catch (const std::exception& ex) {
+            std::cerr << "err: " << ex.what() << std::endl;
+        }
     }
-    root["sets"] = sets;
 
-    std::ofstream out(BACKUP_SET_CONF);
-    out << root;
-    out.close();
+    return ret;
 }
 
-bool Xe_Client::rm_backupset(const std::string& backup_dir, const std::string& set_id)
+bool Xe_Client::verify_backupset(const std::string& backup_dir, const std::string& set_id)
 {
-    std::vector<struct backup_set> sets;
-    if (!load_backup_sets(sets)) {
-        std::cout << "Failed to get backup sets" << std::endl;
+    const std::filesystem::path dir = std::filesystem::path(backup_dir) / set_id;
+    struct vm v;
+    if (!load_vm_meta((dir / VM_META_CONF).string(), v)) {
+        std::cout << "Failed to load vm meta of set " << set_id << std::endl;
         return false;
     }
 
-    std::filesystem::path m;
-    if (set_id == "all") {
-        for (const auto& s : sets) {
-            try {
-                m.clear();
-                m /= (backup_dir + "/" + s.vm_name);
-                if (std::filesystem::is_directory(m)) {
-                    std::filesystem::remove_all(m);
-                }
-            } catch (const std::exception& ex) {
-                std::cerr << "err: " << ex.what() << std::endl;
+    bool ret = true;
+    for (const auto& vb : v.vbds) {
+        const std::string file = stored_file((dir / (vb.vdi.uuid + ".vhd")).string());
+        std::unique_ptr<Source> source = open_source(file);
+        if (!source) {
+            std::cout << "Failed to open " << file << std::endl;
+            ret = false;
+            continue;
+        }
+
+        Vhd_Reader vhd(source.get());
+        std::string err;
+        if (!vhd.open() || !vhd.verify(err)) {
+            std::cout << "Invalid vhd " << file << ": " << err << std::endl;
+            ret = false;
+            continue;
+        }
+
+        std::cout << file << ": type " << vhd.footer().disk_type << ", size "
+                  << vhd.disk_size() << ", blocks " << vhd.allocated_blocks() << "/" << vhd.blocks()
+                  << ", data " << (int64_t)vhd.allocated_blocks() * vhd.block_size() << std::endl;
+
+        if (vb.vdi.checksum.empty())
+            continue;
+
+        Xxh64 hash;
+        std::vector<char> buf(4 << 20);
+        for (int64_t off = 0; off < source->size(); off += buf.size()) {
+            const size_t n = std::min<int64_t>(buf.size(), source->size() - off);
+            if (!source->read_at(off, buf.data(), n)) {
+                std::cout << "Failed to read " << file << " at " << off << std::endl;
+                ret = false;
+                break;
             }
+            hash.update(buf.data(), n);
         }
 
-        sets.clear();
-        update_backup_set(sets);
+        if (hash.hex() != vb.vdi.checksum) {
+            std::cout << "Checksum mismatch " << file << ": " << hash.hex()
+                      << ", expected " << vb.vdi.checksum << std::endl;
+            ret = false;
+        }
     }
 
-    return true;
+    std::cout << "set " << set_id << (ret ? " is ok" : " is damaged") << std::endl;
+    return ret;
 }
 
 bool Xe_Client::load_vm_meta(const std::string& file, struct vm &vm)
@@ -1524,6 +2698,8 @@ bool Xe_Client::load_vm_meta(const std::string& file, struct vm &vm)
         vb.vdi.type = vbd["vdi"]["type"].asInt();
         vb.vdi.sharable = vbd["vdi"]["sharable"].asBool();
         vb.vdi.read_only = vbd["vdi"]["read_only"].asBool();
+        vb.vdi.sr_uuid = vbd["vdi"]["sr_uuid"].asString();
+        vb.vdi.checksum = vbd["vdi"]["checksum"].asString();
 
         vm.vbds.emplace_back(std::move(vb));
     }
@@ -1790,198 +2966,310 @@ bool Xe_Client::restore_vif(const std::string& vm_uuid,
     return ret;
 }
 
-bool Xe_Client::restore_vm_diff(const std::string& storage_dir,
-                                const std::string& set_id,
-                                const std::string& vm_uuid)
+bool Xe_Client::create_vbd(const std::string& vm_uuid,
+                           const std::string& vdi_ref,
+                           const struct vbd& vb,
+                           std::string& vbd_ref)
 {
-    // load diff vm info
-    std::filesystem::path meta_file(storage_dir);
-    meta_file /= (set_id + "/" + VM_META_CONF);
-    struct vm diff_v;
-    if (!load_vm_meta(meta_file.string(), diff_v)) {
-        std::cout << "Failed to load vm meta from " << meta_file << std::endl;
-        return false;
-    }
-
-    xen_vm vm;
-    if (!xen_vm_get_by_uuid(session_, &vm, (char*)vm_uuid.c_str())) {
+    xen_vm new_vm2 = nullptr;
+    if (!xen_vm_get_by_uuid(session_, &new_vm2, (char*)vm_uuid.c_str())) {
         std::cout << "Failed to get vm by " << vm_uuid << std::endl;
+        xen_session_clear_error(session_);
         return false;
     }
 
-    struct vm full_v;
-    if (!get_vm(vm, full_v)) {
-        std::cout << "Failed to get vm" << std::endl;
-    }
-    xen_vm_free(vm);
-
-    for (const auto& vb : diff_v.vbds) {
-        std::string vdi = find_basevdi_by_userdevice(full_v, vb.userdevice);
-        if (vdi.empty()) {
-            std::cout << "Failed to find base vdi by userdevice " << vb.userdevice << std::endl;
-            return false;
-        }
-
-        xen_task task = nullptr;
-        std::string task_name("import_raw_vdi");
-        if (!xen_task_create(session_, &task, (char*)task_name.c_str(),
-                             const_cast<char *>("task"))) {
-            std::cout << "Failed to create task" << std::endl;
-            return false;
-        }
-
-        std::string url = import_url(task, vdi);
-
-        std::filesystem::path file(storage_dir);
-        file /= (set_id + "/" + vb.vdi.uuid + ".vhd");
-        std::thread t(&Xe_Client::http_upload, this, url, file.string());
-        progress(task);
-        t.join();
+    // new_vm2 and the vdi handle are freed by xen_vbd_record_free
+    xen_vm_record_opt* vm_record_opt = xen_vm_record_opt_alloc();
+    vm_record_opt->is_record = false;
+    vm_record_opt->u.handle = new_vm2;
+
+    xen_vdi_record_opt* vdi0_record_opt = xen_vdi_record_opt_alloc();
+    vdi0_record_opt->is_record = false;
+    vdi0_record_opt->u.handle = (xen_vdi)strdup(vdi_ref.c_str());
+
+    xen_vbd_record *vbd0_record = xen_vbd_record_alloc();
+    vbd0_record->vm = vm_record_opt;
+    vbd0_record->vdi = vdi0_record_opt;
+    vbd0_record->userdevice = strdup(vb.userdevice.c_str());
+    vbd0_record->device = strdup(vb.device.c_str());
+    vbd0_record->type = xen_vbd_type_from_string(session_, "Disk");
+    vbd0_record->mode = XEN_VBD_MODE_RW;
+    vbd0_record->qos_algorithm_params = xen_string_string_map_alloc(0);
+    vbd0_record->other_config = xen_string_string_map_alloc(0);
+    vbd0_record->bootable = vb.bootable;
+
+    xen_vbd vbd0 = nullptr;
+    const bool vbd_ok = xen_vbd_create(session_, &vbd0, vbd0_record);
+    xen_vbd_record_free(vbd0_record);
+    if (!vbd_ok) {
+        std::cout << "Failed to create vbd0" << std::endl;
+        xen_session_clear_error(session_);
+        return false;
     }
 
+    vbd_ref = (char*)vbd0;
+    xen_vbd_free(vbd0);
     return true;
 }
 
-bool Xe_Client::restore_vdi(const std::string& storage_dir,
-                            const std::string& set_id,
-                            const std::string& sr_uuid,
-                            const std::string& vm_uuid,
-                            std::vector<struct vbd>& vbds)
+bool Xe_Client::import_vdi(const std::string& storage_dir,
+                           const std::vector<struct backup_set>& chain,
+                           const std::vector<struct vm>& metas,
+                           const std::string& sr_uuid,
+                           const std::string& vm_uuid,
+                           const struct vbd& vb,
+                           bool plug,
+                           std::string& vdi_ref,
+                           std::string& vbd_ref)
 {
-    enum xen_vbd_type vbd_type_disk = xen_vbd_type_from_string(session_, "Disk");
-    for (const auto& vb : vbds) {
-        // must in for loop,  sr will be free by xen_vdi_record_free
+    {
+        std::lock_guard<std::mutex> lock(session_mutex_);
         xen_sr sr = nullptr;
         if (!xen_sr_get_by_uuid(session_, &sr, (char *)sr_uuid.c_str())) {
             std::cout << "Failed to get sr by " << sr_uuid  << std::endl;
+            xen_session_clear_error(session_);
             return false;
         }
 
+        // sr is freed by xen_vdi_record_free
         xen_sr_record_opt* sr_record_opt = xen_sr_record_opt_alloc();
         sr_record_opt->is_record = false;
         sr_record_opt->u.handle = sr;
 
-        xen_string_string_map *other_config = xen_string_string_map_alloc(0);
         xen_vdi_record* vdi0_record = xen_vdi_record_alloc();
         vdi0_record->sr = sr_record_opt;
-        // vdi0_record->virtual_size = (int64_t)10 * 1024 * 1024 * 1024;
-        // vdi0_record->type = XEN_VDI_TYPE_SYSTEM;
-        // vdi0_record->sharable = false;
-        // vdi0_record->read_only = false;
         vdi0_record->virtual_size = vb.vdi.virtual_size;
         vdi0_record->type = (xen_vdi_type)vb.vdi.type;
         vdi0_record->sharable = vb.vdi.sharable;
         vdi0_record->read_only = vb.vdi.read_only;
-        vdi0_record->other_config = other_config;
+        vdi0_record->other_config = xen_string_string_map_alloc(0);
+        vdi0_record->name_label = strdup(vb.vdi.name_label.c_str());
+        vdi0_record->name_description = strdup(vb.vdi.name_description.c_str());
 
         xen_vdi vdi0 = nullptr;
-        if (!xen_vdi_create(session_, &vdi0, vdi0_record)) {
+        const bool vdi_ok = xen_vdi_create(session_, &vdi0, vdi0_record);
+        xen_vdi_record_free(vdi0_record);
+        if (!vdi_ok) {
             std::cout << "Failed to create vdi0" << std::endl;
-            xen_vdi_record_free(vdi0_record);
+            xen_session_clear_error(session_);
             return false;
         }
-        xen_vdi_record_free(vdi0_record);
+        vdi_ref = (char*)vdi0;
+        char* uuid = nullptr;
+        if (xen_vdi_get_uuid(session_, &uuid, vdi0) && uuid) {
+            std::cout << "created vdi " << uuid << " for userdevice " << vb.userdevice << std::endl;
+            free(uuid);
+        } else {
+            xen_session_clear_error(session_);
+        }
+        xen_vdi_free(vdi0);
 
-        // must in for loop, xen_vm will be free by xen_vm_record_free every loop
-        xen_vm new_vm2;
-        if (!xen_vm_get_by_uuid(session_, &new_vm2, (char*)vm_uuid.c_str())) {
-             xen_vdi_record_free(vdi0_record);
-            std::cout << "Failed to get vm by " << vm_uuid << std::endl;
+        // a disk of a running vm is attached once it is complete, a disk
+        // without vm is left unattached
+        if (!plug && !vm_uuid.empty() && !create_vbd(vm_uuid, vdi_ref, vb, vbd_ref))
             return false;
-        }
+    }
 
-        xen_vm_record_opt* vm_record_opt = xen_vm_record_opt_alloc();
-        vm_record_opt->is_record = false;
-        vm_record_opt->u.handle = new_vm2;
-
-        xen_vdi_record_opt* vdi0_record_opt = xen_vdi_record_opt_alloc();
-        vdi0_record_opt->is_record = false;
-        vdi0_record_opt->u.handle = vdi0;
-
-        xen_string_string_map* qos_algorithm_params = xen_string_string_map_alloc(0);
-        xen_string_string_map* vbd_other_config = xen_string_string_map_alloc(0);
-        xen_vbd_record *vbd0_record = xen_vbd_record_alloc();
-        vbd0_record->vm = vm_record_opt;
-        vbd0_record->vdi = vdi0_record_opt;
-        vbd0_record->userdevice = strdup(vb.userdevice.c_str());
-        vbd0_record->device = strdup(vb.device.c_str());
-        vbd0_record->type = vbd_type_disk;
-        vbd0_record->mode = XEN_VBD_MODE_RW;
-        vbd0_record->qos_algorithm_params = qos_algorithm_params;
-        vbd0_record->other_config = vbd_other_config;
-        vbd0_record->bootable = true;
-
-        xen_vbd vbd0 = nullptr;
-        if (!xen_vbd_create(session_, &vbd0, vbd0_record)) {
-            std::cout << "Failed to create vbd0" << std::endl;
-            xen_vbd_record_free(vbd0_record);
+    // one vhd with the newest copy of every block, nothing is sent twice
+    Vhd_Chain vhds;
+    if (!open_chain(storage_dir, chain, metas, vb.userdevice, vhds)
+        || !upload_vdi(vdi_ref, vhds, vb.vdi.uuid, "")) {
+        std::cout << "Failed to import vdi " << vb.vdi.uuid << std::endl;
+        return false;
+    }
+
+    if (plug && !vm_uuid.empty()) {
+        std::lock_guard<std::mutex> lock(session_mutex_);
+        if (!create_vbd(vm_uuid, vdi_ref, vb, vbd_ref))
             return false;
-        }
 
-        xen_task task = nullptr;
-        std::string task_name("import_raw_vdi");
-        if (!xen_task_create(session_, &task, (char*)task_name.c_str(),
-                             const_cast<char *>("task"))) {
-            std::cout << "Failed to create task" << std::endl;
-            xen_vbd_record_free(vbd0_record);
+        if (!xen_vbd_plug(session_, (xen_vbd)vbd_ref.c_str())) {
+            std::cout << "Failed to plug vbd of userdevice " << vb.userdevice << std::endl;
+            xen_session_clear_error(session_);
             return false;
         }
+        std::cout << "plugged userdevice " << vb.userdevice << " into vm " << vm_uuid << std::endl;
+    }
+
+    return true;
+}
+
+bool Xe_Client::restore_vdi(const std::string& storage_dir,
+                            const std::vector<struct backup_set>& chain,
+                            const std::vector<struct vm>& metas,
+                            const std::string& sr_uuid,
+                            const std::string& vm_uuid,
+                            std::vector<struct vbd>& vbds,
+                            bool plug)
+{
+    struct import_job {
+        const struct vbd* vb;
+        std::string vdi;    // what was created, for the rollback
+        std::string vbd;
+        bool done;
+    };
+
+    std::vector<struct import_job> jobs;
+    for (const auto& vb : vbds)
+        jobs.push_back({&vb, "", "", false});
+
+    if (jobs.empty())
+        return true;
 
-        std::string url = import_url(task, (char*)vdi0);
+    // every vdi is created and imported on its own, at most restore_parallel in flight
+    std::atomic<size_t> next(0);
+    std::atomic<bool> failed(false);
+    const size_t n = std::min(jobs.size(), (size_t)std::max(1, opts_.restore_parallel));
+    std::cout << "import " << jobs.size() << " vdis, parallel: " << n << std::endl;
+
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < n; i++) {
+        workers.emplace_back([&]() {
+            for (;;) {
+                const size_t k = next++;
+                if (k >= jobs.size() || failed)
+                    break;
+
+                auto& job = jobs[k];
+                job.done = import_vdi(storage_dir, chain, metas, sr_uuid, vm_uuid, *job.vb, plug, job.vdi, job.vbd);
+                if (!job.done)
+                    failed = true;
+            }
+        });
+    }
 
-        std::filesystem::path file(storage_dir);
-        file /= (set_id + "/" + vb.vdi.uuid + ".vhd");
-        std::thread t(&Xe_Client::http_upload, this, url, file.string());
-        progress(task);
+    for (auto& t : workers)
         t.join();
 
-        xen_vbd_record_free(vbd0_record);
+    if (!failed)
+        return true;
+
+    // never leave half imported disks behind. Disks already plugged into a
+    // running vm may be in use by the guest, those stay.
+    std::lock_guard<std::mutex> lock(session_mutex_);
+    for (const auto& job : jobs) {
+        if (plug && job.done)
+            continue;
+
+        if (plug)
+            std::cout << "Missing userdevice " << job.vb->userdevice << " of vm " << vm_uuid << std::endl;
+
+        if (!job.vbd.empty() && plug && !xen_vbd_unplug(session_, (xen_vbd)job.vbd.c_str()))
+            xen_session_clear_error(session_);
+
+        if (!job.vbd.empty() && !xen_vbd_destroy(session_, (xen_vbd)job.vbd.c_str())) {
+            std::cout << "Failed to destroy vbd " << job.vbd << std::endl;
+            xen_session_clear_error(session_);
+        }
+
+        if (!job.vdi.empty() && !xen_vdi_destroy(session_, (xen_vdi)job.vdi.c_str())) {
+            std::cout << "Failed to destroy vdi " << job.vdi << std::endl;
+            xen_session_clear_error(session_);
+        }
     }
 
-    return true;
+    return false;
 }
 
 bool Xe_Client::restore_vm_full(const std::string& storage_dir,
-                                const std::string& set_id,
-                                std::string& vm_uuid)
+                                const std::vector<struct backup_set>& chain,
+                                const std::vector<struct vm>& metas,
+                                std::string& vm_uuid,
+                                const struct restore_target* target)
 {
     // choose storage
-    std::vector<struct sr> ss;
-    srs(ss);
-    std::cout << "Select Storage: " << std::endl;
-    for (int i = 0; i < ss.size(); i++) {
-        std::cout << i << ": " << "type " << ss[i].type << ", name_label: " << ss[i].name_label << std::endl;
-    }
     std::string sr_uuid;
     std::string input;
-    std::getline(std::cin, input);
-    try {
-        const int n = std::stoi(input);
-        sr_uuid = ss.at(n).uuid;
-        std::cout << "Selected Storage: " <<  sr_uuid << " " << ss.at(n).name_label << std::endl;
-    } catch (std::exception& e) {
-        std::cout << "Invalid input: " << e.what() << std::endl;
-        return false;
+    if (target) {
+        sr_uuid = target->sr_uuid;
+        std::cout << "Selected Storage: " << sr_uuid << std::endl;
+    } else {
+        std::vector<struct sr> ss;
+        srs(ss);
+        std::cout << "Select Storage: " << std::endl;
+        for (int i = 0; i < ss.size(); i++) {
+            std::cout << i << ": " << "type " << ss[i].type << ", name_label: " << ss[i].name_label << std::endl;
+        }
+        std::getline(std::cin, input);
+        try {
+            const int n = std::stoi(input);
+            sr_uuid = ss.at(n).uuid;
+            std::cout << "Selected Storage: " <<  sr_uuid << " " << ss.at(n).name_label << std::endl;
+        } catch (std::exception& e) {
+            std::cout << "Invalid input: " << e.what() << std::endl;
+            return false;
+        }
     }
 
+    // the vm as of the newest set
     bool template_flag = false;
     std::string new_vm_uuid;
     struct vm v;
-    if (!create_new_vm(storage_dir, set_id, new_vm_uuid, v, template_flag)) {
+    if (!create_new_vm(storage_dir, chain.back().vm_name, new_vm_uuid, v, template_flag)) {
         std::cout << "Failed to create new vm" << std::endl;
         return false;
     }
 
-    if (!restore_vdi(storage_dir, set_id, sr_uuid, new_vm_uuid, v.vbds)) {
+    // with boot_first the vm is started once its boot disks are in, the
+    // data disks are plugged into it as they complete
+    std::vector<struct vbd> boot;
+    std::vector<struct vbd> data;
+    for (const auto& vb : v.vbds) {
+        if (opts_.boot_first && !vb.bootable)
+            data.push_back(vb);
+        else
+            boot.push_back(vb);
+    }
+
+    if (boot.empty())
+        boot.swap(data);
+
+    if (!restore_vdi(storage_dir, chain, metas, sr_uuid, new_vm_uuid, boot)) {
         std::cout << "Failed to restore vdi" << std::endl;
+        xen_vm new_vm = nullptr;
+        if (xen_vm_get_by_uuid(session_, &new_vm, (char*)new_vm_uuid.c_str())) {
+            if (!xen_vm_destroy(session_, new_vm))
+                std::cout << "Failed to destroy vm " << new_vm_uuid << std::endl;
+            xen_vm_free(new_vm);
+        }
+        xen_session_clear_error(session_);
         return false;
     }
 
+    // the disks are in, a vm failing after that goes with its vdis
+    auto rollback = [this, &new_vm_uuid]() {
+        xen_vm new_vm = nullptr;
+        if (!xen_vm_get_by_uuid(session_, &new_vm, (char*)new_vm_uuid.c_str())) {
+            xen_session_clear_error(session_);
+            return;
+        }
+
+        if (!delete_snapshot(new_vm)) {
+            std::cout << "Failed to destroy vm " << new_vm_uuid << std::endl;
+            xen_session_clear_error(session_);
+        }
+        xen_vm_free(new_vm);
+    };
+
     std::string network_uuid;
     std::vector<struct network> ns;
-    networks(ns);
+    if (!target)
+        networks(ns);
     for (const auto& vif : v.vifs) {
         std::cout << "restore vif " << vif.device << std::endl;
+        if (target) {
+            // unmapped networks are kept, e.g. when restoring into the same pool
+            auto it = target->networks.find(vif.network.uuid);
+            network_uuid = it != target->networks.end() ? it->second : vif.network.uuid;
+            std::cout << "Mapped Network " << vif.network.uuid << " to " << network_uuid << std::endl;
+            if (!restore_vif(new_vm_uuid, network_uuid, vif)) {
+                std::cout << "Failed to restore vif" << std::endl;
+                rollback();
+                return false;
+            }
+            continue;
+        }
+
         // select network
         std::cout << "Select Network: " << std::endl;
         for (int i = 0; i < ns.size(); i++) {
@@ -1997,11 +3285,13 @@ bool Xe_Client::restore_vm_full(const std::string& storage_dir,
                       << ns.at(n).name_label << ", bridge: " << ns.at(n).bridge << std::endl;
         } catch (std::exception& e) {
             std::cout << "Invalid input: " << e.what() << std::endl;
+            rollback();
             return false;
         }
 
         if (!restore_vif(new_vm_uuid, network_uuid, vif)) {
             std::cout << "Failed to restore vif" << std::endl;
+            rollback();
             return false;
         }
     }
@@ -2020,6 +3310,28 @@ bool Xe_Client::restore_vm_full(const std::string& storage_dir,
     }
     vm_uuid = std::move(new_vm_uuid);
 
+    if (data.empty())
+        return true;
+
+    bool started = false;
+    xen_vm new_vm = nullptr;
+    if (xen_vm_get_by_uuid(session_, &new_vm, (char*)vm_uuid.c_str())) {
+        started = xen_vm_start(session_, new_vm, false, false);
+        xen_vm_free(new_vm);
+    }
+
+    if (started) {
+        std::cout << "Started vm " << vm_uuid << ", " << data.size() << " data disks follow" << std::endl;
+    } else {
+        std::cout << "Failed to start vm " << vm_uuid << ", restore data disks unplugged" << std::endl;
+        xen_session_clear_error(session_);
+    }
+
+    if (!restore_vdi(storage_dir, chain, metas, sr_uuid, vm_uuid, data, started)) {
+        std::cout << "Failed to restore data disks of vm " << vm_uuid << std::endl;
+        return false;
+    }
+
     return true;
 }
 
@@ -2040,67 +3352,152 @@ std::string Xe_Client::find_basevdi_by_userdevice(const struct vm& v, const std:
 
 bool Xe_Client::delete_snapshot(xen_vm vm)
 {
-    xen_vbd_set *vbd_set = nullptr;
-    if (!xen_vm_get_vbds(session_, &vbd_set, vm)) {
-        std::cout << "Failed to get vbds of snapshot" << std::endl;
-    }
-
-    if (!vbd_set) {
-        std::cout << "vbd_set is null" << std::endl;
-        return false;
-    }
+    // the disks first, then the vm, the destroys of a step run at once
+    std::vector<std::string> vbds;
+    std::vector<std::string> vdis;
+    {
+        std::lock_guard<std::mutex> lock(session_mutex_);
+        xen_vbd_set *vbd_set = nullptr;
+        if (!xen_vm_get_vbds(session_, &vbd_set, vm)) {
+            std::cout << "Failed to get vbds of snapshot" << std::endl;
+        }
 
-    for (int i = 0; i < vbd_set->size; ++i) {
-        xen_vbd vbd = vbd_set->contents[i];
-        xen_vbd_record *vbd_record = nullptr;
-        if (!xen_vbd_get_record(session_, &vbd_record, vbd)) {
-            print_error(session_);
-            std::cout << "Failed to get vbd record" << std::endl;
-            xen_vbd_set_free(vbd_set);
+        if (!vbd_set) {
+            std::cout << "vbd_set is null" << std::endl;
             return false;
         }
 
-        if (vbd_record->type != XEN_VBD_TYPE_DISK) {
+        auto vs = make_deleter(vbd_set, [](xen_vbd_set* s) {
+            xen_vbd_set_free(s);
+        });
+
+        for (int i = 0; i < vbd_set->size; ++i) {
+            xen_vbd vbd = vbd_set->contents[i];
+            xen_vbd_record *vbd_record = nullptr;
+            if (!xen_vbd_get_record(session_, &vbd_record, vbd)) {
+                print_error(session_);
+                std::cout << "Failed to get vbd record" << std::endl;
+                return false;
+            }
+
+            if (vbd_record->type != XEN_VBD_TYPE_DISK) {
+                xen_vbd_record_free(vbd_record);
+                continue;
+            }
             xen_vbd_record_free(vbd_record);
-            continue;
-        }
-        xen_vbd_record_free(vbd_record);
 
-        xen_vdi vdi = nullptr;
-        if (!xen_vbd_get_vdi(session_, &vdi, vbd)) {
-            std::cout << "Failed to get vdi by vbd" << std::endl;
-            xen_vbd_set_free(vbd_set);
-            return false;
+            xen_vdi vdi = nullptr;
+            if (!xen_vbd_get_vdi(session_, &vdi, vbd)) {
+                std::cout << "Failed to get vdi by vbd" << std::endl;
+                return false;
+            }
+
+            if (!vdi) {
+                std::cout << "vdi is null" << std::endl;
+                return false;
+            }
+
+            vbds.push_back((char *)vbd);
+            vdis.push_back((char *)vdi);
+            xen_vdi_free(vdi);
         }
+    }
 
-        if (!vdi) {
-            std::cout << "vdi is null" << std::endl;
-            xen_vbd_set_free(vbd_set);
-            return false;
+    if (!run_tasks(vbds, [this](xen_task* task, const std::string& ref) {
+            return xen_vbd_destroy_async(session_, task, (xen_vbd)ref.c_str());
+        }, "destroy vbd"))
+        return false;
+
+    if (!run_tasks(vdis, [this](xen_task* task, const std::string& ref) {
+            return xen_vdi_destroy_async(session_, task, (xen_vdi)ref.c_str());
+        }, "destroy vdi"))
+        return false;
+
+    if (!run_tasks({(char *)vm}, [this](xen_task* task, const std::string& ref) {
+            return xen_vm_destroy_async(session_, task, (xen_vm)ref.c_str());
+        }, "destroy snapshot"))
+        return false;
+
+    return true;
+}
+
+void Xe_Client::drop_snapshot(xen_vm vm)
+{
+    if (!Snapshot_Queue::get()->reap((char *)vm))
+        delete_snapshot(vm);
+}
+
+bool Xe_Client::start_control(const std::vector<std::string>& vm_uuids)
+{
+    auto queue = Snapshot_Queue::get();
+    queue->open();
+
+    // all snapshot tasks are started before the first is waited for, so
+    // xenserver takes them side by side
+    std::vector<std::pair<std::string, xen_task>> tasks;
+    for (const auto& vm_uuid : opts_.snapshot_ahead ? vm_uuids : std::vector<std::string>()) {
+        xen_vm vm = nullptr;
+        if (!xen_vm_get_by_uuid(session_, &vm, (char *)vm_uuid.c_str())) {
+            std::cout << "Failed to get vm by uuid: " << vm_uuid << std::endl;
+            xen_session_clear_error(session_);
+            continue;
         }
 
-        if (!xen_vbd_destroy(session_, vbd)) {
-            std::cout << "Failed to destroy vbd" << std::endl;
-            xen_vdi_free(vdi);
-            xen_vbd_set_free(vbd_set);
-            return false;
+        // cbt has to be on before the snapshot, so the next export can use it
+        if (opts_.cbt) {
+            struct vm live;
+            if (!get_vm(vm, live) || !enable_cbt(live))
+                std::cout << "Failed to enable cbt on the disks of vm: " << vm_uuid << std::endl;
         }
 
-        if (!xen_vdi_destroy(session_, vdi)) {
-            std::cout << "Failed to destroy vdi" << std::endl;
-            xen_vdi_free(vdi);
-            xen_vbd_set_free(vbd_set);
-            return false;
+        const std::string name = vm_uuid + "_" + current_time_str();
+        xen_task task = nullptr;
+        const bool started = xen_vm_snapshot_async(session_, &task, vm, (char *)name.c_str());
+        xen_vm_free(vm);
+        if (!started) {
+            print_error(session_, (char*)("Failed to start snapshot"));
+            xen_session_clear_error(session_);
+            continue;
         }
 
-        xen_vdi_free(vdi);
+        std::cout << "snapshot ahead: " << name << std::endl;
+        queue->expect(vm_uuid, name);
+        tasks.emplace_back(vm_uuid, task);
     }
 
-    if (!xen_vm_destroy(session_, vm)) {
-        std::cout << "Failed to destroy snapshot" << std::endl;
-        return false;
+    ahead_thread_ = std::thread([this, tasks, queue]() {
+        for (const auto& t : tasks) {
+            std::string ref;
+            if (!wait_task(t.second, false, &ref))
+                ref.clear();
+            xen_task_free(t.second);
+            queue->taken(t.first, ref);
+        }
+    });
+
+    for (int i = 0; i < std::max(1, opts_.jobs); i++) {
+        reapers_.emplace_back([this, queue]() {
+            std::string ref;
+            while (queue->next(ref)) {
+                if (!delete_snapshot((xen_vm)ref.c_str()))
+                    std::cout << "Failed to delete snapshot " << ref << std::endl;
+            }
+        });
     }
 
-    xen_vbd_set_free(vbd_set);
     return true;
 }
+
+void Xe_Client::stop_control()
+{
+    if (ahead_thread_.joinable())
+        ahead_thread_.join();
+
+    if (reapers_.empty())
+        return;
+
+    Snapshot_Queue::get()->close();
+    for (auto& t : reapers_)
+        t.join();
+    reapers_.clear();
+}
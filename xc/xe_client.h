@@ -8,6 +8,23 @@ extern "C"
 #include <string>
 #include <vector>
 #include <map>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include "scheduler.h"
+#include "throttle.h"
+#include "stripe.h"
+#include <thread>
+#include <functional>
+
+class Rpc_Pool;
+class Task_Waiter;
+class Catalog;
+class Download_Pipeline;
+struct transfer_journal;
+class Source;
+class Vhd_Chain;
+class Transfer_Engine;
 
 struct network {
     std::string uuid;
@@ -36,6 +53,8 @@ struct vdi {
     int type;
     bool sharable;
     bool read_only;
+    std::string sr_uuid;
+    std::string checksum;       // xxh64 of the exported vhd stream
 };
 
 struct vbd {
@@ -87,17 +106,27 @@ struct vm {
 
     std::vector<struct vbd> vbds;
     std::vector<struct vif> vifs;
-    std::string host_uuid;
+    std::vector<std::string> tags;
+    std::string host_uuid;          // resident_on
+    std::string affinity_uuid;
 };
 
 struct backup_set {
     std::string vm_name;
     std::string vm_uuid;
     std::string date;
-    std::string type;     // full or diff
+    std::string type;     // full, diff or incr
+    std::string parent;   // set this one was exported against, empty for full
+    bool synthetic = false; // full merged offline from a chain by synth
     struct vm vm;
 };
 
+// where restore puts a vm instead of asking on stdin
+struct restore_target {
+    std::string sr_uuid;
+    std::map<std::string, std::string> networks;   // source network uuid -> target
+};
+
 struct host {
     std::string uuid;
     std::string host;
@@ -114,10 +143,41 @@ struct sr {
     int64_t physical_size;
 };
 
+struct options {
+    int vdi_parallel = 4;       // max concurrent vdi exports per vm
+    int restore_parallel = 4;   // max concurrent vdi imports per vm
+    bool boot_first = false;    // start a restored vm before its data disks are in
+    int jobs = 4;               // max concurrent vms in batch mode
+    int per_host = 2;           // max concurrent vms per xenserver host
+    int per_sr = 2;             // max concurrent vms per sr
+    int rpc_pool_size = 8;      // max xml-rpc connections per xenserver
+    int rpc_idle_timeout = 60;  // seconds before an idle connection is dropped
+    bool rpc_tls_session_reuse = true;
+    int buffer_mb = 4;          // size of one download pipeline buffer
+    int buffers = 8;            // buffers per download pipeline
+    bool sparse = true;         // do not write all zero blocks of raw vdis
+    bool compress = false;      // store vdis as seekable zstd
+    int compress_level = 3;
+    int compress_threads = 4;   // compression threads per download
+    bool dedup = false;         // store vdis in the deduplicated chunk store
+    int chunk_kb = 64;          // average dedup chunk size
+    bool cbt = false;           // diff and incr fetch only changed blocks over nbd
+    int probe_mb = 16;          // read over every pif of a host to find its fastest, 0 takes the first
+    bool snapshot_ahead = true; // batch backups snapshot all their vms at once up front
+    int retries = 3;            // new attempts of a vdi transfer that broke off
+    bool resume = true;         // keep failed sets and journals to continue them
+    int journal_mb = 256;       // raw downloads are journaled every that many mb
+    int segment_mb = 4096;      // uploads are imported in segments of that many mb
+    int transfer_threads = 2;   // event loops running every vdi transfer of the process
+    struct throttle_limits throttle;                // bandwidth of all vdi transfers
+    std::vector<struct throttle_window> throttle_schedule;  // other limits by time of day
+};
+
 class Xe_Client
 {
 public:
-    Xe_Client(std::string host, std::string user, std::string pass);
+    Xe_Client(std::string host, std::string user, std::string pass,
+              struct options opts = options());
     ~Xe_Client();
 
     bool connect();
@@ -129,11 +189,39 @@ public:
 
     bool backup_vm(const std::string &vm_uuid, const std::string &backup_dir);
     bool backup_vm_diff(const std::string &backup_dir, const std::string &vm_uuid);
-
+    // exports only what changed since the newest full or incr set of the vm
+    bool backup_vm_incr(const std::string &backup_dir, const std::string &vm_uuid);
+    // merges the newest chain of the vm into a new full set, offline
+    bool synth_vm(const std::string &backup_dir, const std::string &vm_uuid);
+
+    // plan one job per vm, tag empty means every vm
+    bool backup_jobs(const std::string& tag, std::vector<struct job>& jobs);
+    int64_t bytes_transferred() const { return transferred_; }
+    // makes this client the control client of a batch: it snapshots the vms
+    // up front and deletes the snapshots the workers drop, until stop_control
+    bool start_control(const std::vector<std::string>& vm_uuids);
+    void stop_control();
+
+    // target null prompts for the sr and networks
     bool restore_vm(const std::string& storage_dir,
-                    const std::string& set_id);
+                    const std::string& set_id,
+                    const struct restore_target* target = nullptr);
+    // restores only the disks at userdevices, into new unattached vdis on sr
+    bool restore_disks(const std::string& storage_dir,
+                       const std::string& set_id,
+                       const std::vector<std::string>& userdevices,
+                       const std::string& sr_uuid);
+    // overwrites an existing, unattached vdi with the disk at userdevice
+    bool restore_disk_in_place(const std::string& storage_dir,
+                               const std::string& set_id,
+                               const std::string& userdevice,
+                               const std::string& vdi_uuid);
+    // fills name of jobs whose id is a set id, false if a set is unknown
+    bool restore_jobs(const std::string& storage_dir, std::vector<struct job>& jobs);
 
     bool rm_backupset(const std::string& backup_dir, const std::string& set_id);
+    // checks the vhd structure and checksum of every vdi of a set, offline
+    bool verify_backupset(const std::string& backup_dir, const std::string& set_id);
 private:
     xen_session* get_session() const { return session_; }
 
@@ -142,17 +230,36 @@ private:
     bool vms(std::vector<struct vm>& vms);
     bool srs(std::vector<struct sr>& srs);
     bool networks(std::vector<struct network>& networks);
-    bool hosts(std::map<std::string, struct host> &host);
     bool pifs(std::vector<std::string>& pifs, xen_host host);
 
     bool write_to_json();
     bool backupset_list(std::vector<struct backup_set>& bsets);
 
     bool restore_vdi(const std::string& storage_dir,
-                     const std::string& set_id,
+                     const std::vector<struct backup_set>& chain,
+                     const std::vector<struct vm>& metas,
                      const std::string& sr_uuid,
                      const std::string& vm_uuid,
-                     std::vector<struct vbd>& vbds);
+                     std::vector<struct vbd>& vbds,
+                     bool plug = false);
+
+    // creates a vdi on sr and attaches it to the vm at vb.userdevice, then
+    // uploads the disk. With plug the vbd is only created and plugged after
+    // the upload, for a running vm. vdi_ref and vbd_ref are set once created.
+    bool import_vdi(const std::string& storage_dir,
+                    const std::vector<struct backup_set>& chain,
+                    const std::vector<struct vm>& metas,
+                    const std::string& sr_uuid,
+                    const std::string& vm_uuid,
+                    const struct vbd& vb,
+                    bool plug,
+                    std::string& vdi_ref,
+                    std::string& vbd_ref);
+    // session_mutex_ must be held
+    bool create_vbd(const std::string& vm_uuid,
+                    const std::string& vdi_ref,
+                    const struct vbd& vb,
+                    std::string& vbd_ref);
 
     bool restore_vif(const std::string& vm_uuid,
                      const std::string& network_uuid,
@@ -165,7 +272,14 @@ private:
                            const std::string& base);
     bool get_vifs(xen_vm x_vm, std::vector<struct vif>& vifs);
     std::string import_url(xen_task task, const std::string& vdi);
-    void progress(xen_task task);
+    // wait for a task to finish and destroy it, true if it succeeded
+    // ref is set to the object a successful task returned
+    bool wait_task(xen_task task, bool cancel = false, std::string* ref = nullptr);
+    // starts a task for every ref at once and waits for all of them
+    bool run_tasks(const std::vector<std::string>& refs,
+                   const std::function<bool(xen_task*, const std::string&)>& start,
+                   const std::string& what);
+    bool snapshot(xen_vm vm, const std::string& name, xen_vm& snap);
     bool load_vm_meta(const std::string& file, struct vm &vm);
 
     bool backup_vm_i(const std::string &vm_uuid,
@@ -174,15 +288,77 @@ private:
                      const std::string& backup_type,
                      const struct vm& full_v);
 
-    void http_download(const std::string &url, const std::string &file);
-    void http_upload(const std::string &url, const std::string &file);
-
+    // ips of the host that serves the disks of snapshot v best, null if it
+    // has none. hosts are the fallbacks when no local sr pins the disks.
+    std::shared_ptr<Stripe> host_stripe(const struct vm& v, const std::vector<std::string>& hosts);
+    // host of a local sr, false for shared ones
+    bool sr_host(const std::string& sr_uuid, std::string& host_uuid);
+    bool probe_path(const std::string& ip, const std::string& vdi_ref, struct host_path& path);
+
+    bool export_vdi(Stripe& stripe,
+                    struct vbd& vb,
+                    const std::string& basevdi,
+                    const std::string& file);
+
+    // exports only the blocks changed since basevdi, read over nbd
+    bool export_vdi_cbt(struct vbd& vb, const std::string& basevdi, const std::string& file);
+    bool enable_cbt(const struct vm& v);
+    bool has_cbt(const std::string& vdi);
+    // stores a raw vhd stream in file like a download, journaled continues
+    // the journal of file
+    bool store_source(Source& source, const std::string& file, std::string& checksum,
+                      bool journaled = false);
+
+    // continues the stream at pipeline.bytes(). head is the start of the
+    // stream, kept to check a server that sends it again; changed is set
+    // if the stream is not the one the pipeline has. With move the stream
+    // is dropped, and move->moved set, once another link is much faster.
+    bool http_download(const std::string &url, Download_Pipeline& pipeline,
+                       const std::string& name, std::string& head, bool& changed,
+                       struct stripe_stream* move = nullptr);
+    // name is only used in messages
+    bool http_upload(const std::string &url, Source& source, const std::string& name);
+    // imports vhds into the vdi segment by segment, a broken off segment is
+    // sent again. journal, if not empty, records the segments imported.
+    bool upload_vdi(const std::string& vdi_ref, Vhd_Chain& vhds,
+                    const std::string& name, const std::string& journal);
+
+    // where a vdi of a set is written, in the configured storage format
+    std::string vdi_file(const std::string& dir, const std::string& vdi_uuid);
+    // pipeline that stores a raw vhd stream in file. journaled keeps a
+    // journal for raw files, from continues one.
+    std::unique_ptr<Download_Pipeline> new_pipeline(const std::string& file, bool journaled = false,
+                                                    const struct transfer_journal* from = nullptr);
+    // the unfinished set of a failed backup of vm_uuid of the same type and
+    // base, with its snapshot, stale ones are removed
+    bool resume_set(const std::string& backup_dir, const std::string& vm_uuid,
+                    const std::string& backup_type, const struct vm& full_v,
+                    std::string& snap_name, xen_vm& snap_handle);
+
+    // chain is a full set and the sets up to the one restored, metas
+    // their vm meta
     bool restore_vm_full(const std::string& storage_dir,
-                         const std::string& set_id,
-                         std::string& vm_uuid);
-    bool restore_vm_diff(const std::string& storage_dir,
-                         const std::string& set_id,
-                         const std::string& vm_uuid);
+                         const std::vector<struct backup_set>& chain,
+                         const std::vector<struct vm>& metas,
+                         std::string& vm_uuid,
+                         const struct restore_target* target);
+    // the chain of sets bset is restored from, oldest first
+    bool load_chain(const std::string& backup_dir, const struct backup_set& bset,
+                    std::vector<struct backup_set>& chain, std::vector<struct vm>& metas);
+    // the vhds of userdevice along the chain, merged into one
+    bool open_chain(const std::string& backup_dir,
+                    const std::vector<struct backup_set>& chain,
+                    const std::vector<struct vm>& metas,
+                    const std::string& userdevice,
+                    Vhd_Chain& vhds,
+                    bool all_blocks = false);
+    // the chain of set_id and the newest vbds at userdevices
+    bool select_disks(const std::string& storage_dir,
+                      const std::string& set_id,
+                      const std::vector<std::string>& userdevices,
+                      std::vector<struct backup_set>& chain,
+                      std::vector<struct vm>& metas,
+                      std::vector<struct vbd>& vbds);
 
     bool add_backup_set(const struct backup_set &bset);
     bool load_backup_sets(std::vector<struct backup_set>& bsets);
@@ -204,19 +380,37 @@ private:
     void dump_backupset(const struct backup_set& bset);
 
     std::string find_basevdi_by_userdevice(const struct vm& v, const std::string& userdevice);
-    void update_backup_set(const std::vector<struct backup_set>& bsets);
+    // newest set of one of types whose snapshot is still on xenserver
+    bool find_base_set(const std::string& backup_dir, const std::string& vm_uuid,
+                       const std::vector<std::string>& types,
+                       struct backup_set& bset, struct vm& v);
     bool delete_snapshot(xen_vm vm);
-
-    bool scan_pif(struct xen_pif_record_opt_set *pifs);
+    // deleted by the control client of a batch if there is one, else now
+    void drop_snapshot(xen_vm vm);
 private:
-    xen_session* session_;
+    xen_session* session_ = nullptr;
     std::string host_;
     std::string user_;
     std::string pass_;
+    struct options opts_;
+    std::shared_ptr<Rpc_Pool> rpc_;
+    xen_session* event_session_ = nullptr;
+    std::unique_ptr<Task_Waiter> waiter_;
+    std::shared_ptr<Catalog> catalog_;
+    std::shared_ptr<Transfer_Engine> engine_;
+    std::string job_;   // vm or set the transfers are throttled as
+
+    // xen_session is not thread safe, lock it when calling xapi from workers
+    std::mutex session_mutex_;
+    std::atomic<int64_t> transferred_{0};
 
     std::map<std::string, struct host> hosts_;
     std::vector<struct sr> srs_;
     std::vector<struct backup_set> backup_sets_;
+
+    // of a control client
+    std::thread ahead_thread_;
+    std::vector<std::thread> reapers_;
 };
 
 #endif // XE_CLIENT_
@@ -0,0 +1,87 @@
+#include "zero.h"
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ZERO_X86
+#endif
+
+static bool is_zero_scalar(const char* p, size_t len)
+{
+    while (len >= 32) {
+        uint64_t v[4];
+        memcpy(v, p, sizeof(v));
+        if (v[0] | v[1] | v[2] | v[3])
+            return false;
+        p += 32;
+        len -= 32;
+    }
+
+    while (len > 0) {
+        if (*p)
+            return false;
+        p++;
+        len--;
+    }
+
+    return true;
+}
+
+#ifdef ZERO_X86
+__attribute__((target("sse2")))
+static bool is_zero_sse2(const char* p, size_t len)
+{
+    while (len >= 64) {
+        const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16));
+        const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 32));
+        const __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 48));
+        const __m128i v = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xffff)
+            return false;
+        p += 64;
+        len -= 64;
+    }
+
+    return is_zero_scalar(p, len);
+}
+
+__attribute__((target("avx2")))
+static bool is_zero_avx2(const char* p, size_t len)
+{
+    while (len >= 128) {
+        const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 32));
+        const __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 64));
+        const __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 96));
+        const __m256i v = _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d));
+        if (!_mm256_testz_si256(v, v))
+            return false;
+        p += 128;
+        len -= 128;
+    }
+
+    return is_zero_sse2(p, len);
+}
+#endif
+
+typedef bool (*zero_func)(const char*, size_t);
+
+static zero_func pick()
+{
+#ifdef ZERO_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return is_zero_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return is_zero_sse2;
+#endif
+    return is_zero_scalar;
+}
+
+bool is_zero(const char* p, size_t len)
+{
+    static const zero_func f = pick();
+    return f(p, len);
+}
@@ -0,0 +1,13 @@
+#ifndef ZERO_
+#define ZERO_
+
+#include <cstddef>
+
+// granularity of sparse writes, the usual file system block size
+#define ZERO_BLOCK 4096
+
+// true if all len bytes are zero. Picks avx2 or sse2 at runtime when the
+// cpu has them, plain 64 bit compares otherwise.
+bool is_zero(const char* p, size_t len);
+
+#endif // ZERO_